@@ -40,7 +40,8 @@
 /*! \brief Could not resolve host.
  * 
  * The host name supplied for irc_connect() function could not be resolved
- * into valid IP address. Usually means that host name is invalid.
+ * into valid IP address. Usually means that host name is invalid. As the 
+ * name is resolved in the background, it may also be reported by irc_run().
  *
  * \ingroup errorcodes
  */
@@ -228,8 +229,35 @@
 #define LIBIRC_ERR_SSL_CERT_VERIFY_FAILED 20
 
 
+/*! \brief SASL authentication failed
+ * 
+ * The IRC server rejected the SASL credentials set with irc_set_sasl, does
+ * not support the mechanism, or does not support SASL at all.
+ * \ingroup errorcodes
+ */
+#define LIBIRC_ERR_SASL_FAILED		21
+
+
+/*! \brief Connecting to the server timed out
+ * 
+ * The server name was not resolved, or no connection to any of its addresses
+ * was made, within the time set with irc_set_connect_timeout.
+ * \ingroup errorcodes
+ */
+#define LIBIRC_ERR_CONNECT_TIMEOUT	22
+
+
+/*! \brief The registration timed out
+ * 
+ * The server did not accept the registration within the time set with
+ * irc_set_connect_timeout once connected.
+ * \ingroup errorcodes
+ */
+#define LIBIRC_ERR_REGISTER_TIMEOUT	23
+
+
 // Internal max error value count.
 // If you added more errors, add them to errors.c too!
-#define LIBIRC_ERR_MAX			21
+#define LIBIRC_ERR_MAX			24
 
 #endif /* INCLUDE_IRC_ERRORS_H */
@@ -376,7 +376,8 @@ typedef struct
 
 	/*!
 	 * The "dcc chat" event is triggered when someone wants to send a file 
-	 * to you via DCC SEND request.
+	 * to you via DCC SEND request, or via DCC SSEND request, in which case
+	 * the file is received over TLS (SDCC).
 	 *
 	 * See the params in ::irc_event_dcc_send_t specification.
 	 */
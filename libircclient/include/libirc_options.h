@@ -53,4 +53,21 @@
 #define LIBIRC_OPTION_SSL_NO_VERIFY	(1 << 3)
 
 
+/*! \brief Receives DCC files on a dedicated data thread.
+ *
+ * Once an accepted DCC file transfer is connected, it is handed over to a data
+ * thread with its own event loop, so that the IRC traffic and the file data do
+ * not delay each other. The data callback (\a status 0) is then invoked from 
+ * the data thread, which also sends the file offset acknowledgements. Errors 
+ * and the cb_close callback are still reported from the thread that drives the
+ * session. irc_dcc_destroy may be called from either thread. The data threads
+ * are those of the session's DCC pool (see irc_set_dcc_pool), or a single one
+ * of its own.
+ *
+ * This option has no effect unless libircclient is built with thread support.
+ * \ingroup options
+ */
+#define LIBIRC_OPTION_DCC_THREAD	(1 << 4)
+
+
 #endif /* INCLUDE_IRC_OPTIONS_H */
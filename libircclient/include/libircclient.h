@@ -66,11 +66,27 @@ typedef struct irc_session_s		irc_session_t;
  */
 typedef struct irc_dcc_session_s	irc_dcc_session_t;
 
+/*! \brief A set of local addresses to bind the connections to.
+ *
+ * A bind pool is created with irc_bind_pool_create, and may be shared by 
+ * several sessions. Its members are internal to libircclient.
+ */
+typedef struct irc_bind_pool_s		irc_bind_pool_t;
+
+/*! \brief A set of data threads that receive DCC files.
+ *
+ * A DCC pool is created with irc_dcc_pool_create, and may be shared by 
+ * several sessions. Its members are internal to libircclient.
+ */
+typedef struct irc_dcc_pool_s		irc_dcc_pool_t;
+
 
 /*! \brief A DCC session identifier.
  *
  * The irc_dcc_t type is a DCC session identifier, used to identify the
- * DCC sessions in callbacks and various functions.
+ * DCC sessions in callbacks and various functions. Looking a session up by
+ * its id takes constant time, and the id of a destroyed session stays 
+ * invalid even after its slot has been reused by a new session.
  */
 typedef unsigned int			irc_dcc_t;
 
@@ -124,6 +140,75 @@ typedef uint64_t			irc_dcc_size_t;
 typedef void (*irc_dcc_callback_t) (irc_session_t * session, irc_dcc_t id, int status, void * ctx);
 
 
+/*! \brief A timer identifier.
+ *
+ * The irc_timer_t type identifies a timer added with irc_timer_add. 
+ * Zero is never a valid timer identifier.
+ */
+typedef unsigned int			irc_timer_t;
+
+/*!
+ * \fn typedef void (*irc_timer_callback_t) (irc_session_t * session, irc_timer_t id, void * ctx)
+ * \brief A timer callback, called once the timer is due.
+ *
+ * \param session An IRC session which generates the callback
+ * \param id      The timer id, as returned by irc_timer_add.
+ * \param ctx     A user-supplied context.
+ *
+ * The timer is removed before the callback is invoked, so the callback may 
+ * add a new timer to run again later.
+ *
+ * \ingroup running
+ */
+typedef void (*irc_timer_callback_t) (irc_session_t * session, irc_timer_t id, void * ctx);
+
+
+/*! \brief The socket options of a session's connections.
+ *
+ * Passed to irc_set_socket_tuning. A zeroed structure keeps the system 
+ * defaults for everything.
+ *
+ * \ingroup conndisc
+ */
+typedef struct
+{
+	//! The receive buffer size in bytes (SO_RCVBUF), or 0 to keep the kernel's autotuning.
+	int				rcvbuf;
+
+	//! The congestion control algorithm (TCP_CONGESTION), such as "bbr", or NULL.
+	const char	*	congestion;
+
+	//! Acknowledge every segment right away (TCP_QUICKACK) instead of delaying the ACKs.
+	bool			quickack;
+
+	//! Send small writes, such as the DCC acknowledgements, without delay (TCP_NODELAY).
+	bool			nodelay;
+
+	//! Busy-poll the device queue for this many microseconds on blocking reads (SO_BUSY_POLL), or 0.
+	int				busy_poll;
+
+	//! DCC only: the receive watermark, see irc_set_dcc_rcvlowat.
+	unsigned int	rcvlowat;
+
+	//! Server only: send the registration along with the SYN (TCP Fast Open), once
+	//! the kernel holds a cookie of the server. Plain connections only; see irc_connect.
+	bool			fastopen;
+
+} irc_socket_tuning_t;
+
+//! Selects the IRC server connection in irc_set_socket_tuning.
+#define LIBIRC_TUNE_SERVER		0
+
+//! Selects the DCC connections in irc_set_socket_tuning.
+#define LIBIRC_TUNE_DCC			1
+
+//! A bind pool policy: the addresses are used in turn.
+#define LIBIRC_BIND_ROUND_ROBIN		0
+
+//! A bind pool policy: the address with the fewest connections is used.
+#define LIBIRC_BIND_LEAST_LOAD		1
+
+
 #define IN_INCLUDE_LIBIRC_H
 #include "libirc_errors.h"
 #include "libirc_events.h"
@@ -214,7 +299,22 @@ void irc_destroy_session (irc_session_t * session);
  * return value means that connection was initiated (but not completed!)
  * successfully.
  *
- * \sa irc_run
+ * A host name is resolved in the background if the library is built 
+ * thread-safe, into all of its IPv4 and IPv6 addresses. The addresses are 
+ * then raced: a connection attempt is started every 250 ms, alternating the
+ * address families, and the first attempt to complete is used, so a dead 
+ * address does not delay the connection by a full TCP timeout. A host name
+ * that does not resolve, or a server that none of the attempts could reach,
+ * is therefore reported later, as LIBIRC_ERR_RESOLV or LIBIRC_ERR_CONNECT
+ * from irc_run() or the descriptor processing functions.
+ *
+ * With the fastopen socket tuning (see irc_set_socket_tuning), the
+ * registration is sent along with the SYN to the address raced first, if
+ * the kernel holds a TCP Fast Open cookie of the server, saving a round
+ * trip. The cookie is obtained on the first connection to the server. SSL
+ * connections are not sped up this way.
+ *
+ * \sa irc_run irc_connect6
  * \ingroup conndisc
  */
 int irc_connect (irc_session_t * session, 
@@ -256,12 +356,10 @@ int irc_connect (irc_session_t * session,
  *  code may be obtained through irc_errno(). Any error, generated by the 
  *  IRC server, is available through irc_callbacks_t::event_numeric.
  *
- * This function prepares and initiates a connection to the IRC server. The
- * connection is done asynchronously (see irc_callbacks_t::event_connect), so the success 
- * return value means that connection was initiated (but not completed!)
- * successfully.
+ * This function works as irc_connect(), but only races the IPv6 addresses
+ * of the server.
  *
- * \sa irc_run
+ * \sa irc_run irc_connect
  * \ingroup conndisc
  */
 int irc_connect6 (irc_session_t * session, 
@@ -272,6 +370,45 @@ int irc_connect6 (irc_session_t * session,
 			const char * username,
 			const char * realname);
 
+//! No SASL authentication, for irc_set_sasl.
+#define LIBIRC_SASL_NONE		0
+
+//! SASL PLAIN: a user name and password, for irc_set_sasl.
+#define LIBIRC_SASL_PLAIN		1
+
+//! SASL EXTERNAL: the identity of the TLS client certificate set with
+//! irc_set_ssl_client_cert, for irc_set_sasl.
+#define LIBIRC_SASL_EXTERNAL		2
+
+/*!
+ * \fn int irc_set_sasl (irc_session_t * session, int mechanism, const char * username, const char * password)
+ * \brief Sets the SASL credentials to authenticate with when connecting.
+ *
+ * \param session   An initialized IRC session.
+ * \param mechanism LIBIRC_SASL_PLAIN, LIBIRC_SASL_EXTERNAL, or LIBIRC_SASL_NONE
+ *                  to stop authenticating.
+ * \param username  The account name; only used by LIBIRC_SASL_PLAIN.
+ * \param password  The account password; only used by LIBIRC_SASL_PLAIN.
+ *
+ * \return Return code 0 means success. Other value means error, the error 
+ *  code may be obtained through irc_errno().
+ *
+ * The connections made from now on request the \c sasl capability together
+ * with the registration, and authenticate before the registration completes,
+ * so the account is already identified when irc_callbacks_t::event_connect 
+ * is called. The strings are copied.
+ *
+ * If the server rejects the credentials or does not support SASL, the 
+ * connection fails with LIBIRC_ERR_SASL_FAILED rather than continuing
+ * unidentified. LIBIRC_SASL_EXTERNAL needs an SSL connection with a client 
+ * certificate, set with irc_set_ssl_client_cert.
+ *
+ * \sa irc_connect, irc_set_ssl_client_cert
+ * \ingroup conndisc
+ */
+int irc_set_sasl (irc_session_t * session, int mechanism, const char * username, const char * password);
+
+
 /*!
  * \fn void irc_disconnect (irc_session_t * session)
  * \brief Disconnects a connection to IRC server.
@@ -323,6 +460,9 @@ int irc_is_connected (irc_session_t * session);
  * generate it asynchronously). Even in last case, you still can call irc_run,
  * and start the asynchronous thread in event_connect handler. See examples. 
  *
+ * Between events the loop sleeps until the next timer is due (see 
+ * irc_timer_add), or indefinitely if there are none.
+ *
  * \ingroup running 
  */
 int irc_run (irc_session_t * session);
@@ -373,6 +513,276 @@ int irc_add_select_descriptors (irc_session_t * session, fd_set *in_set, fd_set
 int irc_process_select_descriptors (irc_session_t * session, fd_set *in_set, fd_set *out_set);
 
 
+/*! \brief The descriptor is waiting to become readable.
+ * \ingroup running
+ */
+#define LIBIRC_WATCH_READ		(1 << 0)
+
+/*! \brief The descriptor is waiting to become writable.
+ * \ingroup running
+ */
+#define LIBIRC_WATCH_WRITE		(1 << 1)
+
+/*!
+ * \fn typedef void (*irc_watch_callback_t) (irc_session_t * session, int fd, int events, void * ctx)
+ * \brief A callback, used to inform the host's event loop about a session's descriptors.
+ *
+ * \param session An IRC session which generates the callback
+ * \param fd      The descriptor.
+ * \param events  A combination of LIBIRC_WATCH_READ and LIBIRC_WATCH_WRITE;
+ *                may be zero, in which case the descriptor should stay registered
+ *                but not be polled for anything. Always zero for watch_remove.
+ * \param ctx     The ctx member of ::irc_watch_callbacks_t.
+ *
+ * \ingroup running
+ */
+typedef void (*irc_watch_callback_t) (irc_session_t * session, int fd, int events, void * ctx);
+
+/*! \brief The callbacks through which a session reports its descriptors.
+ *
+ * \ingroup running
+ */
+typedef struct
+{
+	//! A new descriptor should be polled for \a events. Must not be NULL.
+	irc_watch_callback_t	watch_add;
+
+	//! An already added descriptor should now be polled for \a events.
+	irc_watch_callback_t	watch_modify;
+
+	//! A descriptor should not be polled anymore. It may already be closed.
+	irc_watch_callback_t	watch_remove;
+
+	//! A user-supplied context passed to every callback.
+	void			* ctx;
+
+} irc_watch_callbacks_t;
+
+
+/*!
+ * \fn int irc_set_watch_callbacks (irc_session_t * session, const irc_watch_callbacks_t * callbacks)
+ * \brief Reports the session's descriptors to an external event loop.
+ *
+ * \param session   An initialized IRC session.
+ * \param callbacks The watch callbacks, or NULL to stop reporting.
+ *
+ * \return Return code 0 means success. Other value means error, the error 
+ *  code may be obtained through irc_errno().
+ *
+ * This function is an alternative to irc_add_select_descriptors for hosts that
+ * use epoll, kqueue, libevent or similar. Instead of filling descriptor sets
+ * on every iteration, the session tells the host which descriptors to poll
+ * and for which events, and only reports the changes: when a descriptor is 
+ * added (the IRC connection, a DCC connection), when the events it waits for 
+ * change, and when it goes away. Any descriptors the session already has are
+ * reported immediately. When a descriptor becomes ready, the host calls
+ * irc_process_descriptor.
+ *
+ * The callbacks are invoked from irc_connect, irc_process_descriptor, 
+ * irc_send_raw (and the irc_cmd_* functions), the irc_dcc_* functions and
+ * irc_disconnect; they must not call back into the session. When one of
+ * those is called from a DCC data thread (see #LIBIRC_OPTION_DCC_THREAD), the
+ * changes are reported from the next irc_process_descriptor instead, and the
+ * descriptor through which the data thread reports completions is made ready
+ * for it.
+ *
+ * \sa irc_process_descriptor
+ * \ingroup running
+ */
+int irc_set_watch_callbacks (irc_session_t * session, const irc_watch_callbacks_t * callbacks);
+
+
+/*!
+ * \fn int irc_process_descriptor (irc_session_t * session, int fd, int events)
+ * \brief Processes a single descriptor, reported by the watch callbacks, that has become ready.
+ *
+ * \param session An initiated and connected session.
+ * \param fd      The descriptor that is ready.
+ * \param events  A combination of LIBIRC_WATCH_READ and LIBIRC_WATCH_WRITE;
+ *                the events the descriptor is ready for.
+ *
+ * \return Return code 0 means success. Other value means error, the error 
+ *  code may be obtained through irc_errno(). As with irc_process_select_descriptors,
+ *  an error on the IRC server connection means the session is disconnected.
+ *
+ * Only the given descriptor is processed, so the cost of an event does not 
+ * depend on the number of descriptors the session has. Timers that are due
+ * are run here as well. Once the descriptor has been processed,
+ * the changes it caused are reported through the watch callbacks.
+ *
+ * \sa irc_set_watch_callbacks
+ * \ingroup running
+ */
+int irc_process_descriptor (irc_session_t * session, int fd, int events);
+
+
+/*!
+ * \fn irc_timer_t irc_timer_add (irc_session_t * session, unsigned int msec, irc_timer_callback_t callback, void * ctx)
+ * \brief Adds a one-shot timer to the session.
+ *
+ * \param session  An initialized IRC session.
+ * \param msec     The number of milliseconds after which the timer is due.
+ * \param callback The callback to invoke once the timer is due.
+ * \param ctx      A user-supplied context, passed to the callback.
+ *
+ * \return The timer id, or zero on error; the error code may be obtained 
+ *  through irc_errno().
+ *
+ * The callback is invoked from irc_run, irc_process_select_descriptors, 
+ * irc_process_descriptor or irc_process_timers, whichever is driving the 
+ * session. The session uses timers itself for the DCC connect timeout, 
+ * the keepalive and the connect timeouts.
+ *
+ * \sa irc_timer_cancel irc_next_timeout
+ * \ingroup running
+ */
+irc_timer_t irc_timer_add (irc_session_t * session, unsigned int msec, irc_timer_callback_t callback, void * ctx);
+
+
+/*!
+ * \fn int irc_timer_cancel (irc_session_t * session, irc_timer_t id)
+ * \brief Cancels a timer that is not due yet.
+ *
+ * \param session An initialized IRC session.
+ * \param id      The timer id, as returned by irc_timer_add.
+ *
+ * \return Return code 0 means the timer was cancelled, 1 means there is no
+ *  such timer (it has already run, or has been cancelled).
+ *
+ * \sa irc_timer_add
+ * \ingroup running
+ */
+int irc_timer_cancel (irc_session_t * session, irc_timer_t id);
+
+
+/*!
+ * \fn int irc_next_timeout (irc_session_t * session)
+ * \brief Returns how long the host's event loop may sleep.
+ *
+ * \param session An initialized IRC session.
+ *
+ * \return The number of milliseconds until the next timer is due, zero if
+ *  a timer is already due, or -1 if the session has no timers.
+ *
+ * Hosts that drive the session from their own event loop should use this 
+ * value as the timeout of select(), poll() or epoll_wait(), and call 
+ * irc_process_timers when it expires without any descriptor being ready.
+ *
+ * \sa irc_process_timers
+ * \ingroup running
+ */
+int irc_next_timeout (irc_session_t * session);
+
+
+/*!
+ * \fn int irc_process_timers (irc_session_t * session)
+ * \brief Runs the timers that are due.
+ *
+ * \param session An initialized IRC session.
+ *
+ * \return Return code 0 means success. Nonzero means a timer has disconnected
+ *  the session; the error code may be obtained through irc_errno().
+ *
+ * irc_process_select_descriptors and irc_process_descriptor run the due 
+ * timers themselves; this function is for when the timeout returned by 
+ * irc_next_timeout expires and there is nothing else to process.
+ *
+ * \sa irc_next_timeout
+ * \ingroup running
+ */
+int irc_process_timers (irc_session_t * session);
+
+
+/*!
+ * \fn void irc_set_keepalive (irc_session_t * session, unsigned int interval)
+ * \brief Enables the detection of dead server connections.
+ *
+ * \param session  An initialized IRC session.
+ * \param interval The keepalive interval in seconds, or zero to disable it.
+ *
+ * Once the server has been silent for \a interval seconds, a PING is sent.
+ * If it is still silent another \a interval seconds later, the session is 
+ * disconnected with LIBIRC_ERR_TIMEOUT. Disabled by default.
+ *
+ * \ingroup running
+ */
+void irc_set_keepalive (irc_session_t * session, unsigned int interval);
+
+
+/*!
+ * \fn void irc_set_connect_timeout (irc_session_t * session, unsigned int connect, unsigned int registration)
+ * \brief Bounds the time the connection to the server may take.
+ *
+ * \param session      An initialized IRC session.
+ * \param connect      The seconds from irc_connect until a connection to one
+ *                     of the server's addresses is made, including resolving
+ *                     its name, or zero for no limit.
+ * \param registration The seconds from then on until the server accepts the
+ *                     registration, including the SSL handshake and SASL, or
+ *                     zero for no limit.
+ *
+ * A connection that misses either deadline is dropped, and the session is
+ * disconnected with LIBIRC_ERR_CONNECT_TIMEOUT or LIBIRC_ERR_REGISTER_TIMEOUT
+ * respectively. Takes effect from the next irc_connect. Neither is limited by
+ * default, so only the system's TCP timeouts apply.
+ *
+ * \ingroup conndisc
+ */
+void irc_set_connect_timeout (irc_session_t * session, unsigned int connect, unsigned int registration);
+
+
+/*!
+ * \fn void irc_set_reconnect (irc_session_t * session, unsigned int delay, unsigned int max_delay)
+ * \brief Connects to the server again when the connection is lost.
+ *
+ * \param session   An initialized IRC session.
+ * \param delay     The seconds to wait before connecting again, or zero to 
+ *                  disable reconnecting.
+ * \param max_delay The longest wait. The delay doubles after every attempt
+ *                  that fails, until the server accepts a registration again.
+ *
+ * Once enabled, losing the connection to the server, or failing to connect
+ * or register again, does not end the session: the event loop functions do 
+ * not report it, irc_is_connected() keeps returning true, and the DCC 
+ * sessions keep running while the session waits and connects again with 
+ * the parameters given to irc_connect. The event_connect callback is invoked
+ * again once the server has accepted the new registration; the channels 
+ * have to be joined again from it. Nothing queued for the lost connection 
+ * is sent on the new one.
+ *
+ * The connection is not made again after irc_cmd_quit or irc_disconnect, 
+ * nor if it failed for a reason that would not go away, such as rejected 
+ * SASL credentials or an untrusted server certificate. Disabled by default.
+ *
+ * \ingroup conndisc
+ */
+void irc_set_reconnect (irc_session_t * session, unsigned int delay, unsigned int max_delay);
+
+
+/*!
+ * \fn void irc_set_flood_control (irc_session_t * session, unsigned int burst, unsigned int interval)
+ * \brief Paces the lines sent to the server, so that it does not drop the 
+ *        connection for flooding ("Excess Flood").
+ *
+ * \param session  An initialized IRC session.
+ * \param burst    The most lines sent at once, or zero to disable the pacing.
+ * \param interval The milliseconds after which another line may be sent.
+ *
+ * The lines are metered as the servers meter their clients, with a token 
+ * bucket: up to \a burst lines go at once, after which one line is sent 
+ * every \a interval milliseconds; the lines held back stay queued in the 
+ * session, which grows its outgoing buffer as needed. The lines that may 
+ * go are written with a single send. The registration is not metered, 
+ * and neither are QUIT and the PONG replies, which are also sent ahead of 
+ * the lines held back. 
+ * The typical limit of servers is a burst of 5 lines and one line every 
+ * 2000 milliseconds. Disabled by default.
+ *
+ * \ingroup conndisc
+ */
+void irc_set_flood_control (irc_session_t * session, unsigned int burst, unsigned int interval);
+
+
 /*!
  * \fn int irc_send_raw (irc_session_t * session, const char * format, ...)
  * \brief Sends raw data to the IRC server.
@@ -386,7 +796,8 @@ int irc_process_select_descriptors (irc_session_t * session, fd_set *in_set, fd_
  *
  * This function sends the raw data as-is to the IRC server. Use it to 
  * generate a server command, which is not (yet) provided by libircclient 
- * directly.
+ * directly. A line is truncated to the 510 bytes an IRC message leaves 
+ * for it before its CRLF.
  *
  * \ingroup ircmd_oth
  */
@@ -1108,6 +1519,12 @@ void irc_target_get_host (const char * target, char *nick, size_t size);
  * After the request is accepted, the supplied callback will be called,
  * and you can start sending messages or receiving the file.
  *
+ * A file offered with DCC SSEND (SDCC) is received over TLS. The sender's
+ * certificate is not verified, as SDCC senders use self-signed ones; where
+ * the kernel supports kTLS, the records are decrypted by the kernel. If the
+ * library is built without SSL support, accepting such an offer fails with
+ * LIBIRC_ERR_SSL_NOT_SUPPORTED.
+ *
  * This function should be called only after either event_dcc_chat_req or
  * event_dcc_send_req events are generated, and should react to them. It is
  * possible not to call irc_dcc_accept or irc_dcc_decline immediately in 
@@ -1141,10 +1558,56 @@ int	irc_dcc_accept (irc_session_t * session, irc_dcc_t dccid, void * ctx, irc_dc
  * This function should be called only during an active DCC session, but primarily
  * during the `cb_datum` callback that is supplied to irc_dcc_accept.
  *
+ * If the connection has been closed or has failed, the session is destroyed 
+ * once the callback returns, and the failure is reported through `cb_datum` 
+ * with a nonzero status.
+ *
  * \ingroup dccstuff
  */
 int irc_dcc_read (irc_session_t * session, irc_dcc_t dccid, char * buffer, size_t capacity);
 
+/*!
+ * \fn int irc_dcc_pause (irc_session_t * session, irc_dcc_t dccid)
+ * \brief Stops receiving DCC data until irc_dcc_resume is called.
+ *
+ * \param session An initiated and connected session.
+ * \param dccid   A DCC session ID, returned by appropriate callback.
+ *
+ * \return Return code 0 means success. Other value means error, the error 
+ *  code may be obtained through irc_errno().
+ *
+ * Meant to be called from `cb_datum`, when there is nowhere to put the data
+ * for now: the callback then returns without calling irc_dcc_read, and is not
+ * invoked again for data while the session is paused. The data is left in the
+ * socket, so TCP slows the sender down. File offset acknowledgements that are
+ * already due are still sent, and a failure is still reported.
+ *
+ * This function may be called from the DCC data thread.
+ *
+ * \sa irc_dcc_resume
+ * \ingroup dccstuff
+ */
+int irc_dcc_pause (irc_session_t * session, irc_dcc_t dccid);
+
+/*!
+ * \fn int irc_dcc_resume (irc_session_t * session, irc_dcc_t dccid)
+ * \brief Receives the DCC data of a session paused with irc_dcc_pause again.
+ *
+ * \param session An initiated and connected session.
+ * \param dccid   A DCC session ID, returned by appropriate callback.
+ *
+ * \return Return code 0 means success. Other value means error, the error 
+ *  code may be obtained through irc_errno().
+ *
+ * Must be called from the thread that drives the session, as the change is
+ * reported through the watch callbacks. The DCC data thread, if the session
+ * is on one, is woken up to poll the socket again.
+ *
+ * \sa irc_dcc_pause
+ * \ingroup dccstuff
+ */
+int irc_dcc_resume (irc_session_t * session, irc_dcc_t dccid);
+
 /*!
  * \fn int irc_dcc_decline (irc_session_t * session, irc_dcc_t dccid)
  * \brief Declines a remote DCC CHAT or DCC RECVFILE request.
@@ -1173,6 +1636,301 @@ int irc_dcc_read (irc_session_t * session, irc_dcc_t dccid, char * buffer, size_
 int irc_dcc_decline (irc_session_t * session, irc_dcc_t dccid);
 
 
+/*!
+ * \fn void irc_set_dcc_rcvlowat (irc_session_t * session, unsigned int bytes)
+ * \brief Sets the receive watermark of the DCC file transfers.
+ *
+ * \param session An initialized IRC session.
+ * \param bytes   The watermark in bytes, or zero to disable it (the default).
+ *
+ * The DCC sockets of transfers accepted from now on are only reported as 
+ * readable once \a bytes bytes have arrived (SO_RCVLOWAT), so on fast links
+ * each wakeup moves tens of kilobytes instead of a few hundred bytes. The 
+ * data callback is then invoked repeatedly until the queued data has been 
+ * drained. The watermark is capped to half the socket receive buffer, and is
+ * lowered as the end of the file approaches.
+ *
+ * A sender that waits for the file offset acknowledgements before sending 
+ * more than a window of data stalls if the watermark exceeds that window: the
+ * receiver then waits for data that never comes. Only enable it for senders 
+ * that keep the connection full.
+ *
+ * \ingroup dccstuff
+ */
+void irc_set_dcc_rcvlowat (irc_session_t * session, unsigned int bytes);
+
+
+/*!
+ * \fn irc_dcc_pool_t * irc_dcc_pool_create (unsigned int count, const int * cpus)
+ * \brief Creates a pool of data threads that receive DCC files.
+ *
+ * \param count The maximum number of data threads.
+ * \param cpus  An array of \a count CPU numbers to pin the data threads to,
+ *              or NULL. An entry of -1 leaves that thread unpinned.
+ *
+ * \return A new DCC pool, or 0 if \a count is 0 or out of memory.
+ *
+ * With LIBIRC_OPTION_DCC_THREAD set, every connected DCC file transfer of 
+ * the sessions sharing the pool is handed over to its least loaded data 
+ * thread, counted across all those sessions. A new thread is started, up to
+ * \a count, only when all the running ones are already busy, so transfers are
+ * spread across the threads and the aggregate throughput scales with the
+ * number of cores. Each thread has its own event loop and serves at most 128
+ * transfers; any further transfers stay on the thread that drives their 
+ * session. The callbacks are still invoked as described for 
+ * LIBIRC_OPTION_DCC_THREAD, whichever thread drives each session.
+ *
+ * The pool is freed, and its threads stopped, by irc_dcc_pool_destroy once 
+ * no session or transfer uses it any more. The CPU affinity is only 
+ * supported on Linux. Without thread support in libircclient, the pool 
+ * starts no threads.
+ *
+ * \sa irc_set_dcc_pool
+ * \ingroup dccstuff
+ */
+irc_dcc_pool_t * irc_dcc_pool_create (unsigned int count, const int * cpus);
+
+
+/*!
+ * \fn void irc_dcc_pool_destroy (irc_dcc_pool_t * pool)
+ * \brief Releases a DCC pool.
+ *
+ * \param pool A DCC pool created with irc_dcc_pool_create, or 0.
+ *
+ * The sessions the pool has been given to keep using it; it is freed once
+ * the last of them, and the last of their transfers, has released it.
+ *
+ * \ingroup dccstuff
+ */
+void irc_dcc_pool_destroy (irc_dcc_pool_t * pool);
+
+
+/*!
+ * \fn void irc_set_dcc_pool (irc_session_t * session, irc_dcc_pool_t * pool)
+ * \brief Receives the DCC files of a session on the threads of a pool.
+ *
+ * \param session An initialized IRC session.
+ * \param pool    A DCC pool, or 0 for the session to start a single data 
+ *                thread of its own when it first needs one.
+ *
+ * Only the transfers connected from now on are handed over to the new pool.
+ *
+ * \sa LIBIRC_OPTION_DCC_THREAD
+ * \ingroup dccstuff
+ */
+void irc_set_dcc_pool (irc_session_t * session, irc_dcc_pool_t * pool);
+
+
+/*!
+ * \fn int irc_set_dcc_threads (irc_session_t * session, unsigned int count, const int * cpus)
+ * \brief Gives a session a DCC pool of its own.
+ *
+ * \param session An initialized IRC session.
+ * \param count   The maximum number of data threads; 1 by default.
+ * \param cpus    An array of \a count CPU numbers to pin the data threads to,
+ *                or NULL. An entry of -1 leaves that thread unpinned.
+ *
+ * \return Return code 0 means success. Other value means error, the error 
+ *  code may be obtained through irc_errno().
+ *
+ * A shortcut for irc_dcc_pool_create and irc_set_dcc_pool, for a session 
+ * that shares its data threads with no other. 
+ *
+ * \sa irc_dcc_pool_create
+ * \ingroup dccstuff
+ */
+int irc_set_dcc_threads (irc_session_t * session, unsigned int count, const int * cpus);
+
+
+/*!
+ * \fn int irc_set_socket_tuning (irc_session_t * session, int target, const irc_socket_tuning_t * tuning)
+ * \brief Sets the socket options of the server or DCC connections.
+ *
+ * \param session An initialized IRC session.
+ * \param target  LIBIRC_TUNE_SERVER or LIBIRC_TUNE_DCC.
+ * \param tuning  The options to apply, or NULL to restore the defaults.
+ *                The structure is copied.
+ *
+ * \return Return code 0 means success. Other value means error, the error 
+ *  code may be obtained through irc_errno().
+ *
+ * The options are applied to the sockets created from now on, before they
+ * connect, so that the receive buffer size is reflected in the advertised 
+ * window. They are best effort: options that the system does not support, or
+ * that the process is not permitted to set (such as a congestion control
+ * algorithm that is not loaded, or a receive buffer above net.core.rmem_max),
+ * are silently left at their defaults.
+ *
+ * Since the kernel leaves the quick acknowledgement mode on its own, it is
+ * requested again after every DCC read.
+ *
+ * \sa irc_set_dcc_rcvlowat
+ * \ingroup dccstuff
+ */
+int irc_set_socket_tuning (irc_session_t * session, int target, const irc_socket_tuning_t * tuning);
+
+
+/*!
+ * \fn irc_bind_pool_t * irc_bind_pool_create (int policy)
+ * \brief Creates an empty bind pool.
+ *
+ * \param policy LIBIRC_BIND_ROUND_ROBIN or LIBIRC_BIND_LEAST_LOAD.
+ *
+ * \return A new bind pool, or 0 if the policy is invalid or out of memory.
+ *
+ * A bind pool spreads the connections of one or more sessions across several
+ * local addresses, so that a host with several uplinks or addresses can 
+ * exceed the throughput, or the per-address slot limit of a DCC sender, that
+ * a single address gets. With LIBIRC_BIND_LEAST_LOAD the connections go to 
+ * the address that has the fewest open connections at the time, counted 
+ * across all the sessions sharing the pool.
+ *
+ * The pool is freed by irc_bind_pool_destroy once no session or connection
+ * uses it any more.
+ *
+ * \sa irc_bind_pool_add irc_set_bind_pool
+ * \ingroup conndisc
+ */
+irc_bind_pool_t * irc_bind_pool_create (int policy);
+
+
+/*!
+ * \fn int irc_bind_pool_add (irc_bind_pool_t * pool, const char * source)
+ * \brief Adds a local address to a bind pool.
+ *
+ * \param pool   A bind pool.
+ * \param source An IPv4 or IPv6 address, or the name of a network interface,
+ *               whose first IPv4 and IPv6 addresses are then added.
+ *
+ * \return 0 on success, LIBIRC_ERR_RESOLV if \a source is neither an address
+ *  nor an interface with an address, LIBIRC_ERR_NOMEM if out of memory.
+ *
+ * The sockets are bound to the address only; for the traffic to actually 
+ * leave through the matching uplink, the host must route by source address.
+ *
+ * \ingroup conndisc
+ */
+int irc_bind_pool_add (irc_bind_pool_t * pool, const char * source);
+
+
+/*!
+ * \fn void irc_bind_pool_destroy (irc_bind_pool_t * pool)
+ * \brief Releases a bind pool.
+ *
+ * \param pool A bind pool created with irc_bind_pool_create, or 0.
+ *
+ * The sessions the pool has been given to keep using it; it is freed once
+ * the last of them has released it.
+ *
+ * \ingroup conndisc
+ */
+void irc_bind_pool_destroy (irc_bind_pool_t * pool);
+
+
+/*!
+ * \fn void irc_set_bind_pool (irc_session_t * session, irc_bind_pool_t * pool)
+ * \brief Binds the connections of a session to the addresses of a pool.
+ *
+ * \param session An initialized IRC session.
+ * \param pool    A bind pool, or 0 to stop binding the connections.
+ *
+ * The server connections made by irc_connect and irc_connect6, and the 
+ * outgoing DCC connections, are bound to an address of the pool's matching 
+ * address family before they connect. Connections for which the pool has no
+ * address of that family are not bound. Listening DCC sockets keep using the
+ * address of the server connection.
+ *
+ * \ingroup conndisc
+ */
+void irc_set_bind_pool (irc_session_t * session, irc_bind_pool_t * pool);
+
+
+/*!
+ * \fn void irc_set_endpoint_cache (irc_session_t * session, const char * path, unsigned int ttl)
+ * \brief Keeps the resolved addresses of the IRC servers in a file.
+ *
+ * \param session An initialized IRC session.
+ * \param path    The path of the cache file, or 0 to stop using one. The file
+ *                is created as needed, but not its directory.
+ * \param ttl     The number of seconds the resolved addresses are used for
+ *                before the server name is resolved again. 0 always resolves
+ *                the name, but still orders the addresses by their history.
+ *
+ * The cache records the addresses each server name resolved to, the 
+ * smoothed latency of the connections to each of them and the failures
+ * since their last success. irc_connect() then races the addresses that 
+ * connected last time first, fastest first, followed by the untried ones and
+ * last by those that failed; and until they expire, starts connecting 
+ * at once, without resolving the name. If none of the cached addresses 
+ * connects any more, the name is resolved again.
+ *
+ * The file may be shared by concurrent sessions and processes; it is
+ * replaced atomically when a connection attempt is over.
+ *
+ * \sa irc_connect
+ * \ingroup conndisc
+ */
+void irc_set_endpoint_cache (irc_session_t * session, const char * path, unsigned int ttl);
+
+
+/*!
+ * \fn void irc_set_tls_session_cache (irc_session_t * session, const char * path)
+ * \brief Keeps the TLS sessions of the IRC servers in a file.
+ *
+ * \param session An initialized IRC session.
+ * \param path    The path of the cache file, or 0 to stop using one. The file
+ *                is created as needed, readable by its owner only, but not its
+ *                directory.
+ *
+ * A session always offers the last TLS session issued by the server to its
+ * next SSL connection to the same server, so that a reconnect resumes it 
+ * with an abbreviated handshake, one round trip long and without the 
+ * certificate chain. The cache file extends this across sessions and 
+ * processes: the last session or TLS 1.3 ticket issued by each server is 
+ * stored there, and offered by the next connection to it.
+ *
+ * Only the sessions of servers whose certificate has been verified are kept 
+ * and offered: none are with LIBIRC_OPTION_SSL_NO_VERIFY. A resumed 
+ * connection is still refused if the session it resumed was not verified.
+ *
+ * The sessions hold the keys to the connections that used them; keep the 
+ * file private. Does nothing if the library is built without SSL support.
+ *
+ * \sa irc_connect
+ * \ingroup conndisc
+ */
+void irc_set_tls_session_cache (irc_session_t * session, const char * path);
+
+
+/*!
+ * \fn int irc_set_ssl_client_cert (irc_session_t * session, const char * cert, const char * key)
+ * \brief Sets the certificate that identifies the client to SSL servers.
+ *
+ * \param session An initialized IRC session.
+ * \param cert    The path of the certificate, in PEM format, possibly followed 
+ *                by its chain; or 0 to stop sending one.
+ * \param key     The path of its private key, in PEM format and unencrypted; 
+ *                or 0 if it is in the certificate file.
+ *
+ * \return Return code 0 means success. Other value means error, the error 
+ *  code may be obtained through irc_errno().
+ *
+ * The SSL connections made from now on present the certificate to the 
+ * server, which may identify the account with it, either by itself or 
+ * through LIBIRC_SASL_EXTERNAL (see irc_set_sasl). The files are read when 
+ * connecting: if they cannot be loaded, or the key does not match the 
+ * certificate, the connection fails with LIBIRC_ERR_SSL_INIT_FAILED. The 
+ * paths are copied.
+ *
+ * Fails with LIBIRC_ERR_SSL_NOT_SUPPORTED if the library is built without 
+ * SSL support.
+ *
+ * \sa irc_set_sasl
+ * \ingroup conndisc
+ */
+int irc_set_ssl_client_cert (irc_session_t * session, const char * cert, const char * key);
+
+
 /*!
  * \fn int irc_dcc_destroy (irc_session_t * session, irc_dcc_t dccid)
  * \brief Destroys a DCC session.
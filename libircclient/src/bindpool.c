@@ -0,0 +1,257 @@
+/*
+ * Copyright (C) 2004-2012 George Yunaev gyunaev@ulduzsoft.com
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ */
+
+/*
+ * A bind pool is a set of local addresses that the server and DCC sockets
+ * are bound to before they connect, so that concurrent transfers leave the
+ * host through several uplinks and are not subject to a single per-address
+ * slot limit. A pool may be shared by any number of sessions, and counts the
+ * sockets currently bound to each of its addresses.
+ */
+
+#include <ifaddrs.h>
+
+struct libirc_bind_entry
+{
+	struct sockaddr_storage	addr;
+	socklen_t		addrlen;
+	unsigned int		load;		// the sockets currently bound to it
+};
+
+struct irc_bind_pool_s
+{
+	port_mutex_t		mutex;
+	int			policy;
+	unsigned int		refs;
+	unsigned int		next;		// the round-robin cursor
+
+	struct libirc_bind_entry * entries;
+	unsigned int		count;
+};
+
+
+irc_bind_pool_t * irc_bind_pool_create (int policy)
+{
+	irc_bind_pool_t * pool;
+
+	if ( policy != LIBIRC_BIND_ROUND_ROBIN && policy != LIBIRC_BIND_LEAST_LOAD )
+		return 0;
+
+	if ( (pool = calloc (1, sizeof(*pool))) == 0 )
+		return 0;
+
+	if ( libirc_mutex_init (&pool->mutex) )
+	{
+		free (pool);
+		return 0;
+	}
+
+	pool->policy = policy;
+	pool->refs = 1;
+	return pool;
+}
+
+
+static int libirc_bind_pool_append (irc_bind_pool_t * pool, const struct sockaddr * addr, socklen_t addrlen)
+{
+	struct libirc_bind_entry * entries;
+
+	libirc_mutex_lock (&pool->mutex);
+
+	if ( (entries = realloc (pool->entries, (pool->count + 1) * sizeof(*entries))) == 0 )
+	{
+		libirc_mutex_unlock (&pool->mutex);
+		return LIBIRC_ERR_NOMEM;
+	}
+
+	pool->entries = entries;
+	memset (&entries[pool->count], 0, sizeof(entries[pool->count]));
+	memcpy (&entries[pool->count].addr, addr, addrlen);
+	entries[pool->count].addrlen = addrlen;
+	pool->count++;
+
+	libirc_mutex_unlock (&pool->mutex);
+	return 0;
+}
+
+
+int irc_bind_pool_add (irc_bind_pool_t * pool, const char * source)
+{
+	struct sockaddr_in saddr;
+	struct sockaddr_in6 saddr6;
+	struct ifaddrs * ifa, * i;
+	int err = LIBIRC_ERR_RESOLV;
+
+	if ( !pool || !source )
+		return LIBIRC_ERR_INVAL;
+
+	memset (&saddr, 0, sizeof(saddr));
+	memset (&saddr6, 0, sizeof(saddr6));
+
+	if ( inet_pton (AF_INET, source, &saddr.sin_addr) == 1 )
+	{
+		saddr.sin_family = AF_INET;
+		return libirc_bind_pool_append (pool, (struct sockaddr *) &saddr, sizeof(saddr));
+	}
+
+	if ( inet_pton (AF_INET6, source, &saddr6.sin6_addr) == 1 )
+	{
+		saddr6.sin6_family = AF_INET6;
+		return libirc_bind_pool_append (pool, (struct sockaddr *) &saddr6, sizeof(saddr6));
+	}
+
+	// Otherwise it is an interface name: take its first address of each family
+	if ( getifaddrs (&ifa) )
+		return LIBIRC_ERR_RESOLV;
+
+	for ( i = ifa; i; i = i->ifa_next )
+	{
+		if ( !i->ifa_addr || strcmp (i->ifa_name, source) )
+			continue;
+
+		if ( i->ifa_addr->sa_family == AF_INET && saddr.sin_family == 0 )
+		{
+			memcpy (&saddr, i->ifa_addr, sizeof(saddr));
+			saddr.sin_port = 0;
+
+			if ( (err = libirc_bind_pool_append (pool, (struct sockaddr *) &saddr, sizeof(saddr))) != 0 )
+				break;
+		}
+		else if ( i->ifa_addr->sa_family == AF_INET6 && saddr6.sin6_family == 0 )
+		{
+			memcpy (&saddr6, i->ifa_addr, sizeof(saddr6));
+			saddr6.sin6_port = 0;
+
+			if ( (err = libirc_bind_pool_append (pool, (struct sockaddr *) &saddr6, sizeof(saddr6))) != 0 )
+				break;
+		}
+	}
+
+	freeifaddrs (ifa);
+	return err;
+}
+
+
+static void libirc_bind_pool_unref (irc_bind_pool_t * pool)
+{
+	unsigned int refs;
+
+	libirc_mutex_lock (&pool->mutex);
+	refs = --pool->refs;
+	libirc_mutex_unlock (&pool->mutex);
+
+	if ( refs )
+		return;
+
+	libirc_mutex_destroy (&pool->mutex);
+	free (pool->entries);
+	free (pool);
+}
+
+
+void irc_bind_pool_destroy (irc_bind_pool_t * pool)
+{
+	if ( pool )
+		libirc_bind_pool_unref (pool);
+}
+
+
+void irc_set_bind_pool (irc_session_t * session, irc_bind_pool_t * pool)
+{
+	if ( pool )
+	{
+		libirc_mutex_lock (&pool->mutex);
+		pool->refs++;
+		libirc_mutex_unlock (&pool->mutex);
+	}
+
+	// The sockets bound so far keep their reference to the old pool
+	if ( session->bind_pool )
+		libirc_bind_pool_unref (session->bind_pool);
+
+	session->bind_pool = pool;
+}
+
+
+/*
+ * Binds the socket to the next address of the given family in the pool,
+ * and takes a reference on the pool for it. The socket is left unbound if
+ * the pool has no address of that family. Returns nonzero if bind() failed.
+ */
+static int libirc_bind_acquire (irc_bind_pool_t * pool, socket_t * sock, int family, struct libirc_binding * binding)
+{
+	struct libirc_bind_entry * entry = 0;
+	unsigned int i, slot;
+
+	binding->pool = 0;
+
+	if ( !pool )
+		return 0;
+
+	libirc_mutex_lock (&pool->mutex);
+
+	for ( i = 0; i < pool->count; i++ )
+	{
+		struct libirc_bind_entry * e = &pool->entries[(pool->next + i) % pool->count];
+
+		if ( e->addr.ss_family != family )
+			continue;
+
+		if ( !entry || e->load < entry->load )
+			entry = e;
+
+		if ( pool->policy == LIBIRC_BIND_ROUND_ROBIN )
+			break;
+	}
+
+	if ( !entry )
+	{
+		libirc_mutex_unlock (&pool->mutex);
+		return 0;
+	}
+
+	slot = entry - pool->entries;
+	pool->next = slot + 1;
+
+	if ( bind (*sock, (struct sockaddr *) &entry->addr, entry->addrlen) < 0 )
+	{
+		libirc_mutex_unlock (&pool->mutex);
+		return 1;
+	}
+
+	entry->load++;
+	pool->refs++;
+
+	libirc_mutex_unlock (&pool->mutex);
+
+	binding->pool = pool;
+	binding->slot = slot;
+	return 0;
+}
+
+
+static void libirc_bind_release (struct libirc_binding * binding)
+{
+	irc_bind_pool_t * pool = binding->pool;
+
+	if ( !pool )
+		return;
+
+	libirc_mutex_lock (&pool->mutex);
+	pool->entries[binding->slot].load--;
+	libirc_mutex_unlock (&pool->mutex);
+
+	binding->pool = 0;
+	libirc_bind_pool_unref (pool);
+}
@@ -0,0 +1,604 @@
+/*
+ * Copyright (C) 2004-2012 George Yunaev gyunaev@ulduzsoft.com
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ */
+
+/*
+ * The connection to the IRC server. The host name is resolved on a helper
+ * thread, so the event loop is not blocked by a slow resolver, and all of
+ * its addresses are then raced as in RFC 8305 ("happy eyeballs"): a new
+ * attempt is started every LIBIRC_CONNECT_STAGGER milliseconds, or at once
+ * when one fails, and the first socket to connect becomes the session
+ * socket. An address that does not answer only delays the connection by
+ * the stagger, rather than by a full TCP timeout. With an endpoint cache
+ * (see endpoints.c), the addresses that connected fastest are raced first,
+ * and the resolution is skipped until they expire. With TCP Fast Open, the
+ * registration rides on the SYN of the address raced first.
+ */
+
+#if defined (ENABLE_THREADS)
+
+// A name resolution in progress. It is shared by the session and the
+// resolver thread, so that the session may go away before the thread is done.
+struct libirc_resolver
+{
+	atomic_uint		refs;
+	int			donefd[2];	// readable once the result is set
+	char			* host;
+	char			port[8];
+	int			family;
+	struct addrinfo		* result;
+	int			error;
+};
+
+
+static void libirc_resolver_unref (struct libirc_resolver * resolver)
+{
+	if ( atomic_fetch_sub_explicit (&resolver->refs, 1, memory_order_acq_rel) != 1 )
+		return;
+
+	if ( resolver->result )
+		freeaddrinfo (resolver->result);
+
+	close (resolver->donefd[0]);
+	close (resolver->donefd[1]);
+	free (resolver->host);
+	free (resolver);
+}
+
+
+static void * libirc_resolver_main (void * arg)
+{
+	struct libirc_resolver * resolver = arg;
+	struct addrinfo hints;
+
+	memset (&hints, 0, sizeof(hints));
+	hints.ai_family = resolver->family;
+	hints.ai_socktype = SOCK_STREAM;
+
+	resolver->error = getaddrinfo (resolver->host, resolver->port, &hints, &resolver->result);
+
+	// Both ends of the pipe live as long as the resolver, so this cannot
+	// raise SIGPIPE even if the session has been destroyed meanwhile
+	(void) write (resolver->donefd[1], "", 1);
+
+	libirc_resolver_unref (resolver);
+	return 0;
+}
+
+
+static int libirc_resolver_start (irc_session_t * session, const char * host, unsigned short port, int family)
+{
+	struct libirc_resolver * resolver;
+	pthread_t thread;
+
+	if ( (resolver = calloc (1, sizeof(*resolver))) == 0 )
+		return LIBIRC_ERR_NOMEM;
+
+	if ( (resolver->host = strdup (host)) == 0 )
+	{
+		free (resolver);
+		return LIBIRC_ERR_NOMEM;
+	}
+
+	if ( libirc_make_pipe (resolver->donefd) )
+	{
+		free (resolver->host);
+		free (resolver);
+		return LIBIRC_ERR_SOCKET;
+	}
+
+	snprintf (resolver->port, sizeof(resolver->port), "%u", (unsigned) port);
+	resolver->family = family;
+	atomic_init (&resolver->refs, 2);
+
+	if ( pthread_create (&thread, 0, libirc_resolver_main, resolver) )
+	{
+		atomic_init (&resolver->refs, 1);
+		libirc_resolver_unref (resolver);
+		return LIBIRC_ERR_NOMEM;
+	}
+
+	pthread_detach (thread);
+	session->resolver = resolver;
+	return 0;
+}
+
+#endif
+
+
+static void libirc_connect_stagger (irc_session_t * session, irc_timer_t timer, void * ctx);
+
+
+/*
+ * Drops the attempts that are still in progress, and everything else that
+ * is only needed until the connection is made.
+ */
+static void libirc_connect_reset (irc_session_t * session)
+{
+	libirc_watch_dirty (session, 0);
+
+	while ( session->attempt_count > 0 )
+	{
+		struct libirc_attempt * attempt = &session->attempts[--session->attempt_count];
+
+		libirc_bind_release (&attempt->binding);
+		socket_close (&attempt->sock);
+	}
+
+	if ( session->attempt_timer )
+		irc_timer_cancel (session, session->attempt_timer);
+
+	session->attempt_timer = 0;
+
+	free (session->endpoints);
+	session->endpoints = 0;
+	session->endpoint_count = 0;
+	session->endpoint_next = 0;
+
+#if defined (ENABLE_THREADS)
+	if ( session->resolver )
+		libirc_resolver_unref (session->resolver);
+
+	session->resolver = 0;
+#endif
+}
+
+
+// Returns the first entry from ai on that is (or, if !same, is not) of the family.
+static const struct addrinfo * libirc_addrinfo_next (const struct addrinfo * ai, int family, int same)
+{
+	while ( ai && (ai->ai_family == family) != same )
+		ai = ai->ai_next;
+
+	return ai;
+}
+
+
+/*
+ * Takes the addresses to race from the resolver's result. The families are
+ * interleaved, starting with the one the resolver prefers, so that a broken
+ * family only costs a single stagger. The history of the addresses already
+ * in session->endpoints, loaded from the endpoint cache, is kept.
+ */
+static int libirc_connect_set_endpoints (irc_session_t * session, const struct addrinfo * res)
+{
+	const struct addrinfo * ai, * next[2];
+	struct libirc_endpoint * endpoints;
+	unsigned int count = 0, turn = 0;
+	time_t expires = time (0) + session->endpoint_cache_ttl;
+
+	for ( ai = res; ai; ai = ai->ai_next )
+		count++;
+
+	if ( !count )
+		return LIBIRC_ERR_RESOLV;
+
+	if ( (endpoints = calloc (count, sizeof(struct libirc_endpoint))) == 0 )
+		return LIBIRC_ERR_NOMEM;
+
+	count = 0;
+	next[0] = res;
+	next[1] = libirc_addrinfo_next (res, res->ai_family, 0);
+
+	while ( next[0] || next[1] )
+	{
+		if ( !next[turn] )
+			turn ^= 1;
+
+		ai = next[turn];
+		next[turn] = libirc_addrinfo_next (ai->ai_next, res->ai_family, turn == 0);
+		turn ^= 1;
+
+		if ( (ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
+		|| ai->ai_addrlen > sizeof(struct sockaddr_storage) )
+			continue;
+
+		memcpy (&endpoints[count].addr, ai->ai_addr, ai->ai_addrlen);
+		endpoints[count].addrlen = ai->ai_addrlen;
+		endpoints[count].expires = expires;
+		count++;
+	}
+
+	libirc_endpoints_merge (endpoints, count, session->endpoints, session->endpoint_count);
+	free (session->endpoints);
+
+	session->endpoints = endpoints;
+	session->endpoint_count = count;
+	session->endpoint_next = 0;
+	session->endpoints_cached = false;
+
+	if ( session->endpoint_cache )
+		libirc_endpoints_sort (session);
+
+	return count ? 0 : LIBIRC_ERR_RESOLV;
+}
+
+
+/*
+ * Connects the socket of an attempt. With TCP Fast Open, the registration
+ * is sent along with the SYN to the address raced first, if the kernel
+ * holds a cookie of the server; only to that one, so that the nick is not
+ * registered on two servers at once. An SSL connection is not sped up, as
+ * its ClientHello is only made once the race is won. Returns nonzero if the
+ * connect failed.
+ */
+static int libirc_connect_socket (irc_session_t * session, struct libirc_attempt * attempt, const struct libirc_endpoint * endpoint)
+{
+	int sent;
+
+	attempt->early = 0;
+
+	if ( !session->tuning_server.fastopen
+	|| endpoint != session->endpoints
+	|| (session->flags & SESSIONFL_SSL_CONNECTION) )
+		return socket_connect (&attempt->sock, (struct sockaddr *) &endpoint->addr, endpoint->addrlen);
+
+	libirc_register (session);
+
+	libirc_mutex_lock (&session->mutex_session);
+	sent = socket_connect_fastopen (&attempt->sock, (struct sockaddr *) &endpoint->addr, endpoint->addrlen, session->outgoing_buf, session->outgoing_offset);
+	libirc_mutex_unlock (&session->mutex_session);
+
+	if ( sent < 0 )
+		return 1;
+
+	attempt->early = sent;
+	return 0;
+}
+
+
+/*
+ * Starts a connection attempt to the next address that accepts one. Returns
+ * nonzero if there is no address left, or no room for another attempt.
+ */
+static int libirc_connect_attempt (irc_session_t * session)
+{
+	libirc_watch_dirty (session, 0);
+
+	while ( session->endpoint_next < session->endpoint_count
+	&& session->attempt_count < LIBIRC_CONNECT_ATTEMPTS )
+	{
+		struct libirc_endpoint * endpoint = &session->endpoints[session->endpoint_next++];
+		struct libirc_attempt * attempt = &session->attempts[session->attempt_count];
+		int family = endpoint->addr.ss_family;
+
+		attempt->binding.pool = 0;
+		attempt->endpoint = endpoint - session->endpoints;
+		endpoint->started = libirc_time_ms ();
+
+		if ( socket_create (family == AF_INET6 ? PF_INET6 : PF_INET, SOCK_STREAM, &attempt->sock) )
+			continue;
+
+		socket_tune (&attempt->sock, &session->tuning_server);
+
+		// An address the host cannot reach usually fails right here
+		if ( socket_make_nonblocking (&attempt->sock)
+		|| libirc_bind_acquire (session->bind_pool, &attempt->sock, family, &attempt->binding)
+		|| libirc_connect_socket (session, attempt, endpoint) )
+		{
+			libirc_bind_release (&attempt->binding);
+			socket_close (&attempt->sock);
+			libirc_endpoint_result (session, attempt->endpoint, 0);
+			continue;
+		}
+
+		session->attempt_count++;
+
+		// Give it a head start before the next address is raced against it
+		if ( session->endpoint_next < session->endpoint_count && !session->attempt_timer )
+			session->attempt_timer = irc_timer_add (session, LIBIRC_CONNECT_STAGGER, libirc_connect_stagger, 0);
+
+		return 0;
+	}
+
+	return 1;
+}
+
+
+static void libirc_connect_stagger (irc_session_t * session, irc_timer_t timer, void * ctx)
+{
+	session->attempt_timer = 0;
+
+	if ( session->state == LIBIRC_STATE_CONNECTING && session->sock < 0 )
+		libirc_connect_attempt (session);
+}
+
+
+/*
+ * Starts racing the resolved addresses. Returns 0 or the error code.
+ */
+static int libirc_connect_begin (irc_session_t * session, const struct addrinfo * res)
+{
+	int err;
+
+	if ( (err = libirc_connect_set_endpoints (session, res)) != 0 )
+		return err;
+
+	return libirc_connect_attempt (session) ? LIBIRC_ERR_CONNECT : 0;
+}
+
+
+static int libirc_connect_fail (irc_session_t * session, int err)
+{
+	libirc_connect_reset (session);
+
+	session->lasterror = err;
+	session->state = LIBIRC_STATE_DISCONNECTED;
+	return 1;
+}
+
+
+/*
+ * Resolves session->server, on a helper thread if the library is
+ * thread-safe, and synchronously otherwise. Returns 0 or the error code.
+ */
+static int libirc_connect_resolve (irc_session_t * session)
+{
+#if defined (ENABLE_THREADS)
+	return libirc_resolver_start (session, session->server, session->server_port, session->server_family);
+#else
+	struct addrinfo hints, * res;
+	char portstr[8];
+	int err;
+
+	memset (&hints, 0, sizeof(hints));
+	hints.ai_family = session->server_family;
+	hints.ai_socktype = SOCK_STREAM;
+
+	snprintf (portstr, sizeof(portstr), "%u", (unsigned) session->server_port);
+
+	if ( getaddrinfo (session->server, portstr, &hints, &res) != 0 )
+		return LIBIRC_ERR_RESOLV;
+
+	err = libirc_connect_begin (session, res);
+	freeaddrinfo (res);
+	return err;
+#endif
+}
+
+
+/*
+ * Initiates the connection to session->server. A numeric address is used
+ * right away, and so are the addresses of the endpoint cache until they
+ * expire; otherwise the name is resolved. Returns 0 or the error code.
+ */
+static int libirc_connect_start (irc_session_t * session, unsigned short port, int family)
+{
+	struct addrinfo hints, * res;
+	char portstr[8];
+	int err;
+
+	libirc_connect_reset (session);
+
+	session->server_port = port;
+	session->server_family = family;
+
+	memset (&hints, 0, sizeof(hints));
+	hints.ai_family = family;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICHOST;
+
+	snprintf (portstr, sizeof(portstr), "%u", (unsigned) port);
+
+	if ( getaddrinfo (session->server, portstr, &hints, &res) == 0 )
+	{
+		err = libirc_connect_begin (session, res);
+		freeaddrinfo (res);
+	}
+	else if ( (session->endpoints_cached = libirc_endpoints_load (session)) != 0
+	&& libirc_connect_attempt (session) == 0 )
+		err = 0;
+	else
+	{
+		session->endpoints_cached = false;
+		err = libirc_connect_resolve (session);
+	}
+
+	if ( err )
+		libirc_connect_reset (session);
+
+	return err;
+}
+
+
+#if defined (ENABLE_THREADS)
+static int libirc_resolver_done (irc_session_t * session)
+{
+	struct libirc_resolver * resolver = session->resolver;
+	char drain;
+	int err;
+
+	if ( read (resolver->donefd[0], &drain, 1) != 1 )
+		return 0;
+
+	session->resolver = 0;
+	err = resolver->error ? LIBIRC_ERR_RESOLV : libirc_connect_begin (session, resolver->result);
+	libirc_resolver_unref (resolver);
+
+	return err ? libirc_connect_fail (session, err) : 0;
+}
+#endif
+
+
+/*
+ * Returns nonzero if fd is one of the descriptors used to make the connection.
+ */
+static int libirc_connect_owns (irc_session_t * session, socket_t fd)
+{
+	unsigned int i;
+
+	if ( session->state != LIBIRC_STATE_CONNECTING || session->sock >= 0 )
+		return 0;
+
+#if defined (ENABLE_THREADS)
+	if ( session->resolver && fd == session->resolver->donefd[0] )
+		return 1;
+#endif
+
+	for ( i = 0; i < session->attempt_count; i++ )
+		if ( session->attempts[i].sock == fd )
+			return 1;
+
+	return 0;
+}
+
+
+/*
+ * Processes the readiness events of a descriptor owned by the connection
+ * race. The first attempt to connect becomes the session socket, and the
+ * registration is sent on it at once.
+ */
+static int libirc_connect_process (irc_session_t * session, socket_t fd, int events)
+{
+	struct libirc_attempt winner;
+	unsigned int i;
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+#if defined (ENABLE_THREADS)
+	if ( session->resolver && fd == session->resolver->donefd[0] )
+		return (events & LIBIRC_WATCH_READ) ? libirc_resolver_done (session) : 0;
+#endif
+
+	for ( i = 0; i < session->attempt_count; i++ )
+		if ( session->attempts[i].sock == fd )
+			break;
+
+	if ( i == session->attempt_count || !(events & LIBIRC_WATCH_WRITE) )
+		return 0;
+
+	winner = session->attempts[i];
+	session->attempts[i] = session->attempts[--session->attempt_count];
+
+	if ( getsockopt (fd, SOL_SOCKET, SO_ERROR, (char *) &err, &len) < 0 || err != 0 )
+	{
+		libirc_bind_release (&winner.binding);
+		socket_close (&winner.sock);
+		libirc_endpoint_result (session, winner.endpoint, 0);
+
+		// Move on to the next address now rather than at the next stagger
+		if ( !libirc_connect_attempt (session) || session->attempt_count > 0 )
+			return 0;
+
+		if ( !session->endpoints_cached )
+		{
+			libirc_endpoints_save (session);
+			return libirc_connect_fail (session, LIBIRC_ERR_CONNECT);
+		}
+
+		// None of the cached addresses works any more: expire them, and
+		// race those the server name resolves to now
+		for ( i = 0; i < session->endpoint_count; i++ )
+			session->endpoints[i].expires = 0;
+
+		libirc_endpoints_save (session);
+		session->endpoints_cached = false;
+
+		if ( (err = libirc_connect_resolve (session)) != 0 )
+			return libirc_connect_fail (session, err);
+
+		return 0;
+	}
+
+	libirc_endpoint_result (session, winner.endpoint, 1);
+	libirc_endpoints_save (session);
+	libirc_connect_reset (session);
+
+	session->sock = winner.sock;
+	session->binding = winner.binding;
+
+	// What went with the SYN is not sent again
+	if ( winner.early > 0 )
+	{
+		libirc_mutex_lock (&session->mutex_session);
+		libirc_outgoing_consume (session, winner.early, winner.early);
+		libirc_mutex_unlock (&session->mutex_session);
+	}
+
+#if defined (ENABLE_SSL)
+	// Init the SSL stuff
+	if ( session->flags & SESSIONFL_SSL_CONNECTION )
+	{
+		int rc = ssl_init( session );
+
+		if ( rc != 0 )
+			return libirc_connect_fail (session, rc);
+	}
+#endif
+
+	return libirc_session_process (session, LIBIRC_WATCH_WRITE);
+}
+
+
+static void libirc_connect_add_descriptors (irc_session_t * session, fd_set * in_set, fd_set * out_set, int * maxfd)
+{
+	unsigned int i;
+
+#if defined (ENABLE_THREADS)
+	if ( session->resolver )
+		libirc_add_to_set (session->resolver->donefd[0], in_set, maxfd);
+#endif
+
+	for ( i = 0; i < session->attempt_count; i++ )
+		libirc_add_to_set (session->attempts[i].sock, out_set, maxfd);
+}
+
+
+static int libirc_connect_process_descriptors (irc_session_t * session, fd_set * in_set, fd_set * out_set)
+{
+	unsigned int i;
+
+#if defined (ENABLE_THREADS)
+	if ( session->resolver && FD_ISSET (session->resolver->donefd[0], in_set) )
+		return libirc_connect_process (session, session->resolver->donefd[0], LIBIRC_WATCH_READ);
+#endif
+
+	// Downwards, as a failed attempt is replaced by the last one
+	for ( i = session->attempt_count; i-- > 0 && session->sock < 0; )
+	{
+		if ( i < session->attempt_count
+		&& FD_ISSET (session->attempts[i].sock, out_set)
+		&& libirc_connect_process (session, session->attempts[i].sock, LIBIRC_WATCH_WRITE) )
+			return 1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Stores the descriptors of the connection race into watches, and returns
+ * their number; at most LIBIRC_CONNECT_ATTEMPTS + 1.
+ */
+static unsigned int libirc_connect_collect (irc_session_t * session, struct libirc_watch * watches)
+{
+	unsigned int i, count = 0;
+
+#if defined (ENABLE_THREADS)
+	if ( session->resolver )
+	{
+		watches[count].fd = session->resolver->donefd[0];
+		watches[count].events = LIBIRC_WATCH_READ;
+		count++;
+	}
+#endif
+
+	for ( i = 0; i < session->attempt_count; i++ )
+	{
+		watches[count].fd = session->attempts[i].sock;
+		watches[count].events = LIBIRC_WATCH_WRITE;
+		count++;
+	}
+
+	return count;
+}
@@ -16,26 +16,146 @@
 #include <stdbool.h>
 #include <sys/socket.h>
 
+static inline irc_dcc_session_t * libirc_dcc_slot (irc_session_t * session, unsigned int index)
+{
+	return &session->dcc_slabs[index / LIBIRC_DCC_SLAB_SIZE][index % LIBIRC_DCC_SLAB_SIZE];
+}
+
+
+/*
+ * Looks the session up by the slot index encoded in its id, and checks the
+ * generation so a stale id cannot reach a session that reused the slot.
+ */
 static irc_dcc_session_t * libirc_find_dcc_session (irc_session_t * session, irc_dcc_t dccid, int lock_list)
 {
-	irc_dcc_session_t * s, *found = 0;
+	unsigned int index = (dccid & LIBIRC_DCC_INDEX_MASK) - 1;
+	irc_dcc_session_t * found = 0;
 
 	if ( lock_list )
 		libirc_mutex_lock (&session->mutex_dcc);
 
-	for ( s = session->dcc_sessions; s; s = s->next )
+	if ( index < session->dcc_slots && libirc_dcc_slot (session, index)->id == dccid )
+		found = libirc_dcc_slot (session, index);
+
+	if ( found == 0 && lock_list )
+		libirc_mutex_unlock (&session->mutex_dcc);
+
+	return found;
+}
+
+
+/*
+ * Returns the live DCC session that owns the socket \a fd, or 0. The session
+ * list must be locked.
+ */
+static irc_dcc_session_t * libirc_find_dcc_session_by_fd (irc_session_t * session, int fd)
+{
+	irc_dcc_session_t * dcc;
+
+	if ( fd < 0 || (unsigned int) fd >= session->dcc_by_fd_size )
+		return 0;
+
+	dcc = libirc_find_dcc_session (session, session->dcc_by_fd[fd], 0);
+
+	if ( !dcc || dcc->sock != fd || dcc->state == LIBIRC_STATE_REMOVED )
+		return 0;
+
+	return dcc;
+}
+
+
+/*
+ * Records that the DCC session owns its current socket. The session list
+ * must be locked.
+ */
+static int libirc_dcc_map_fd (irc_session_t * session, irc_dcc_session_t * dcc)
+{
+	if ( (unsigned int) dcc->sock >= session->dcc_by_fd_size )
 	{
-		if ( s->id == dccid )
+		unsigned int size = session->dcc_by_fd_size ? session->dcc_by_fd_size : 64;
+		irc_dcc_t * map;
+
+		while ( size <= (unsigned int) dcc->sock )
+			size *= 2;
+
+		if ( (map = realloc (session->dcc_by_fd, size * sizeof(*map))) == 0 )
+			return LIBIRC_ERR_NOMEM;
+
+		memset (map + session->dcc_by_fd_size, 0, (size - session->dcc_by_fd_size) * sizeof(*map));
+		session->dcc_by_fd = map;
+		session->dcc_by_fd_size = size;
+	}
+
+	session->dcc_by_fd[dcc->sock] = dcc->id;
+	return 0;
+}
+
+
+/*
+ * Takes a slot off the free list, or carves a new one, growing the table
+ * by a slab when it is full. The session list must be locked.
+ */
+static irc_dcc_session_t * libirc_dcc_alloc (irc_session_t * session)
+{
+	irc_dcc_session_t * dcc;
+	struct libirc_dcc_watch watch;
+	unsigned short generation;
+	unsigned int index;
+
+	if ( session->dcc_free != LIBIRC_DCC_NO_SLOT )
+	{
+		index = session->dcc_free;
+		dcc = libirc_dcc_slot (session, index);
+		session->dcc_free = dcc->next_free;
+	}
+	else
+	{
+		if ( session->dcc_slots == LIBIRC_DCC_INDEX_MASK )
+			return 0;
+
+		if ( session->dcc_slots % LIBIRC_DCC_SLAB_SIZE == 0 )
 		{
-			found = s;
-			break;
+			unsigned int nslabs = session->dcc_slots / LIBIRC_DCC_SLAB_SIZE;
+			irc_dcc_session_t ** slabs = realloc (session->dcc_slabs, (nslabs + 1) * sizeof(*slabs));
+
+			if ( !slabs )
+				return 0;
+
+			session->dcc_slabs = slabs;
+
+			if ( (slabs[nslabs] = calloc (LIBIRC_DCC_SLAB_SIZE, sizeof(irc_dcc_session_t))) == 0 )
+				return 0;
 		}
+
+		index = session->dcc_slots++;
+		dcc = libirc_dcc_slot (session, index);
+		dcc->watch.fd = -1;
 	}
 
-	if ( found == 0 && lock_list )
-		libirc_mutex_unlock (&session->mutex_dcc);
+	generation = dcc->generation;
+	watch = dcc->watch;
+	memset (dcc, 0, sizeof(irc_dcc_session_t));
 
-	return found;
+	dcc->generation = generation;
+	dcc->watch = watch;
+	dcc->id = ((irc_dcc_t) generation << LIBIRC_DCC_INDEX_BITS) | (index + 1);
+	dcc->sock = -1;
+
+	session->dcc_count++;
+	return dcc;
+}
+
+
+// The session list must be locked.
+static void libirc_dcc_free (irc_session_t * session, irc_dcc_session_t * dcc)
+{
+	unsigned int index = (dcc->id & LIBIRC_DCC_INDEX_MASK) - 1;
+
+	dcc->id = 0;
+	dcc->generation++;
+	dcc->next_free = session->dcc_free;
+	session->dcc_free = index;
+	session->dcc_count--;
 }
 
 
@@ -49,6 +169,7 @@ static void libirc_dcc_destroy_nolock (irc_session_t * session, irc_dcc_t dccid)
 			socket_close (&dcc->sock);
 
 		dcc->state = LIBIRC_STATE_REMOVED;
+		libirc_watch_dirty (session, dcc);
 	}
 }
 
@@ -58,286 +179,520 @@ static void libirc_remove_dcc_session (irc_session_t * session, irc_dcc_session_
 	if ( dcc->sock >= 0 )
 		socket_close (&dcc->sock);
 
-	libirc_mutex_destroy (&dcc->mutex_outbuf);
+	libirc_bind_release (&dcc->binding);
+
+#if defined (ENABLE_SSL)
+	if ( dcc->ssl )
+		SSL_free (dcc->ssl);
+#endif
+
+	if ( dcc->timer )
+		irc_timer_cancel (session, dcc->timer);
 
 	if ( lock_list )
 		libirc_mutex_lock (&session->mutex_dcc);
 
-	if ( session->dcc_sessions != dcc )
-	{
-		irc_dcc_session_t * s;
-		for ( s = session->dcc_sessions; s; s = s->next )
-		{
-			if ( s->next == dcc )
-			{
-				s->next = dcc->next;
-				break;
-			}
-		}
-	}
-	else
-		session->dcc_sessions = dcc->next;
+	libirc_dcc_free (session, dcc);
 
 	if ( lock_list )
 		libirc_mutex_unlock (&session->mutex_dcc);
-
-	free (dcc);
 }
 
 
-static void libirc_dcc_add_descriptors (irc_session_t * ircsession, fd_set *in_set, fd_set *out_set, int * maxfd)
+/*
+ * Frees the DCC sessions that have been destroyed.
+ */
+static void libirc_dcc_reap (irc_session_t * ircsession)
 {
-	irc_dcc_session_t * dcc, *dcc_next;
-	time_t now = time (0);
+	unsigned int i;
 
 	libirc_mutex_lock (&ircsession->mutex_dcc);
 
-	// Preprocessing DCC list:
-	// - ask DCC send callbacks for data;
-	// - remove unused DCC structures
-	for ( dcc = ircsession->dcc_sessions; dcc; dcc = dcc_next )
+	for ( i = 0; i < ircsession->dcc_slots && ircsession->dcc_count; i++ )
 	{
-		dcc_next = dcc->next;
+		irc_dcc_session_t * dcc = libirc_dcc_slot (ircsession, i);
 
-		// Remove timed-out sessions
-		if ( (dcc->state == LIBIRC_STATE_CONNECTING
-			|| dcc->state == LIBIRC_STATE_INIT
-			|| dcc->state == LIBIRC_STATE_LISTENING)
-		&& now - dcc->timeout > ircsession->dcc_timeout )
-		{
-			// Inform the caller about DCC timeout.
-			// Do not inform when state is LIBIRC_STATE_INIT - session
-			// was initiated from someone else, and callbacks aren't set yet.
-			if ( dcc->state != LIBIRC_STATE_INIT )
-			{
-				libirc_mutex_unlock (&ircsession->mutex_dcc);
+		if ( dcc->id && dcc->state == LIBIRC_STATE_REMOVED )
+			libirc_remove_dcc_session (ircsession, dcc, 0);
+	}
 
-				if ( dcc->cb_datum )
-					(*dcc->cb_datum)(ircsession, dcc->id, LIBIRC_ERR_TIMEOUT, dcc->ctx);
+	libirc_mutex_unlock (&ircsession->mutex_dcc);
+}
 
-				libirc_mutex_lock (&ircsession->mutex_dcc);
-			}
 
-			libirc_remove_dcc_session (ircsession, dcc, 0);
+/*
+ * Fires when a DCC session has not been established within dcc_timeout
+ * seconds of being offered.
+ */
+static void libirc_dcc_timeout (irc_session_t * ircsession, irc_timer_t timer, void * ctx)
+{
+	irc_dcc_session_t * dcc = libirc_find_dcc_session (ircsession, (irc_dcc_t) (uintptr_t) ctx, 1);
+
+	if ( !dcc )
+		return;
+
+	dcc->timer = 0;
+
+	if ( dcc->state == LIBIRC_STATE_CONNECTING
+	|| dcc->state == LIBIRC_STATE_HANDSHAKE
+	|| dcc->state == LIBIRC_STATE_INIT
+	|| dcc->state == LIBIRC_STATE_LISTENING )
+	{
+		// Inform the caller about DCC timeout.
+		// Do not inform when state is LIBIRC_STATE_INIT - session
+		// was initiated from someone else, and callbacks aren't set yet.
+		if ( dcc->state != LIBIRC_STATE_INIT && dcc->cb_datum )
+		{
+			libirc_mutex_unlock (&ircsession->mutex_dcc);
+			(*dcc->cb_datum)(ircsession, dcc->id, LIBIRC_ERR_TIMEOUT, dcc->ctx);
+			libirc_mutex_lock (&ircsession->mutex_dcc);
 		}
 
-		// Clean up unused sessions
-		if ( dcc->state == LIBIRC_STATE_REMOVED )
-			libirc_remove_dcc_session (ircsession, dcc, 0);
+		libirc_dcc_destroy_nolock (ircsession, dcc->id);
+	}
+
+	libirc_mutex_unlock (&ircsession->mutex_dcc);
+}
+
+
+/*
+ * Returns the events (LIBIRC_WATCH_READ and LIBIRC_WATCH_WRITE) that the DCC
+ * session is waiting for. The session list must be locked.
+ */
+static int libirc_dcc_interest (irc_dcc_session_t * dcc)
+{
+	int events = 0;
+
+	switch (dcc->state)
+	{
+	case LIBIRC_STATE_LISTENING:
+		// While listening, only in_set descriptor should be set
+		events |= LIBIRC_WATCH_READ;
+		break;
+
+	case LIBIRC_STATE_CONNECTING:
+		// While connection, only out_set descriptor should be set
+		events |= LIBIRC_WATCH_WRITE;
+		break;
+
+	case LIBIRC_STATE_HANDSHAKE:
+		events |= dcc->handshake;
+		break;
+
+	case LIBIRC_STATE_CONNECTED:
+		// The file data is read by the caller straight into its buffer
+		if ( !dcc->paused )
+			events |= LIBIRC_WATCH_READ;
+
+		// Add output descriptor if an acknowledgement is pending
+		if ( dcc->outgoing_offset > 0  )
+			events |= LIBIRC_WATCH_WRITE;
+		break;
+
+	case LIBIRC_STATE_CONFIRM_SIZE:
+		/*
+		 * If we're receiving file, then WE should confirm the transferred
+		 * part (so we have to sent data). But if we're sending the file, 
+		 * then RECEIVER should confirm the packet, so we have to receive
+		 * data.
+		 */
+		if ( dcc->outgoing_offset > 0 )
+			events |= LIBIRC_WATCH_WRITE;
 	}
 
-	for ( dcc = ircsession->dcc_sessions; dcc; dcc = dcc->next )
+	return events;
+}
+
+
+/*
+ * Returns the socket of the DCC session that the host is to watch, or -1
+ * if there is none. The session list must be locked.
+ */
+static socket_t libirc_dcc_watch_fd (irc_dcc_session_t * dcc)
+{
+	if ( !dcc->id
+	|| dcc->state == LIBIRC_STATE_INIT
+	|| dcc->state == LIBIRC_STATE_DETACHED
+	|| dcc->state == LIBIRC_STATE_REMOVED )
+		return -1;
+
+	return dcc->sock;
+}
+
+
+static void libirc_dcc_add_descriptors (irc_session_t * ircsession, fd_set *in_set, fd_set *out_set, int * maxfd)
+{
+	unsigned int i;
+
+	// Remove unused DCC structures
+	libirc_dcc_reap (ircsession);
+
+	if ( libirc_dcc_worker_fd (ircsession) >= 0 )
+		libirc_add_to_set (libirc_dcc_worker_fd (ircsession), in_set, maxfd);
+
+	libirc_mutex_lock (&ircsession->mutex_dcc);
+
+	for ( i = 0; i < ircsession->dcc_slots && ircsession->dcc_count; i++ )
 	{
-		switch (dcc->state)
-		{
-		case LIBIRC_STATE_LISTENING:
-			// While listening, only in_set descriptor should be set
+		irc_dcc_session_t * dcc = libirc_dcc_slot (ircsession, i);
+		int events;
+
+		if ( !dcc->id )
+			continue;
+
+		events = libirc_dcc_interest (dcc);
+
+		if ( events & LIBIRC_WATCH_READ )
 			libirc_add_to_set (dcc->sock, in_set, maxfd);
-			break;
 
-		case LIBIRC_STATE_CONNECTING:
-			// While connection, only out_set descriptor should be set
+		if ( events & LIBIRC_WATCH_WRITE )
 			libirc_add_to_set (dcc->sock, out_set, maxfd);
-			break;
-
-		case LIBIRC_STATE_CONNECTED:
-			// Add input descriptor if there is space in input buffer
-			// and it is DCC chat (during DCC send, there is nothing to recv)
-			if ( dcc->incoming_offset < sizeof(dcc->incoming_buf) - 1 )
-				libirc_add_to_set (dcc->sock, in_set, maxfd);
-
-			// Add output descriptor if there is something in output buffer
-			libirc_mutex_lock (&dcc->mutex_outbuf);
-
-			if ( dcc->outgoing_offset > 0  )
-				libirc_add_to_set (dcc->sock, out_set, maxfd);
-
-			libirc_mutex_unlock (&dcc->mutex_outbuf);
-			break;
-
-		case LIBIRC_STATE_CONFIRM_SIZE:
-			/*
-			 * If we're receiving file, then WE should confirm the transferred
-			 * part (so we have to sent data). But if we're sending the file, 
-			 * then RECEIVER should confirm the packet, so we have to receive
-			 * data.
-			 *
-			 * We don't need to LOCK_DCC_OUTBUF - during file transfer, buffers
-			 * can't change asynchronously.
-			 */
-			if ( dcc->outgoing_offset > 0 )
-				libirc_add_to_set (dcc->sock, out_set, maxfd);
-		}
 	}
 
 	libirc_mutex_unlock (&ircsession->mutex_dcc);
 }
 
 
-static void libirc_dcc_process_descriptors (irc_session_t * ircsession, fd_set *in_set, fd_set *out_set)
+/*
+ * Lowers the receive watermark as the end of the file approaches, so the
+ * last bytes still wake up the loop.
+ */
+static void libirc_dcc_update_rcvlowat (irc_dcc_session_t * dcc)
 {
-	irc_dcc_session_t * dcc;
+#if defined (SO_RCVLOWAT)
+	uint64_t remaining = dcc->received_file_size - dcc->file_confirm_offset;
+	int lowat = dcc->rcvlowat;
 
-	/*
-	 * We need to use such a complex scheme here, because on every callback
-	 * a number of DCC sessions could be destroyed.
-	 */
+	// Linux does not honour a watermark above half the receive buffer
+	if ( lowat > dcc->sock_rcvbuf_size / 2 )
+		lowat = dcc->sock_rcvbuf_size / 2;
+
+	if ( remaining < (uint64_t) lowat )
+		lowat = (int) remaining;
+
+	if ( lowat < 1 )
+		lowat = 1;
+
+	if ( lowat != dcc->rcvlowat_set
+	&& setsockopt (dcc->sock, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof(lowat)) == 0 )
+		dcc->rcvlowat_set = lowat;
+#endif
+}
+
+
+/*
+ * Returns nonzero if the TLS connection of an SDCC session holds file data
+ * already decrypted, which the socket no longer reports as readable.
+ */
+static int libirc_dcc_pending (irc_dcc_session_t * dcc)
+{
+#if defined (ENABLE_SSL)
+	return dcc->ssl && SSL_pending (dcc->ssl) > 0;
+#else
+	return 0;
+#endif
+}
+
+
+/*
+ * Invokes the data callback. With a receive watermark, the callback is
+ * invoked again while data is still queued, so a wakeup moves as much data
+ * as possible, and the watermark is then updated. It is invoked again as
+ * well while TLS holds decrypted data. The session list must not be locked.
+ */
+static void libirc_dcc_receive (irc_session_t * ircsession, irc_dcc_session_t * dcc)
+{
+	unsigned int rounds = 0;
+
+	do
+	{
+		dcc->would_block = false;
+		(*dcc->cb_datum)(ircsession, dcc->id, LIBIRC_ERR_OK, dcc->ctx);
+	}
+	while ( !dcc->would_block && !dcc->read_error && !dcc->cancelled && !dcc->paused
+	&& dcc->state != LIBIRC_STATE_REMOVED
+	&& dcc->file_confirm_offset < dcc->received_file_size
+	&& (libirc_dcc_pending (dcc) || (dcc->rcvlowat && ++rounds < LIBIRC_DCC_DRAIN_ROUNDS)) );
+
+	if ( dcc->rcvlowat && !dcc->read_error && !dcc->cancelled && dcc->state != LIBIRC_STATE_REMOVED )
+		libirc_dcc_update_rcvlowat (dcc);
+}
+
+
+/*
+ * Sends what is left of the pending file offset acknowledgement. Returns 0
+ * or the error that broke the connection.
+ */
+static int libirc_dcc_send_ack (irc_dcc_session_t * dcc)
+{
+	int length;
+
+	if ( dcc->outgoing_offset == 0 )
+		return 0;
+
+#if defined (ENABLE_SSL)
+	if ( dcc->ssl )
+	{
+		// TLS may have to wait for the socket; the acknowledgement stays pending
+		if ( (length = ssl_dcc_send (dcc, dcc->outgoing_buf, dcc->outgoing_offset)) < 0 && socket_error () == EAGAIN )
+			return 0;
+	}
+	else
+#endif
+	length = socket_send (&dcc->sock, dcc->outgoing_buf, dcc->outgoing_offset);
+
+	if ( length < 0 )
+		return LIBIRC_ERR_WRITE;
+
+	if ( length == 0 )
+		return LIBIRC_ERR_CLOSED;
+
+	if ( dcc->outgoing_offset - length != 0 )
+		memmove (dcc->outgoing_buf, dcc->outgoing_buf + length, dcc->outgoing_offset - length);
+
+	dcc->outgoing_offset -= length;
+	return 0;
+}
+
+
+/*
+ * The DCC session is connected; from now on the file may be received on a
+ * data thread. The session list must be locked.
+ */
+static void libirc_dcc_connected (irc_session_t * ircsession, irc_dcc_session_t * dcc)
+{
+	dcc->state = LIBIRC_STATE_CONNECTED;
+	irc_timer_cancel (ircsession, dcc->timer);
+	dcc->timer = 0;
+
+	libirc_dcc_worker_attach (ircsession, dcc);
+}
+
+
+/*
+ * Advances the TLS handshake of an SDCC session. The session list must be
+ * locked; it is unlocked while the caller is informed of a failure.
+ */
+static void libirc_dcc_handshake (irc_session_t * ircsession, irc_dcc_session_t * dcc)
+{
+#if defined (ENABLE_SSL)
+	int err = ssl_dcc_handshake (dcc);
+
+	if ( !err )
+	{
+		if ( dcc->handshake == 0 )
+			libirc_dcc_connected (ircsession, dcc);
+
+		return;
+	}
+
+	libirc_mutex_unlock (&ircsession->mutex_dcc);
+	(*dcc->cb_datum)(ircsession, dcc->id, err, dcc->ctx);
 	libirc_mutex_lock (&ircsession->mutex_dcc);
+#endif
+	libirc_dcc_destroy_nolock (ircsession, dcc->id);
+}
 
-	for ( dcc = ircsession->dcc_sessions; dcc; dcc = dcc->next )
+
+/*
+ * Processes the readiness \a events of a single DCC session's socket. The
+ * session list must be locked; it is unlocked while callbacks are invoked.
+ */
+static void libirc_dcc_process (irc_session_t * ircsession, irc_dcc_session_t * dcc, int events)
+{
+	if ( dcc->state == LIBIRC_STATE_LISTENING )
 	{
-		if ( dcc->state == LIBIRC_STATE_LISTENING
-		&& FD_ISSET (dcc->sock, in_set) )
+		socklen_t len = sizeof(dcc->remote_addr);
+		int nsock;
+
+		if ( !(events & LIBIRC_WATCH_READ) )
+			return;
+
+		// New connection is available; accept it.
+		if ( socket_accept (&dcc->sock, &nsock, (struct sockaddr *) &dcc->remote_addr, &len) )
 		{
-			socklen_t len = sizeof(dcc->remote_addr);
+			libirc_dcc_destroy_nolock (ircsession, dcc->id);
+			return;
+		}
 
-			int nsock, err = 0;
+		// close the listen socket, and replace it by a newly 
+		// accepted
+		socket_close (&dcc->sock);
+		dcc->sock = nsock;
 
-			// New connection is available; accept it.
-			if ( socket_accept (&dcc->sock, &nsock, (struct sockaddr *) &dcc->remote_addr, &len) )
-				err = LIBIRC_ERR_ACCEPT;
+		if ( libirc_dcc_map_fd (ircsession, dcc) )
+		{
+			libirc_dcc_destroy_nolock (ircsession, dcc->id);
+			return;
+		}
 
-			// On success, change the active socket and change the state
-			if ( err == 0 )
-			{
-				// close the listen socket, and replace it by a newly 
-				// accepted
-				socket_close (&dcc->sock);
-				dcc->sock = nsock;
-				dcc->state = LIBIRC_STATE_CONNECTED;
-			}
+		dcc->state = LIBIRC_STATE_CONNECTED;
+		irc_timer_cancel (ircsession, dcc->timer);
+		dcc->timer = 0;
+		return;
+	}
 
-			if ( err )
-				libirc_dcc_destroy_nolock (ircsession, dcc->id);
+	if ( dcc->state == LIBIRC_STATE_CONNECTING )
+	{
+		// Now we have to determine whether the socket is connected 
+		// or the connect is failed
+		struct sockaddr_in saddr;
+		socklen_t slen = sizeof(saddr);
+
+		if ( !(events & LIBIRC_WATCH_WRITE) )
+			return;
+
+		if ( getpeername (dcc->sock, (struct sockaddr*)&saddr, &slen) < 0 )
+		{
+			libirc_dcc_destroy_nolock (ircsession, dcc->id);
+			return;
 		}
 
-		if ( dcc->state == LIBIRC_STATE_CONNECTING
-		&& FD_ISSET (dcc->sock, out_set) )
+		if ( dcc->secure )
 		{
-			// Now we have to determine whether the socket is connected 
-			// or the connect is failed
-			struct sockaddr_in saddr;
-			socklen_t slen = sizeof(saddr);
-			int err = 0;
+			// An SDCC receive: the TLS handshake comes first, still under the connect timeout
+			dcc->state = LIBIRC_STATE_HANDSHAKE;
+			libirc_dcc_handshake (ircsession, dcc);
+			return;
+		}
+
+		libirc_dcc_connected (ircsession, dcc);
+		return;
+	}
 
-			if ( getpeername (dcc->sock, (struct sockaddr*)&saddr, &slen) < 0 )
-				err = LIBIRC_ERR_CONNECT;
+	if ( dcc->state == LIBIRC_STATE_HANDSHAKE )
+	{
+		if ( events & dcc->handshake )
+			libirc_dcc_handshake (ircsession, dcc);
+
+		return;
+	}
 
-			// On success, change the state
-			if ( err == 0 )
-				dcc->state = LIBIRC_STATE_CONNECTED;
+	if ( dcc->state != LIBIRC_STATE_CONNECTED
+	&& dcc->state != LIBIRC_STATE_CONFIRM_SIZE )
+		return;
 
-			if ( err )
-				libirc_dcc_destroy_nolock (ircsession, dcc->id);
+	if ( events & LIBIRC_WATCH_READ )
+	{
+		libirc_mutex_unlock (&ircsession->mutex_dcc);
+
+		libirc_dcc_receive (ircsession, dcc);
+
+		/*
+		 * If irc_dcc_read failed in the callback, the connection is
+		 * gone; inform the caller, and destroy this session.
+		 */
+		if ( dcc->state != LIBIRC_STATE_REMOVED && dcc->read_error )
+		{
+			(*dcc->cb_datum)(ircsession, dcc->id, dcc->read_error, dcc->ctx);
+			libirc_mutex_lock (&ircsession->mutex_dcc);
+			libirc_dcc_destroy_nolock (ircsession, dcc->id);
+			return;
 		}
 
-		if ( dcc->state == LIBIRC_STATE_CONNECTED
-		|| dcc->state == LIBIRC_STATE_CONFIRM_SIZE )
+		/*
+		 * If the session is not terminated in callback and file-offset
+		 * acknowledgements are not disabled, send the file offsets in
+		 * network-byte order (big endian).
+		 */
+		if ( dcc->state != LIBIRC_STATE_REMOVED )
 		{
-			if ( FD_ISSET (dcc->sock, in_set) )
-			{
-				libirc_mutex_unlock (&ircsession->mutex_dcc);
-
-				(*dcc->cb_datum)(ircsession, dcc->id, LIBIRC_ERR_OK, dcc->ctx);
-
-				/*
-				 * If the session is not terminated in callback and file-offset
-				 * acknowledgements are not disabled, send the file offsets in
-				 * network-byte order (big endian).
-				 */
-				if ( dcc->state != LIBIRC_STATE_REMOVED )
-				{
-					dcc->state = LIBIRC_STATE_CONFIRM_SIZE;
-
-					if ( dcc->acknowledge )
-					{
-						dcc->outgoing_file_confirm_offset = htonl(dcc->file_confirm_offset);
-						dcc->outgoing_offset = sizeof(dcc->outgoing_file_confirm_offset);
-					}
-				}
-
-				libirc_mutex_lock (&ircsession->mutex_dcc);
-			}
+			dcc->state = LIBIRC_STATE_CONFIRM_SIZE;
 
-			/*
-			 * Session might be closed (with sock = -1) after the in_set 
-			 * processing, so before out_set processing we should check
-			 * for this case
-			 */
-			if ( dcc->state == LIBIRC_STATE_REMOVED )
-				continue;
-
-			/*
-			 * If we just sent the confirmation data, change state
-			 * back.
-			 */
-			if ( dcc->state == LIBIRC_STATE_CONFIRM_SIZE )
+			if ( dcc->acknowledge )
 			{
-				/*
-				 * If the file is already received, we should inform
-				 * the caller, and close the session.
-				 */
-				if ( dcc->received_file_size == dcc->file_confirm_offset )
-				{
-					libirc_mutex_unlock (&ircsession->mutex_dcc);
-					libirc_mutex_unlock (&dcc->mutex_outbuf);
-					(*dcc->cb_close)(ircsession, dcc->id, LIBIRC_ERR_OK, dcc->ctx);
-					libirc_dcc_destroy_nolock (ircsession, dcc->id);
-				}
-				else
-				{
-					/* Continue to receive the file */
-					dcc->state = LIBIRC_STATE_CONNECTED;
-				}
+				dcc->outgoing_file_confirm_offset = htonl(dcc->file_confirm_offset);
+				dcc->outgoing_offset = sizeof(dcc->outgoing_file_confirm_offset);
 			}
+		}
 
-			/*
-			 * Write bit set - we can send() something, and it won't block.
-			 */
-			if ( FD_ISSET (dcc->sock, out_set) )
-			{
-				int offset, err = 0;
-
-				/*
-				 * Because in some cases outgoing_buf could be changed 
-				 * asynchronously (by another thread), we should lock 
-				 * it.
-				 */
-				libirc_mutex_lock (&dcc->mutex_outbuf);
-
-				offset = dcc->outgoing_offset;
-		
-				if ( offset > 0 )
-				{
-					int length = socket_send (&dcc->sock, dcc->outgoing_buf, offset);
-
-					if ( length < 0 )
-						err = LIBIRC_ERR_WRITE;
-					else if ( length == 0 )
-						err = LIBIRC_ERR_CLOSED;
-					else
-					{
-						if ( dcc->outgoing_offset - length != 0 )
-							memmove (dcc->outgoing_buf, dcc->outgoing_buf + length, dcc->outgoing_offset - length);
-
-						dcc->outgoing_offset -= length;
-					}
-				}
-
-				libirc_mutex_unlock (&dcc->mutex_outbuf);
-
-				/*
-				 * If error arises somewhere above, we inform the caller 
-				 * of failure, and destroy this session.
-				 */
-				if ( err )
-				{
-					libirc_mutex_unlock (&ircsession->mutex_dcc);
-					(*dcc->cb_datum)(ircsession, dcc->id, err, dcc->ctx);
-					libirc_mutex_lock (&ircsession->mutex_dcc);
-					libirc_dcc_destroy_nolock (ircsession, dcc->id);
-				}
-			}
+		libirc_mutex_lock (&ircsession->mutex_dcc);
+	}
+
+	/*
+	 * Session might be closed (with sock = -1) after the in_set 
+	 * processing, so before out_set processing we should check
+	 * for this case
+	 */
+	if ( dcc->state == LIBIRC_STATE_REMOVED )
+		return;
+
+	/*
+	 * If we just sent the confirmation data, change state
+	 * back.
+	 */
+	if ( dcc->state == LIBIRC_STATE_CONFIRM_SIZE )
+	{
+		/*
+		 * If the file is already received, we should inform
+		 * the caller, and close the session.
+		 */
+		if ( dcc->received_file_size == dcc->file_confirm_offset )
+		{
+			libirc_mutex_unlock (&ircsession->mutex_dcc);
+			(*dcc->cb_close)(ircsession, dcc->id, LIBIRC_ERR_OK, dcc->ctx);
+			libirc_mutex_lock (&ircsession->mutex_dcc);
+			libirc_dcc_destroy_nolock (ircsession, dcc->id);
+			return;
+		}
+
+		/* Continue to receive the file */
+		dcc->state = LIBIRC_STATE_CONNECTED;
+	}
+
+	/*
+	 * Write bit set - we can send() something, and it won't block.
+	 */
+	if ( events & LIBIRC_WATCH_WRITE )
+	{
+		int err = libirc_dcc_send_ack (dcc);
+
+		/*
+		 * If error arises somewhere above, we inform the caller 
+		 * of failure, and destroy this session.
+		 */
+		if ( err )
+		{
+			libirc_mutex_unlock (&ircsession->mutex_dcc);
+			(*dcc->cb_datum)(ircsession, dcc->id, err, dcc->ctx);
+			libirc_mutex_lock (&ircsession->mutex_dcc);
+			libirc_dcc_destroy_nolock (ircsession, dcc->id);
+		}
+	}
+}
+
+
+static void libirc_dcc_process_descriptors (irc_session_t * ircsession, fd_set *in_set, fd_set *out_set)
+{
+	unsigned int i;
+
+	if ( libirc_dcc_worker_fd (ircsession) >= 0 && FD_ISSET (libirc_dcc_worker_fd (ircsession), in_set) )
+		libirc_dcc_worker_collect (ircsession);
+
+	/*
+	 * We need to use such a complex scheme here, because on every callback
+	 * a number of DCC sessions could be destroyed.
+	 */
+	libirc_mutex_lock (&ircsession->mutex_dcc);
+
+	for ( i = 0; i < ircsession->dcc_slots && ircsession->dcc_count; i++ )
+	{
+		irc_dcc_session_t * dcc = libirc_dcc_slot (ircsession, i);
+		int events = 0;
+
+		if ( !dcc->id || dcc->sock < 0 )
+			continue;
+
+		if ( FD_ISSET (dcc->sock, in_set) )
+			events |= LIBIRC_WATCH_READ;
+
+		if ( FD_ISSET (dcc->sock, out_set) )
+			events |= LIBIRC_WATCH_WRITE;
+
+		if ( events )
+		{
+			libirc_dcc_process (ircsession, dcc, events);
+			libirc_watch_dirty (ircsession, dcc);
 		}
 	}
 
@@ -347,20 +702,38 @@ static void libirc_dcc_process_descriptors (irc_session_t * ircsession, fd_set *
 
 static int libirc_new_dcc_session (irc_session_t * session, unsigned long ip, unsigned short port, void * ctx, irc_dcc_session_t ** pdcc)
 {
-	irc_dcc_session_t * dcc = malloc (sizeof(irc_dcc_session_t));
+	irc_dcc_session_t * dcc;
+	int err = LIBIRC_ERR_SOCKET, family = PF_INET;
 
-	if ( !dcc )
+	libirc_mutex_lock (&session->mutex_dcc);
+
+	if ( (dcc = libirc_dcc_alloc (session)) == 0 )
+	{
+		libirc_mutex_unlock (&session->mutex_dcc);
 		return LIBIRC_ERR_NOMEM;
+	}
 
-	// setup
-	memset (dcc, 0, sizeof(irc_dcc_session_t));
+#if defined (ENABLE_IPV6)
+	// A listening socket is bound to the local address of the server connection
+	if ( !ip && (session->flags & SESSIONFL_USES_IPV6) )
+		family = PF_INET6;
+#endif
 
-	if ( libirc_mutex_init (&dcc->mutex_outbuf) )
+	if ( socket_create (family, SOCK_STREAM, &dcc->sock) )
 		goto cleanup_exit_error;
 
-	if ( socket_create (PF_INET, SOCK_STREAM, &dcc->sock) )
+	socket_tune (&dcc->sock, &session->tuning_dcc);
+	dcc->quickack = session->tuning_dcc.quickack;
+
+	// A connecting socket takes its source address from the bind pool
+	if ( ip && libirc_bind_acquire (session->bind_pool, &dcc->sock, AF_INET, &dcc->binding) )
+		goto cleanup_exit_error;
+
+	if ( (err = libirc_dcc_map_fd (session, dcc)) != 0 )
 		goto cleanup_exit_error;
 
+	err = LIBIRC_ERR_SOCKET;
+
 	if ( !ip )
 	{
 		unsigned long arg = 1;
@@ -412,17 +785,11 @@ static int libirc_new_dcc_session (irc_session_t * session, unsigned long ip, un
 	}
 
 	dcc->ctx = ctx;
-	time (&dcc->timeout);
-
-	// and store it
-	libirc_mutex_lock (&session->mutex_dcc);
-
-	dcc->id = session->dcc_last_id++;
-	dcc->next = session->dcc_sessions;
-	session->dcc_sessions = dcc;
 
 	libirc_mutex_unlock (&session->mutex_dcc);
 
+	dcc->timer = irc_timer_add (session, session->dcc_timeout * 1000, libirc_dcc_timeout, (void *) (uintptr_t) dcc->id);
+
 	*pdcc = dcc;
 	return 0;
 
@@ -430,8 +797,10 @@ cleanup_exit_error:
 	if ( dcc->sock >= 0 )
 		socket_close (&dcc->sock);
 
-	free (dcc);
-	return LIBIRC_ERR_SOCKET;
+	libirc_bind_release (&dcc->binding);
+	libirc_dcc_free (session, dcc);
+	libirc_mutex_unlock (&session->mutex_dcc);
+	return err;
 }
 
 
@@ -445,12 +814,21 @@ int irc_dcc_destroy (irc_session_t * session, irc_dcc_t dccid)
 	if ( !dcc )
 		return 1;
 
+	// A data thread may be using the session; take it back first
+	if ( dcc->state == LIBIRC_STATE_DETACHED && libirc_dcc_worker_cancel (session, dcc) )
+	{
+		libirc_mutex_unlock (&session->mutex_dcc);
+		return 0;
+	}
+
 	if ( dcc->sock >= 0 )
 		socket_close (&dcc->sock);
 
 	dcc->state = LIBIRC_STATE_REMOVED;
+	libirc_watch_dirty (session, dcc);
 
 	libirc_mutex_unlock (&session->mutex_dcc);
+	libirc_watch_update (session);
 	return 0;
 }
 
@@ -458,33 +836,28 @@ int irc_dcc_destroy (irc_session_t * session, irc_dcc_t dccid)
 static void libirc_dcc_request (irc_session_t * session, const char * nick, const char * req)
 {
 	char filenamebuf[256];
+	const char * args = 0;
+	bool secure = false;
 	uint64_t size;
 	uint32_t ip;
 	uint16_t port;
 
+	// SDCC offers the file with DCC SSEND, and sends it over TLS
+	if ( !strncasecmp (req, "DCC SEND ", 9) )
+		args = req + 9;
+	else if ( !strncasecmp (req, "DCC SSEND ", 10) )
+	{
+		args = req + 10;
+		secure = true;
+	}
+
 	/*
 	 * If the filename contains space characters, it will be delimited by double-quotes,
 	 * which won't be scanned with `%s`.
 	 */
-	if (sscanf(req, "DCC SEND \"%255[^\"]\" %u %hu %"SCNu64, filenamebuf, &ip, &port, &size) == 4) {
-		if ( session->callbacks.event_dcc_send_req )
-		{
-			irc_dcc_session_t * dcc;
-
-			int err = libirc_new_dcc_session (session, ip, port, 0, &dcc);
-			if ( err )
-			{
-				session->lasterror = err;
-				return;
-			}
-
-            		(*session->callbacks.event_dcc_send_req) (session, nick, inet_ntoa (dcc->remote_addr.sin_addr), filenamebuf, size, dcc->id);
-			dcc->received_file_size = size;
-		}
-
-		return;
-	}
-	else if ( sscanf (req, "DCC SEND %255s %u %hu %"SCNu64, filenamebuf, &ip, &port, &size) == 4 )
+	if ( args
+	&& (sscanf (args, "\"%255[^\"]\" %u %hu %"SCNu64, filenamebuf, &ip, &port, &size) == 4
+	|| sscanf (args, "%255s %u %hu %"SCNu64, filenamebuf, &ip, &port, &size) == 4) )
 	{
 		if ( session->callbacks.event_dcc_send_req )
 		{
@@ -497,6 +870,8 @@ static void libirc_dcc_request (irc_session_t * session, const char * nick, cons
 				return;
 			}
 
+			dcc->secure = secure;
+
 			(*session->callbacks.event_dcc_send_req) (session, nick, inet_ntoa (dcc->remote_addr.sin_addr), filenamebuf, size, dcc->id);
 			dcc->received_file_size = size;
 		}
@@ -524,6 +899,17 @@ int irc_dcc_accept (irc_session_t * session, irc_dcc_t dccid, void * ctx, irc_dc
 		return 1;
 	}
 
+#if !defined (ENABLE_SSL)
+	// An SDCC offer cannot be received without TLS
+	if ( dcc->secure )
+	{
+		libirc_dcc_destroy_nolock (session, dccid);
+		libirc_mutex_unlock (&session->mutex_dcc);
+		session->lasterror = LIBIRC_ERR_SSL_NOT_SUPPORTED;
+		return 1;
+	}
+#endif
+
 	dcc->cb_datum = cb_datum;
 	dcc->cb_close = cb_close;
 	dcc->ctx = ctx;
@@ -546,8 +932,61 @@ int irc_dcc_accept (irc_session_t * session, irc_dcc_t dccid, void * ctx, irc_dc
 		dcc->sock_rcvbuf_size = 4192;
 	}
 
+	if ( (dcc->rcvlowat = session->dcc_rcvlowat) != 0 )
+		libirc_dcc_update_rcvlowat (dcc);
+
 	dcc->state = LIBIRC_STATE_CONNECTING;
+	libirc_watch_dirty (session, dcc);
+
 	libirc_mutex_unlock (&session->mutex_dcc);
+	libirc_watch_update (session);
+	return 0;
+}
+
+
+void irc_set_dcc_rcvlowat (irc_session_t * session, unsigned int bytes)
+{
+	session->dcc_rcvlowat = bytes > INT_MAX ? INT_MAX : bytes;
+}
+
+
+int irc_set_socket_tuning (irc_session_t * session, int target, const irc_socket_tuning_t * tuning)
+{
+	struct socket_tuning * t;
+
+	if ( target == LIBIRC_TUNE_SERVER )
+		t = &session->tuning_server;
+	else if ( target == LIBIRC_TUNE_DCC )
+		t = &session->tuning_dcc;
+	else
+	{
+		session->lasterror = LIBIRC_ERR_INVAL;
+		return 1;
+	}
+
+	memset (t, 0, sizeof(*t));
+
+	if ( tuning )
+	{
+		if ( tuning->congestion && strlen (tuning->congestion) >= sizeof(t->congestion) )
+		{
+			session->lasterror = LIBIRC_ERR_INVAL;
+			return 1;
+		}
+
+		t->rcvbuf = tuning->rcvbuf;
+		t->quickack = tuning->quickack;
+		t->nodelay = tuning->nodelay;
+		t->busy_poll = tuning->busy_poll;
+		t->fastopen = tuning->fastopen && target == LIBIRC_TUNE_SERVER;
+
+		if ( tuning->congestion )
+			strcpy (t->congestion, tuning->congestion);
+
+		if ( target == LIBIRC_TUNE_DCC )
+			irc_set_dcc_rcvlowat (session, tuning->rcvlowat);
+	}
+
 	return 0;
 }
 
@@ -568,9 +1007,46 @@ int irc_dcc_decline (irc_session_t * session, irc_dcc_t dccid)
 
 	libirc_dcc_destroy_nolock (session, dccid);
 	libirc_mutex_unlock (&session->mutex_dcc);
+	libirc_watch_update (session);
+	return 0;
+}
+
+int irc_dcc_pause (irc_session_t * session, irc_dcc_t dccid)
+{
+	irc_dcc_session_t * dcc = libirc_find_dcc_session (session, dccid, 1);
+
+	if ( !dcc )
+		return 1;
+
+	// A data thread polls the sessions it has anew each time
+	dcc->paused = true;
+	libirc_watch_dirty (session, dcc);
+
+	libirc_mutex_unlock (&session->mutex_dcc);
+	return 0;
+}
+
+
+int irc_dcc_resume (irc_session_t * session, irc_dcc_t dccid)
+{
+	irc_dcc_session_t * dcc = libirc_find_dcc_session (session, dccid, 1);
+
+	if ( !dcc )
+		return 1;
+
+	dcc->paused = false;
+
+	if ( dcc->state == LIBIRC_STATE_DETACHED )
+		libirc_dcc_worker_wake (session, dcc);
+	else
+		libirc_watch_dirty (session, dcc);
+
+	libirc_mutex_unlock (&session->mutex_dcc);
+	libirc_watch_update (session);
 	return 0;
 }
 
+
 int irc_dcc_read (irc_session_t * session, irc_dcc_t dccid, char * buffer, size_t capacity)
 {
 	irc_dcc_session_t * dcc = libirc_find_dcc_session (session, dccid, 1);
@@ -578,6 +1054,12 @@ int irc_dcc_read (irc_session_t * session, irc_dcc_t dccid, char * buffer, size_
 	if ( !dcc )
 		return -LIBIRC_ERR_INVAL;
 
+	/*
+	 * The session cannot go away while its data callback runs, so the
+	 * list does not have to stay locked during recv(2).
+	 */
+	libirc_mutex_unlock (&session->mutex_dcc);
+
 	size_t recv_limit;
 
 	// Unfortunately, we cannot simply pass `capacity` to recv(2), since very large values may result in EINVAL.
@@ -590,15 +1072,28 @@ int irc_dcc_read (irc_session_t * session, irc_dcc_t dccid, char * buffer, size_
 		recv_limit = capacity;
 	}
 
-	int length = recv (dcc->sock, buffer, recv_limit, 0);
+	int length;
 
-	if ( length < 0 )
-	{
-		return -LIBIRC_ERR_READ;
-	}
+#if defined (ENABLE_SSL)
+	if ( dcc->ssl )
+		length = ssl_dcc_recv (dcc, buffer, recv_limit);
 	else
+#endif
+	length = recv (dcc->sock, buffer, recv_limit, 0);
+
+	if ( length > 0 )
 	{
-	    dcc->file_confirm_offset += length;
-	    return length;
+		dcc->file_confirm_offset += length;
+
+		if ( dcc->quickack )
+			socket_quickack (&dcc->sock);
 	}
+	else if ( length == 0 )
+		dcc->read_error = LIBIRC_ERR_CLOSED;
+	else if ( socket_error() == EINTR || socket_error() == EAGAIN )
+		dcc->would_block = true;
+	else
+		dcc->read_error = LIBIRC_ERR_READ;
+
+	return length < 0 ? -LIBIRC_ERR_READ : length;
 }
\ No newline at end of file
@@ -17,37 +17,95 @@
 
 #include <stdbool.h>
 
+/*
+ * The DCC sessions live in fixed-size slabs, so a session never moves once
+ * allocated. A session id encodes the index of its slot in the low bits and
+ * the slot's generation in the high bits; the generation is bumped whenever
+ * the slot is freed, so an id of a destroyed session no longer matches.
+ */
+#define LIBIRC_DCC_INDEX_BITS		16
+#define LIBIRC_DCC_INDEX_MASK		((1u << LIBIRC_DCC_INDEX_BITS) - 1)
+#define LIBIRC_DCC_NO_SLOT		((unsigned int) -1)
+
+/*
+ * The bind pool address a socket is bound to; see bindpool.c.
+ */
+struct libirc_binding
+{
+	irc_bind_pool_t		* pool;		/*!< 0 if the socket is not bound */
+	unsigned int		slot;
+};
+
+/*
+ * What has been reported of a DCC session's socket through the watch
+ * callbacks. A session whose interest may have changed is queued on the
+ * dirty list, and only those are looked at by the next update. It outlives
+ * the session in its slot, so the removal of a freed session is reported.
+ */
+struct libirc_dcc_watch
+{
+	socket_t		fd;		/*!< -1 if not reported */
+	irc_dcc_t		owner;		/*!< the session the descriptor belonged to */
+	int			events;
+	bool			dirty;		/*!< queued on the dirty list */
+	unsigned int		next;		/*!< the next dirty slot */
+};
+
 /*
  * This structure keeps the state of a single DCC connection.
  */
 struct irc_dcc_session_s
 {
-	irc_dcc_session_t	* next;
+	irc_dcc_t		id;		/*!< 0 while the slot is free */
+	unsigned short		generation;
+	unsigned int		next_free;	/*!< the next free slot */
+	struct libirc_dcc_watch	watch;
 
-	irc_dcc_t		id;
 	void			* ctx;
 	socket_t		sock;		/*!< DCC socket */
+	struct libirc_binding	binding;
 	int			sock_rcvbuf_size;
 
 	int			state;
-	time_t			timeout;
+	irc_timer_t		timer;		/*!< the connect timeout */
 
 	bool			acknowledge;
+	bool			quickack;	/*!< re-arm TCP_QUICKACK after reads */
+	int			read_error;	/*!< set when irc_dcc_read fails */
+	bool			would_block;	/*!< irc_dcc_read found no data */
+
+	int			rcvlowat;	/*!< the requested SO_RCVLOWAT, or 0 */
+	int			rcvlowat_set;	/*!< the SO_RCVLOWAT on the socket */
+	bool			cancelled;	/*!< destroyed from its data thread */
+#if defined (ENABLE_THREADS)
+	atomic_bool		paused;		/*!< the caller stopped reading for now */
+#else
+	bool			paused;
+#endif
+
+	bool			secure;		/*!< offered with DCC SSEND, received over TLS */
+	int			handshake;	/*!< the events the TLS handshake waits for */
+#if defined (ENABLE_SSL)
+	SSL			* ssl;
+	bool			ktls_recv;	/*!< the kernel decrypts the records */
+#endif
+
+#if defined (ENABLE_THREADS)
+	atomic_bool		worker_owned;	/*!< a data thread is using it */
+	struct libirc_dcc_worker * worker;	/*!< that data thread */
+#endif
 
 	uint64_t		received_file_size;
 	uint64_t		file_confirm_offset;
 
 	struct sockaddr_in	remote_addr;
 
-	char 			incoming_buf[LIBIRC_DCC_BUFFER_SIZE];
-	unsigned int		incoming_offset;
-
+	// Only the file offset acknowledgement is ever sent.
 	union {
-		char		outgoing_buf[LIBIRC_DCC_BUFFER_SIZE];
+		char		outgoing_buf[sizeof(uint32_t)];
 		uint32_t	outgoing_file_confirm_offset;
 	};
 	unsigned int		outgoing_offset;
-	port_mutex_t		mutex_outbuf;
 
 	irc_dcc_callback_t	cb_datum;
 	irc_dcc_callback_t	cb_close;
@@ -0,0 +1,260 @@
+/*
+ * Copyright (C) 2004-2012 George Yunaev gyunaev@ulduzsoft.com
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ */
+
+/*
+ * The endpoint cache: a text file that remembers the addresses a server
+ * name resolved to, until they expire, and how connecting to each of them
+ * went. One line per address:
+ *
+ *   <server> <port> <address> <expires> <srtt> <successes> <failures>
+ *
+ * where expires is a time(2) value, srtt the smoothed connect latency in
+ * milliseconds and failures the number of failed attempts since the last
+ * success. The addresses are raced fastest known-good first.
+ */
+
+void irc_set_endpoint_cache (irc_session_t * session, const char * path, unsigned int ttl)
+{
+	free (session->endpoint_cache);
+
+	session->endpoint_cache = path ? strdup (path) : 0;
+	session->endpoint_cache_ttl = ttl;
+}
+
+
+static int libirc_endpoint_same (const struct libirc_endpoint * a, const struct libirc_endpoint * b)
+{
+	if ( a->addr.ss_family != b->addr.ss_family )
+		return 0;
+
+	if ( a->addr.ss_family == AF_INET6 )
+		return !memcmp (&((struct sockaddr_in6 *) &a->addr)->sin6_addr, &((struct sockaddr_in6 *) &b->addr)->sin6_addr, sizeof(struct in6_addr));
+
+	return !memcmp (&((struct sockaddr_in *) &a->addr)->sin_addr, &((struct sockaddr_in *) &b->addr)->sin_addr, sizeof(struct in_addr));
+}
+
+
+/*
+ * Returns nonzero if a should be raced before b: the addresses that
+ * connected last time come first, fastest first, then the untried ones,
+ * and last those that failed, least failed first.
+ */
+static int libirc_endpoint_before (const struct libirc_endpoint * a, const struct libirc_endpoint * b)
+{
+	int ra = a->failures ? 2 : (a->successes ? 0 : 1);
+	int rb = b->failures ? 2 : (b->successes ? 0 : 1);
+
+	if ( ra != rb )
+		return ra < rb;
+
+	if ( ra == 0 )
+		return a->srtt < b->srtt;
+
+	return a->failures < b->failures;
+}
+
+
+// A stable insertion sort, so that the untried addresses keep the resolver's order.
+static void libirc_endpoints_sort (irc_session_t * session)
+{
+	unsigned int i, j;
+
+	for ( i = 1; i < session->endpoint_count; i++ )
+	{
+		struct libirc_endpoint endpoint = session->endpoints[i];
+
+		for ( j = i; j > 0 && libirc_endpoint_before (&endpoint, &session->endpoints[j - 1]); j-- )
+			session->endpoints[j] = session->endpoints[j - 1];
+
+		session->endpoints[j] = endpoint;
+	}
+}
+
+
+/*
+ * Carries the history of the addresses in from over to the matching ones
+ * in to.
+ */
+static void libirc_endpoints_merge (struct libirc_endpoint * to, unsigned int count, const struct libirc_endpoint * from, unsigned int fromcount)
+{
+	unsigned int i, j;
+
+	for ( i = 0; i < count; i++ )
+	{
+		for ( j = 0; j < fromcount; j++ )
+			if ( libirc_endpoint_same (&to[i], &from[j]) )
+				break;
+
+		if ( j == fromcount )
+			continue;
+
+		to[i].srtt = from[j].srtt;
+		to[i].successes = from[j].successes;
+		to[i].failures = from[j].failures;
+	}
+}
+
+
+// Parses a cache line; returns nonzero if it is malformed.
+static int libirc_endpoint_parse (const char * line, char * server, size_t size, unsigned int * port, struct libirc_endpoint * endpoint)
+{
+	char address[INET6_ADDRSTRLEN], fmt[32];
+	long long expires;
+
+	memset (endpoint, 0, sizeof(*endpoint));
+	snprintf (fmt, sizeof(fmt), "%%%us %%u %%%us %%lld %%u %%u %%u", (unsigned) size - 1, (unsigned) sizeof(address) - 1);
+
+	if ( sscanf (line, fmt, server, port, address, &expires, &endpoint->srtt, &endpoint->successes, &endpoint->failures) != 7 )
+		return 1;
+
+	endpoint->expires = (time_t) expires;
+
+	if ( inet_pton (AF_INET, address, &((struct sockaddr_in *) &endpoint->addr)->sin_addr) == 1 )
+	{
+		endpoint->addr.ss_family = AF_INET;
+		endpoint->addrlen = sizeof(struct sockaddr_in);
+	}
+	else if ( inet_pton (AF_INET6, address, &((struct sockaddr_in6 *) &endpoint->addr)->sin6_addr) == 1 )
+	{
+		endpoint->addr.ss_family = AF_INET6;
+		endpoint->addrlen = sizeof(struct sockaddr_in6);
+	}
+	else
+		return 1;
+
+	return 0;
+}
+
+
+// Returns nonzero if the cache line is about the session's server and address family.
+static int libirc_endpoint_ours (irc_session_t * session, const char * server, unsigned int port, const struct libirc_endpoint * endpoint)
+{
+	return !strcmp (server, session->server)
+		&& port == session->server_port
+		&& (session->server_family == AF_UNSPEC || session->server_family == endpoint->addr.ss_family);
+}
+
+
+/*
+ * Loads the cached addresses of the server into session->endpoints, in the
+ * order they are to be raced. Returns nonzero if they have not expired yet,
+ * and can be raced without resolving the name again; otherwise they are
+ * only kept for their history, and none is to be raced.
+ */
+static int libirc_endpoints_load (irc_session_t * session)
+{
+	struct libirc_endpoint endpoint, * endpoints;
+	char line[512], server[256];
+	unsigned int port, i;
+	time_t now = time (0);
+	int fresh = 1;
+	FILE * fp;
+
+	if ( !session->endpoint_cache || (fp = fopen (session->endpoint_cache, "r")) == 0 )
+		return 0;
+
+	while ( fgets (line, sizeof(line), fp) )
+	{
+		if ( libirc_endpoint_parse (line, server, sizeof(server), &port, &endpoint)
+		|| !libirc_endpoint_ours (session, server, port, &endpoint) )
+			continue;
+
+		if ( (endpoints = realloc (session->endpoints, (session->endpoint_count + 1) * sizeof(*endpoints))) == 0 )
+			break;
+
+		if ( endpoint.addr.ss_family == AF_INET6 )
+			((struct sockaddr_in6 *) &endpoint.addr)->sin6_port = htons (session->server_port);
+		else
+			((struct sockaddr_in *) &endpoint.addr)->sin_port = htons (session->server_port);
+
+		session->endpoints = endpoints;
+		session->endpoints[session->endpoint_count++] = endpoint;
+	}
+
+	fclose (fp);
+
+	for ( i = 0; i < session->endpoint_count; i++ )
+		if ( session->endpoints[i].expires <= now )
+			fresh = 0;
+
+	fresh = fresh && session->endpoint_count > 0;
+	libirc_endpoints_sort (session);
+
+	session->endpoint_next = fresh ? 0 : session->endpoint_count;
+	return fresh;
+}
+
+
+static int libirc_endpoints_keep (const char * line, void * ctx)
+{
+	struct libirc_endpoint endpoint;
+	char server[256];
+	unsigned int port;
+
+	return !libirc_endpoint_parse (line, server, sizeof(server), &port, &endpoint)
+		&& !libirc_endpoint_ours ((irc_session_t *) ctx, server, port, &endpoint);
+}
+
+
+static void libirc_endpoints_append (FILE * out, void * ctx)
+{
+	irc_session_t * session = ctx;
+	char address[INET6_ADDRSTRLEN];
+	unsigned int i;
+
+	for ( i = 0; i < session->endpoint_count; i++ )
+	{
+		const struct libirc_endpoint * e = &session->endpoints[i];
+
+		if ( e->addr.ss_family == AF_INET6 )
+			inet_ntop (AF_INET6, &((struct sockaddr_in6 *) &e->addr)->sin6_addr, address, sizeof(address));
+		else
+			inet_ntop (AF_INET, &((struct sockaddr_in *) &e->addr)->sin_addr, address, sizeof(address));
+
+		fprintf (out, "%s %u %s %lld %u %u %u\n", session->server, (unsigned) session->server_port,
+			address, (long long) e->expires, e->srtt, e->successes, e->failures);
+	}
+}
+
+
+/*
+ * Writes the addresses of the server, and their history, back into the
+ * cache; the lines about the other servers are kept.
+ */
+static void libirc_endpoints_save (irc_session_t * session)
+{
+	if ( session->endpoint_cache && session->endpoint_count )
+		libirc_cache_rewrite (session->endpoint_cache, libirc_endpoints_keep, libirc_endpoints_append, session);
+}
+
+
+/*
+ * Records the outcome of a connection attempt to an address.
+ */
+static void libirc_endpoint_result (irc_session_t * session, unsigned int index, int connected)
+{
+	struct libirc_endpoint * endpoint = &session->endpoints[index];
+	unsigned int latency = (unsigned int) (libirc_time_ms () - endpoint->started);
+
+	if ( !connected )
+	{
+		endpoint->failures++;
+		return;
+	}
+
+	// As TCP smooths its round-trip time
+	endpoint->srtt = endpoint->successes ? (7 * endpoint->srtt + latency) / 8 : latency;
+	endpoint->successes++;
+	endpoint->failures = 0;
+}
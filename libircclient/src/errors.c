@@ -35,6 +35,9 @@ static const char * libirc_strerror[LIBIRC_ERR_MAX] =
 	"SSL initialization failed",
 	"SSL connection failed",
 	"SSL certificate verify failed",
+	"SASL authentication failed",
+	"Connection to the server timed out",
+	"Registration timed out",
 };
 
 
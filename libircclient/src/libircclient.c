@@ -20,11 +20,52 @@
 #include "../include/libircclient.h"
 #include "session.h"
 
+static int libirc_session_process (irc_session_t * session, int events);
+static void libirc_watch_update (irc_session_t * session);
+static void libirc_watch_dirty (irc_session_t * session, irc_dcc_session_t * dcc);
+static int libirc_queue_raw (irc_session_t * session, const char * format, ...);
+static void libirc_register (irc_session_t * session);
+static void libirc_phase_start (irc_session_t * session, unsigned int timeout);
+static unsigned int libirc_flood_allowance (irc_session_t * session);
+static void libirc_outgoing_consume (irc_session_t * session, unsigned int length, unsigned int committed);
+static int libirc_send_urgent (irc_session_t * session, const char * format, ...);
+
+static int libirc_dcc_worker_attach (irc_session_t * session, irc_dcc_session_t * dcc);
+static int libirc_dcc_worker_cancel (irc_session_t * session, irc_dcc_session_t * dcc);
+static void libirc_dcc_worker_wake (irc_session_t * session, irc_dcc_session_t * dcc);
+static int libirc_dcc_worker_fd (irc_session_t * session);
+static void libirc_dcc_worker_collect (irc_session_t * session);
+static int libirc_dcc_worker_defer (irc_session_t * session);
+
+#if defined (ENABLE_SSL)
+static int ssl_dcc_handshake (irc_dcc_session_t * dcc);
+static int ssl_dcc_recv (irc_dcc_session_t * dcc, char * buffer, size_t size);
+static int ssl_dcc_send (irc_dcc_session_t * dcc, const char * data, size_t size);
+#endif
+
+/*
+ * irc_run() sleeps until the next timer is due, so a command queued or a
+ * timer added by another thread has to wake it up explicitly.
+ */
+static void libirc_wake_run_loop (irc_session_t * session)
+{
+#if defined (ENABLE_THREADS)
+	if ( session->run_wakefd[1] >= 0 && !pthread_equal (pthread_self (), session->run_thread) )
+		(void) write (session->run_wakefd[1], "", 1);
+#endif
+}
+
 #include "utils.c"
 #include "errors.c"
 #include "colors.c"
+#include "timers.c"
+#include "bindpool.c"
 #include "dcc.c"
+#include "workers.c"
 #include "ssl.c"
+#include "sasl.c"
+#include "endpoints.c"
+#include "connect.c"
 
 irc_session_t * irc_create_session (irc_callbacks_t * callbacks)
 {
@@ -45,9 +86,15 @@ irc_session_t * irc_create_session (irc_callbacks_t * callbacks)
 		return 0;
 	}
 
-	session->dcc_last_id = 1;
+	session->dcc_free = LIBIRC_DCC_NO_SLOT;
+	session->watch_dirty = LIBIRC_DCC_NO_SLOT;
 	session->dcc_timeout = 60;
 
+#if defined (ENABLE_THREADS)
+	session->run_wakefd[0] = session->run_wakefd[1] = -1;
+	session->dcc_donefd[0] = session->dcc_donefd[1] = -1;
+#endif
+
 	memcpy (&session->callbacks, callbacks, sizeof(irc_callbacks_t));
 
 	if ( !session->callbacks.event_ctcp_req )
@@ -82,7 +129,12 @@ static void free_ircsession_strings (irc_session_t * session)
 
 void irc_destroy_session (irc_session_t * session)
 {
+	unsigned int i;
+
+	irc_set_watch_callbacks (session, 0);
+
 	free_ircsession_strings( session );
+	libirc_sasl_free (session);
 
 	// The CTCP VERSION must be freed only now
 	if ( session->ctcp_version )
@@ -91,29 +143,61 @@ void irc_destroy_session (irc_session_t * session)
 	if ( session->sock >= 0 )
 		socket_close (&session->sock);
 
+	libirc_connect_reset (session);
+	free (session->endpoint_cache);
+	libirc_bind_release (&session->binding);
+	irc_set_bind_pool (session, 0);
+
 #if defined (ENABLE_THREADS)
 	libirc_mutex_destroy (&session->mutex_session);
 #endif
 
+	free (session->tls_cache);
+	free (session->client_cert);
+	free (session->client_key);
+	free (session->outgoing_buf);
+
 #if defined (ENABLE_SSL)
 	if ( session->ssl )
 		SSL_free( session->ssl );
+
+	if ( session->tls_session )
+		SSL_SESSION_free (session->tls_session);
 #endif
 	
 	/* 
 	 * delete DCC data 
-	 * libirc_remove_dcc_session removes the DCC session from the list.
 	 */
-	while ( session->dcc_sessions )
-		libirc_remove_dcc_session (session, session->dcc_sessions, 0);
+	libirc_dcc_worker_stop (session);
+
+	for ( i = 0; i < session->dcc_slots; i++ )
+		if ( libirc_dcc_slot (session, i)->id )
+			libirc_remove_dcc_session (session, libirc_dcc_slot (session, i), 0);
+
+	for ( i = 0; i * LIBIRC_DCC_SLAB_SIZE < session->dcc_slots; i++ )
+		free (session->dcc_slabs[i]);
+
+	free (session->dcc_slabs);
+	free (session->dcc_by_fd);
 
 	libirc_mutex_destroy (&session->mutex_dcc);
 
+	free (session->timers);
+
+#if defined (ENABLE_THREADS)
+	if ( session->run_wakefd[0] >= 0 )
+	{
+		close (session->run_wakefd[0]);
+		close (session->run_wakefd[1]);
+	}
+#endif
+
 	free (session);
 }
 
 
-int irc_connect (irc_session_t * session,
+static int libirc_connect_family (irc_session_t * session,
+			int family,
 			const char * server, 
 			unsigned short port,
 			const char * server_password,
@@ -121,8 +205,8 @@ int irc_connect (irc_session_t * session,
 			const char * username,
 			const char * realname)
 {
-	struct sockaddr_in saddr;
 	char * p;
+	int err;
 
 	// Check and copy all the specified fields
 	if ( !server || !nick )
@@ -140,6 +224,8 @@ int irc_connect (irc_session_t * session,
 	// Free the strings if defined; may be the case when the session is reused after the connection fails
 	free_ircsession_strings( session );
 
+	session->flags = 0; // reset in case of reconnect
+
 	// Handle the server # prefix (SSL)
 	if ( server[0] == SSL_PREFIX )
 	{
@@ -172,272 +258,812 @@ int irc_connect (irc_session_t * session,
 		port = atoi( p );
 	}
 
-	// IPv4 address resolving
-	memset( &saddr, 0, sizeof(saddr) );
-	saddr.sin_family = AF_INET;
-	saddr.sin_port = htons (port);		
-	saddr.sin_addr.s_addr = inet_addr( session->server );
-
-	if ( saddr.sin_addr.s_addr == INADDR_NONE )
+	// The socket is created once an address is known; see connect.c
+	if ( (err = libirc_connect_start (session, port, family)) != 0 )
 	{
-		struct hostent *hp;
-#if defined HAVE_GETHOSTBYNAME_R
-		int tmp_errno;
-		struct hostent tmp_hostent;
-		char buf[2048];
+		session->lasterror = err;
+		return 1;
+	}
+
+	session->state = LIBIRC_STATE_CONNECTING;
+	libirc_phase_start (session, session->connect_timeout);
+	libirc_watch_update (session);
+	return 0;
+}
+
+
+int irc_connect (irc_session_t * session,
+			const char * server, 
+			unsigned short port,
+			const char * server_password,
+			const char * nick,
+			const char * username,
+			const char * realname)
+{
+#if defined (ENABLE_IPV6)
+	return libirc_connect_family (session, AF_UNSPEC, server, port, server_password, nick, username, realname);
+#else
+	return libirc_connect_family (session, AF_INET, server, port, server_password, nick, username, realname);
+#endif
+}
 
-		if ( gethostbyname_r (session->server, &tmp_hostent, buf, sizeof(buf), &hp, &tmp_errno) )
-			hp = 0;
+
+int irc_connect6 (irc_session_t * session,
+			const char * server, 
+			unsigned short port,
+			const char * server_password,
+			const char * nick,
+			const char * username,
+			const char * realname)
+{
+#if defined (ENABLE_IPV6)
+	return libirc_connect_family (session, AF_INET6, server, port, server_password, nick, username, realname);
 #else
-		hp = gethostbyname (session->server);
-#endif // HAVE_GETHOSTBYNAME_R
-		if ( !hp )
-		{
-			session->lasterror = LIBIRC_ERR_RESOLV;
-			return 1;
-		}
+	session->lasterror = LIBIRC_ERR_NOIPV6;
+	return 1;
+#endif	
+}
 
-		memcpy (&saddr.sin_addr, hp->h_addr, (size_t) hp->h_length);
-	}
 
-	// create the IRC server socket
-	if ( socket_create( PF_INET, SOCK_STREAM, &session->sock)
-	|| socket_make_nonblocking (&session->sock) )
+int irc_is_connected (irc_session_t * session)
+{
+	return (session->state == LIBIRC_STATE_CONNECTED 
+	|| session->state == LIBIRC_STATE_CONNECTING) ? 1 : 0;
+}
+
+
+int irc_run (irc_session_t * session)
+{
+	if ( session->state != LIBIRC_STATE_CONNECTING )
 	{
-		session->lasterror = LIBIRC_ERR_SOCKET;
+		session->lasterror = LIBIRC_ERR_STATE;
 		return 1;
 	}
 
-#if defined (ENABLE_SSL)
-	// Init the SSL stuff
-	if ( session->flags & SESSIONFL_SSL_CONNECTION )
+#if defined (ENABLE_THREADS)
+	if ( session->run_wakefd[0] < 0 )
 	{
-		int rc = ssl_init( session );
-		
-		if ( rc != 0 )
+		if ( pipe (session->run_wakefd) )
 		{
-			session->lasterror = rc;
+			session->lasterror = LIBIRC_ERR_SOCKET;
 			return 1;
 		}
+
+		socket_make_nonblocking (&session->run_wakefd[0]);
+		socket_make_nonblocking (&session->run_wakefd[1]);
 	}
+
+	session->run_thread = pthread_self ();
 #endif
-	
-	// and connect to the IRC server
-	if ( socket_connect (&session->sock, (struct sockaddr *) &saddr, sizeof(saddr)) )
+
+	while ( irc_is_connected(session) )
 	{
-		session->lasterror = LIBIRC_ERR_CONNECT;
-		return 1;
+		struct timeval tv, *timeout = 0;
+		fd_set in_set, out_set;
+		int maxfd = 0, msec;
+
+		// Sleep until there is I/O or the next timer is due; an idle
+		// session without timers does not wake up at all.
+		if ( (msec = irc_next_timeout (session)) >= 0 )
+		{
+			tv.tv_sec = msec / 1000;
+			tv.tv_usec = (msec % 1000) * 1000;
+			timeout = &tv;
+		}
+
+		// Init sets
+		FD_ZERO (&in_set);
+		FD_ZERO (&out_set);
+
+		irc_add_select_descriptors (session, &in_set, &out_set, &maxfd);
+
+#if defined (ENABLE_THREADS)
+		libirc_add_to_set (session->run_wakefd[0], &in_set, &maxfd);
+#endif
+
+		if ( select (maxfd + 1, &in_set, &out_set, 0, timeout) < 0 )
+		{
+			if ( socket_error() == EINTR )
+				continue;
+
+			session->lasterror = LIBIRC_ERR_TERMINATED;
+			return 1;
+		}
+
+#if defined (ENABLE_THREADS)
+		if ( FD_ISSET (session->run_wakefd[0], &in_set) )
+		{
+			char drain[64];
+			while ( read (session->run_wakefd[0], drain, sizeof(drain)) > 0 )
+				;
+		}
+#endif
+
+		if ( irc_process_select_descriptors (session, &in_set, &out_set) )
+			return 1;
 	}
 
-	session->state = LIBIRC_STATE_CONNECTING;
-	session->flags = SESSIONFL_USES_IPV6; // reset in case of reconnect
 	return 0;
 }
 
 
-int irc_connect6 (irc_session_t * session,
-			const char * server, 
-			unsigned short port,
-			const char * server_password,
-			const char * nick,
-			const char * username,
-			const char * realname)
+/*
+ * Sends a PING once the server has been silent for a keepalive interval,
+ * and drops the connection if it is still silent one interval later.
+ */
+static void libirc_keepalive (irc_session_t * session, irc_timer_t timer, void * ctx)
 {
-#if defined (ENABLE_IPV6)
-	struct sockaddr_in6 saddr;
-	struct addrinfo ainfo, *res = NULL;
-	char portStr[32], *p;
+	uint64_t interval = (uint64_t) session->keepalive_interval * 1000;
+	uint64_t idle = libirc_time_ms () - session->last_recv;
 
-	// Check and copy all the specified fields
-	if ( !server || !nick )
+	session->keepalive_timer = 0;
+
+	if ( session->state != LIBIRC_STATE_CONNECTED || !interval )
+		return;
+
+	if ( idle < interval )
 	{
-		session->lasterror = LIBIRC_ERR_INVAL;
-		return 1;
+		session->keepalive_pinged = false;
+		session->keepalive_timer = irc_timer_add (session, interval - idle, libirc_keepalive, 0);
+		return;
 	}
 
-	if ( session->state != LIBIRC_STATE_INIT )
+	if ( !session->keepalive_pinged )
 	{
-		session->lasterror = LIBIRC_ERR_STATE;
+		session->keepalive_pinged = true;
+		session->keepalive_timer = irc_timer_add (session, interval, libirc_keepalive, 0);
+		irc_send_raw (session, "PING :%s", session->server);
+		return;
+	}
+
+	session->lasterror = LIBIRC_ERR_TIMEOUT;
+	session->state = LIBIRC_STATE_DISCONNECTED;
+	libirc_watch_dirty (session, 0);
+}
+
+
+static void libirc_keepalive_start (irc_session_t * session)
+{
+	if ( session->keepalive_timer )
+		irc_timer_cancel (session, session->keepalive_timer);
+
+	session->keepalive_timer = 0;
+	session->keepalive_pinged = false;
+	session->last_recv = libirc_time_ms ();
+
+	if ( session->keepalive_interval && session->state == LIBIRC_STATE_CONNECTED )
+		session->keepalive_timer = irc_timer_add (session, session->keepalive_interval * 1000, libirc_keepalive, 0);
+}
+
+
+void irc_set_keepalive (irc_session_t * session, unsigned int interval)
+{
+	session->keepalive_interval = interval;
+	libirc_keepalive_start (session);
+}
+
+
+/*
+ * Drops a connection that has not got through its current phase in time:
+ * resolving the name and connecting, then the registration.
+ */
+static void libirc_phase_timeout (irc_session_t * session, irc_timer_t timer, void * ctx)
+{
+	session->phase_timer = 0;
+
+	if ( session->state == LIBIRC_STATE_CONNECTING )
+		libirc_connect_fail (session, LIBIRC_ERR_CONNECT_TIMEOUT);
+	else if ( session->state == LIBIRC_STATE_CONNECTED && !(session->flags & SESSIONFL_MOTD_RECEIVED) )
+	{
+		session->lasterror = LIBIRC_ERR_REGISTER_TIMEOUT;
+		session->state = LIBIRC_STATE_DISCONNECTED;
+		libirc_watch_dirty (session, 0);
+	}
+}
+
+
+// Starts the deadline of the next phase of the connection, if it has one.
+static void libirc_phase_start (irc_session_t * session, unsigned int timeout)
+{
+	if ( session->phase_timer )
+		irc_timer_cancel (session, session->phase_timer);
+
+	session->phase_timer = timeout ? irc_timer_add (session, timeout * 1000, libirc_phase_timeout, 0) : 0;
+}
+
+
+void irc_set_connect_timeout (irc_session_t * session, unsigned int connect, unsigned int registration)
+{
+	session->connect_timeout = connect;
+	session->register_timeout = registration;
+}
+
+
+// Returns nonzero if a connection lost with this error may be made again.
+static int libirc_reconnect_allowed (int err)
+{
+	switch (err)
+	{
+	case LIBIRC_ERR_RESOLV:
+	case LIBIRC_ERR_CONNECT:
+	case LIBIRC_ERR_CLOSED:
+	case LIBIRC_ERR_READ:
+	case LIBIRC_ERR_WRITE:
+	case LIBIRC_ERR_TIMEOUT:
+	case LIBIRC_ERR_TERMINATED:
+	case LIBIRC_ERR_CONNECT_SSL_FAILED:
+	case LIBIRC_ERR_CONNECT_TIMEOUT:
+	case LIBIRC_ERR_REGISTER_TIMEOUT:
 		return 1;
 	}
 
-	// Free the strings if defined; may be the case when the session is reused after the connection fails
-	free_ircsession_strings( session );
+	return 0;
+}
 
-	// Handle the server # prefix (SSL)
-	if ( server[0] == SSL_PREFIX )
+
+static void libirc_reconnect_start (irc_session_t * session, irc_timer_t timer, void * ctx)
+{
+	int err;
+
+	session->reconnect_timer = 0;
+
+	if ( session->state != LIBIRC_STATE_CONNECTING || session->sock >= 0 )
+		return;
+
+	// A failure is handled as if the connection had been lost once more
+	if ( (err = libirc_connect_start (session, session->server_port, session->server_family)) != 0 )
 	{
-#if defined (ENABLE_SSL)
-		server++;
-		session->flags |= SESSIONFL_SSL_CONNECTION;
-#else
-		session->lasterror = LIBIRC_ERR_SSL_NOT_SUPPORTED;
+		session->lasterror = err;
+		session->state = LIBIRC_STATE_DISCONNECTED;
+		return;
+	}
+
+	libirc_phase_start (session, session->connect_timeout);
+}
+
+
+/*
+ * Called once the connection to the server has been lost. Returns nonzero
+ * if the loss is to be reported. Otherwise the session waits for the
+ * reconnect delay in the CONNECTING state, without a socket, so that its
+ * DCC sessions and timers keep being processed, and connects again.
+ */
+static int libirc_reconnect (irc_session_t * session)
+{
+	unsigned int delay = session->reconnect_backoff;
+
+	if ( session->state != LIBIRC_STATE_DISCONNECTED
+	|| !session->reconnect_delay
+	|| (session->flags & SESSIONFL_QUIT_SENT)
+	|| !libirc_reconnect_allowed (session->lasterror) )
 		return 1;
+
+	if ( session->sock >= 0 )
+		socket_close (&session->sock);
+
+	session->sock = -1;
+	libirc_bind_release (&session->binding);
+	libirc_connect_reset (session);
+	libirc_phase_start (session, 0);
+
+#if defined (ENABLE_SSL)
+	if ( session->ssl )
+		SSL_free (session->ssl);
+
+	session->ssl = 0;
 #endif
+
+	// Nothing that was meant for the lost connection goes to the new one
+	libirc_mutex_lock (&session->mutex_session);
+	session->incoming_offset = 0;
+	session->outgoing_offset = 0;
+	session->outgoing_head = 0;
+	session->flood_clock = 0;
+	libirc_mutex_unlock (&session->mutex_session);
+
+	session->flags &= SESSIONFL_SSL_CONNECTION;
+	session->state = LIBIRC_STATE_CONNECTING;
+	libirc_keepalive_start (session);
+
+	if ( (session->reconnect_timer = irc_timer_add (session, delay * 1000, libirc_reconnect_start, 0)) == 0 )
+	{
+		session->state = LIBIRC_STATE_DISCONNECTED;
+		return 1;
 	}
-	
-	if ( username )
-		session->username = strdup (username);
 
-	if ( server_password )
-		session->server_password = strdup (server_password);
+	session->reconnect_backoff = delay < session->reconnect_max_delay / 2 ? delay * 2 : session->reconnect_max_delay;
+	return 0;
+}
 
-	if ( realname )
-		session->realname = strdup (realname);
 
-	session->nick = strdup (nick);
-	session->server = strdup (server);
+void irc_set_reconnect (irc_session_t * session, unsigned int delay, unsigned int max_delay)
+{
+	session->reconnect_delay = delay;
+	session->reconnect_max_delay = max_delay > delay ? max_delay : delay;
+	session->reconnect_backoff = delay;
+}
 
-	// If port number is zero and server contains the port, parse it
-	if ( port == 0 && (p = strchr( session->server, ':' )) != 0 )
+
+int irc_process_timers (irc_session_t * session)
+{
+	int rc;
+
+	session->watch_depth++;
+	rc = libirc_process_timers (session) ? libirc_reconnect (session) : 0;
+	session->watch_depth--;
+
+	libirc_watch_update (session);
+	return rc;
+}
+
+
+/*
+ * The flood control is a token bucket of flood_burst lines, one of which is
+ * earned back every flood_interval milliseconds, as servers meter their
+ * clients. flood_clock is when the bucket is full again; every line sent
+ * pushes it on by an interval. The registration is not metered, for servers
+ * only meter registered clients.
+ *
+ * The head of the outgoing buffer, outgoing_head bytes, goes out first and
+ * takes no tokens: the PONGs are queued there, ahead of the metered lines,
+ * so that a long queue does not get the client dropped for a ping timeout.
+ * A line partly sent, or handed to an SSL_write that is to be repeated,
+ * joins the head too, for nothing to be queued before it. QUIT takes no
+ * token either, but keeps its place, for the lines queued before it are
+ * meant to reach the server.
+ */
+void irc_set_flood_control (irc_session_t * session, unsigned int burst, unsigned int interval)
+{
+	libirc_mutex_lock (&session->mutex_session);
+	session->flood_burst = interval ? burst : 0;
+	session->flood_interval = interval;
+	libirc_mutex_unlock (&session->mutex_session);
+}
+
+
+// Only wakes the event loop up, for the lines held back to be sent.
+static void libirc_flood_refill (irc_session_t * session, irc_timer_t id, void * ctx)
+{
+	libirc_mutex_lock (&session->mutex_session);
+	session->flood_timer = 0;
+	libirc_watch_dirty (session, 0);
+	libirc_mutex_unlock (&session->mutex_session);
+}
+
+
+static int libirc_flood_metered (irc_session_t * session)
+{
+	return session->flood_burst && (session->flags & SESSIONFL_MOTD_RECEIVED);
+}
+
+
+// Returns nonzero if the line takes a token.
+static int libirc_flood_costs (const char * line)
+{
+	return strncmp (line, "QUIT", 4) || (line[4] != ' ' && line[4] != 0x0D);
+}
+
+
+/*
+ * Returns how many bytes of the outgoing buffer may be sent now: the head,
+ * then the lines there are tokens for, all sent at once. Called with the
+ * session mutex held.
+ */
+static unsigned int libirc_flood_allowance (irc_session_t * session)
+{
+	uint64_t now, full;
+	unsigned int tokens, length = session->outgoing_head;
+	char * eol;
+
+	if ( !libirc_flood_metered (session) )
+		return session->outgoing_offset;
+
+	now = libirc_time_ms ();
+	full = (uint64_t) session->flood_burst * session->flood_interval;
+
+	if ( session->flood_clock < now )
+		session->flood_clock = now;
+
+	tokens = session->flood_clock - now < full ? (unsigned int) ((now + full - session->flood_clock) / session->flood_interval) : 0;
+
+	while ( (eol = memchr (session->outgoing_buf + length, '\n', session->outgoing_offset - length)) != 0 )
 	{
-		// Terminate the string and parse the port number
-		*p++ = '\0';
-		port = atoi( p );
+		if ( libirc_flood_costs (session->outgoing_buf + length) )
+		{
+			if ( tokens == 0 )
+				break;
+
+			tokens--;
+		}
+
+		length = eol - session->outgoing_buf + 1;
 	}
-	
-	memset( &saddr, 0, sizeof(saddr) );
-	saddr.sin6_family = AF_INET6;
-	saddr.sin6_port = htons (port);	
-	
-	sprintf( portStr, "%u", (unsigned)port );
 
-	if ( inet_pton( AF_INET6, session->server, (void*) &saddr.sin6_addr ) <= 0 )
-	{		
-		memset( &ainfo, 0, sizeof(ainfo) );
-		ainfo.ai_family = AF_INET6;
-		ainfo.ai_socktype = SOCK_STREAM;
-		ainfo.ai_protocol = 0;
+	return length;
+}
+
+
+/*
+ * If lines are held back, arms a timer to wake the event loop up once a
+ * token has been earned back. Called before the event loop goes to sleep:
+ * after a line is queued, and after a send.
+ */
+static void libirc_flood_wait (irc_session_t * session)
+{
+	irc_timer_t timer = 0;
+
+	libirc_mutex_lock (&session->mutex_session);
+
+	if ( session->outgoing_offset > 0 && !session->flood_timer && libirc_flood_allowance (session) == 0 )
+	{
+		unsigned int delay = (unsigned int) (session->flood_clock - libirc_time_ms ()
+			- (uint64_t) (session->flood_burst - 1) * session->flood_interval);
+
+		timer = session->flood_timer = libirc_timer_add_locked (session, delay, libirc_flood_refill, 0);
+	}
+
+	libirc_mutex_unlock (&session->mutex_session);
+
+	if ( timer )
+		libirc_wake_run_loop (session);
+}
 
-		if ( getaddrinfo( session->server, portStr, &ainfo, &res ) || !res )
+
+/*
+ * Removes the first length bytes, which have been sent, from the outgoing
+ * buffer. committed is how many were handed over: the same, or more when an
+ * SSL_write is to be repeated. The lines handed over join the head, as does
+ * the rest of a line partly sent, and the metered ones take their tokens.
+ * Called with the session mutex held.
+ */
+static void libirc_outgoing_consume (irc_session_t * session, unsigned int length, unsigned int committed)
+{
+	unsigned int end = committed, i;
+	char * eol;
+
+	if ( end > 0 && session->outgoing_buf[end - 1] != '\n'
+	&& (eol = memchr (session->outgoing_buf + end, '\n', session->outgoing_offset - end)) != 0 )
+		end = eol - session->outgoing_buf + 1;
+
+	if ( end > session->outgoing_head )
+	{
+		// The head always ends a line, so the lines joining it start there
+		for ( i = session->outgoing_head; i < end && libirc_flood_metered (session); i = eol - session->outgoing_buf + 1 )
 		{
-			session->lasterror = LIBIRC_ERR_RESOLV;
-			return 1;
+			if ( (eol = memchr (session->outgoing_buf + i, '\n', end - i)) == 0 )
+				break;
+
+			if ( libirc_flood_costs (session->outgoing_buf + i) )
+				session->flood_clock += session->flood_interval;
 		}
-		
-		memcpy( &saddr, res->ai_addr, res->ai_addrlen );
-		freeaddrinfo( res );
+
+		session->outgoing_head = end;
 	}
-	
-	// create the IRC server socket
-	if ( socket_create( PF_INET6, SOCK_STREAM, &session->sock)
-	|| socket_make_nonblocking (&session->sock) )
+
+	if ( length > 0 && session->outgoing_offset - length != 0 )
+		memmove (session->outgoing_buf, session->outgoing_buf + length, session->outgoing_offset - length);
+
+	session->outgoing_offset -= length;
+	session->outgoing_head -= length;
+}
+
+
+/*
+ * Returns the events (LIBIRC_WATCH_READ and LIBIRC_WATCH_WRITE) that the IRC
+ * server socket is waiting for.
+ */
+static int libirc_session_interest (irc_session_t * session)
+{
+	int events = 0;
+
+	libirc_mutex_lock (&session->mutex_session);
+
+	switch (session->state)
 	{
-		session->lasterror = LIBIRC_ERR_SOCKET;
+	case LIBIRC_STATE_CONNECTING:
+		// While connection, only out_set descriptor should be set
+		events |= LIBIRC_WATCH_WRITE;
+		break;
+
+	case LIBIRC_STATE_CONNECTED:
+		// Add input descriptor if there is space in input buffer
+		if ( session->incoming_offset < (sizeof (session->incoming_buf) - 1) 
+		|| (session->flags & SESSIONFL_SSL_WRITE_WANTS_READ) != 0 )
+			events |= LIBIRC_WATCH_READ;
+
+		// Add output descriptor if there is something the flood control lets go
+		if ( libirc_flood_allowance (session) > 0
+		|| (session->flags & SESSIONFL_SSL_READ_WANTS_WRITE) != 0 )
+			events |= LIBIRC_WATCH_WRITE;
+
+		break;
+	}
+
+	libirc_mutex_unlock (&session->mutex_session);
+	return events;
+}
+
+
+int irc_add_select_descriptors (irc_session_t * session, fd_set *in_set, fd_set *out_set, int * maxfd)
+{
+	int events;
+
+	if ( (session->sock < 0 && session->state != LIBIRC_STATE_CONNECTING)
+	|| session->state == LIBIRC_STATE_INIT
+	|| session->state == LIBIRC_STATE_DISCONNECTED )
+	{
+		session->lasterror = LIBIRC_ERR_STATE;
 		return 1;
 	}
 
-#if defined (ENABLE_SSL)
-	// Init the SSL stuff
-	if ( session->flags & SESSIONFL_SSL_CONNECTION )
+	// Still resolving the server name, or racing its addresses
+	if ( session->sock < 0 )
+	{
+		libirc_connect_add_descriptors (session, in_set, out_set, maxfd);
+		libirc_dcc_add_descriptors (session, in_set, out_set, maxfd);
+		return 0;
+	}
+
+	events = libirc_session_interest (session);
+
+	if ( events & LIBIRC_WATCH_READ )
+		libirc_add_to_set (session->sock, in_set, maxfd);
+
+	if ( events & LIBIRC_WATCH_WRITE )
+		libirc_add_to_set (session->sock, out_set, maxfd);
+
+	libirc_dcc_add_descriptors (session, in_set, out_set, maxfd);
+	return 0;
+}
+
+
+/*
+ * Queues the DCC session on the dirty list, so the next update looks at
+ * whether its socket is to be reported differently; with a null \a dcc, the
+ * session's own descriptors are looked at. The session list must be locked
+ * when a DCC session is given.
+ */
+static void libirc_watch_dirty (irc_session_t * session, irc_dcc_session_t * dcc)
+{
+	if ( !session->watch_callbacks.watch_add )
+		return;
+
+	if ( !dcc )
+		session->watch_session_dirty = true;
+	else if ( dcc->id && !dcc->watch.dirty )
+	{
+		dcc->watch.dirty = true;
+		dcc->watch.next = session->watch_dirty;
+		session->watch_dirty = (dcc->id & LIBIRC_DCC_INDEX_MASK) - 1;
+	}
+}
+
+
+/*
+ * Stores the descriptors the session itself currently waits on into
+ * watches, and returns their number; at most LIBIRC_WATCH_SESSION_MAX.
+ */
+static unsigned int libirc_watch_collect (irc_session_t * session, struct libirc_watch * watches)
+{
+	unsigned int count = 0;
+
+	if ( session->sock >= 0
+	&& (session->state == LIBIRC_STATE_CONNECTING || session->state == LIBIRC_STATE_CONNECTED) )
 	{
-		int rc = ssl_init( session );
-		
-		if ( rc != 0 )
-			return rc;
+		watches[count].fd = session->sock;
+		watches[count].events = libirc_session_interest (session);
+		count++;
 	}
-#endif
-	
-	// and connect to the IRC server
-	if ( socket_connect (&session->sock, (struct sockaddr *) &saddr, sizeof(saddr)) )
+	else if ( session->state == LIBIRC_STATE_CONNECTING )
+		count += libirc_connect_collect (session, watches + count);
+
+	if ( libirc_dcc_worker_fd (session) >= 0 )
 	{
-		session->lasterror = LIBIRC_ERR_CONNECT;
-		return 1;
+		watches[count].fd = libirc_dcc_worker_fd (session);
+		watches[count].events = LIBIRC_WATCH_READ;
+		count++;
 	}
 
-	session->state = LIBIRC_STATE_CONNECTING;
-	session->flags = 0; // reset in case of reconnect
-	return 0;
-#else
-	session->lasterror = LIBIRC_ERR_NOIPV6;
-	return 1;
-#endif	
+	return count;
 }
 
 
-int irc_is_connected (irc_session_t * session)
+// Returns the index of the descriptor fd in watches, or count if it is not there.
+static unsigned int libirc_watch_find (const struct libirc_watch * watches, unsigned int count, socket_t fd)
 {
-	return (session->state == LIBIRC_STATE_CONNECTED 
-	|| session->state == LIBIRC_STATE_CONNECTING) ? 1 : 0;
+	unsigned int i;
+
+	for ( i = 0; i < count && watches[i].fd != fd; i++ )
+		;
+
+	return i;
 }
 
 
-int irc_run (irc_session_t * session)
+/*
+ * Brings the host's view of the session's descriptors up to date, by
+ * reporting what changed for those marked dirty since the last update
+ * through the watch callbacks. Does nothing while descriptors are being
+ * processed; the update is then done once the processing is over. A DCC
+ * data thread leaves the update to the thread that drives the session.
+ */
+static void libirc_watch_update (irc_session_t * session)
 {
-	if ( session->state != LIBIRC_STATE_CONNECTING )
+	irc_watch_callbacks_t * cb = &session->watch_callbacks;
+	struct libirc_watch next[LIBIRC_WATCH_SESSION_MAX];
+	unsigned int i, j, count = 0, index, pending = LIBIRC_DCC_NO_SLOT;
+	irc_dcc_session_t * dcc;
+	socket_t fd;
+	bool dirty;
+
+	if ( !cb->watch_add || session->watch_depth > 0 || libirc_dcc_worker_defer (session) )
+		return;
+
+	libirc_dcc_reap (session);
+
+	// A line may be queued from another thread
+	libirc_mutex_lock (&session->mutex_session);
+	dirty = session->watch_session_dirty;
+	session->watch_session_dirty = false;
+	libirc_mutex_unlock (&session->mutex_session);
+
+	if ( dirty )
+		count = libirc_watch_collect (session, next);
+
+	// Removals are reported first, so the host never sees a descriptor
+	// number added twice when it has been reused by a new socket.
+	for ( i = 0; dirty && i < session->watch_count; i++ )
+		if ( libirc_watch_find (next, count, session->watches[i].fd) == count && cb->watch_remove )
+			(*cb->watch_remove) (session, session->watches[i].fd, 0, cb->ctx);
+
+	libirc_mutex_lock (&session->mutex_dcc);
+
+	// The DCC sessions left with something to report are kept for the second pass
+	while ( (index = session->watch_dirty) != LIBIRC_DCC_NO_SLOT )
 	{
-		session->lasterror = LIBIRC_ERR_STATE;
-		return 1;
+		dcc = libirc_dcc_slot (session, index);
+		session->watch_dirty = dcc->watch.next;
+		fd = libirc_dcc_watch_fd (dcc);
+
+		if ( dcc->watch.fd >= 0 && (dcc->watch.fd != fd || dcc->watch.owner != dcc->id) )
+		{
+			socket_t old = dcc->watch.fd;
+
+			dcc->watch.fd = -1;
+
+			if ( cb->watch_remove )
+			{
+				libirc_mutex_unlock (&session->mutex_dcc);
+				(*cb->watch_remove) (session, old, 0, cb->ctx);
+				libirc_mutex_lock (&session->mutex_dcc);
+			}
+		}
+
+		if ( fd >= 0 && (dcc->watch.fd < 0 || dcc->watch.events != libirc_dcc_interest (dcc)) )
+		{
+			dcc->watch.next = pending;
+			pending = index;
+		}
+		else
+			dcc->watch.dirty = false;
 	}
 
-	while ( irc_is_connected(session) )
+	libirc_mutex_unlock (&session->mutex_dcc);
+
+	for ( j = 0; dirty && j < count; j++ )
 	{
-		struct timeval tv;
-		fd_set in_set, out_set;
-		int maxfd = 0;
+		i = libirc_watch_find (session->watches, session->watch_count, next[j].fd);
 
-		tv.tv_usec = 250000;
-		tv.tv_sec = 0;
+		if ( i == session->watch_count )
+			(*cb->watch_add) (session, next[j].fd, next[j].events, cb->ctx);
+		else if ( session->watches[i].events != next[j].events && cb->watch_modify )
+			(*cb->watch_modify) (session, next[j].fd, next[j].events, cb->ctx);
+	}
 
-		// Init sets
-		FD_ZERO (&in_set);
-		FD_ZERO (&out_set);
+	if ( dirty )
+	{
+		memcpy (session->watches, next, count * sizeof(*next));
+		session->watch_count = count;
+	}
 
-		irc_add_select_descriptors (session, &in_set, &out_set, &maxfd);
+	libirc_mutex_lock (&session->mutex_dcc);
+
+	while ( (index = pending) != LIBIRC_DCC_NO_SLOT )
+	{
+		int events;
+		bool added;
+
+		dcc = libirc_dcc_slot (session, index);
+		pending = dcc->watch.next;
+		dcc->watch.dirty = false;
+		fd = libirc_dcc_watch_fd (dcc);
 
-		if ( select (maxfd + 1, &in_set, &out_set, 0, &tv) < 0 )
+		// Changed once more while the host was being told; left to the next update
+		if ( fd < 0 || (dcc->watch.fd >= 0 && (dcc->watch.fd != fd || dcc->watch.owner != dcc->id)) )
 		{
-			if ( socket_error() == EINTR )
-				continue;
+			if ( dcc->watch.fd >= 0 )
+				libirc_watch_dirty (session, dcc);
 
-			session->lasterror = LIBIRC_ERR_TERMINATED;
-			return 1;
+			continue;
 		}
 
-		if ( irc_process_select_descriptors (session, &in_set, &out_set) )
-			return 1;
+		events = libirc_dcc_interest (dcc);
+
+		if ( dcc->watch.fd >= 0 && dcc->watch.events == events )
+			continue;
+
+		added = dcc->watch.fd < 0;
+		dcc->watch.fd = fd;
+		dcc->watch.owner = dcc->id;
+		dcc->watch.events = events;
+
+		libirc_mutex_unlock (&session->mutex_dcc);
+
+		if ( added )
+			(*cb->watch_add) (session, fd, events, cb->ctx);
+		else if ( cb->watch_modify )
+			(*cb->watch_modify) (session, fd, events, cb->ctx);
+
+		libirc_mutex_lock (&session->mutex_dcc);
 	}
 
-	return 0;
+	libirc_mutex_unlock (&session->mutex_dcc);
 }
 
 
-int irc_add_select_descriptors (irc_session_t * session, fd_set *in_set, fd_set *out_set, int * maxfd)
+int irc_set_watch_callbacks (irc_session_t * session, const irc_watch_callbacks_t * callbacks)
 {
-	if ( session->sock < 0 
-	|| session->state == LIBIRC_STATE_INIT
-	|| session->state == LIBIRC_STATE_DISCONNECTED )
+	irc_watch_callbacks_t old = session->watch_callbacks;
+	unsigned int i, index;
+
+	if ( callbacks && !callbacks->watch_add )
 	{
-		session->lasterror = LIBIRC_ERR_STATE;
+		session->lasterror = LIBIRC_ERR_INVAL;
 		return 1;
 	}
 
-	libirc_mutex_lock (&session->mutex_session);
+	if ( callbacks )
+		memcpy (&session->watch_callbacks, callbacks, sizeof(irc_watch_callbacks_t));
+	else
+		memset (&session->watch_callbacks, 0, sizeof(irc_watch_callbacks_t));
 
-	switch (session->state)
+	// Withdraw everything reported through the previous callbacks
+	if ( old.watch_remove )
+		for ( i = 0; i < session->watch_count; i++ )
+			(*old.watch_remove) (session, session->watches[i].fd, 0, old.ctx);
+
+	session->watch_count = 0;
+
+	libirc_mutex_lock (&session->mutex_dcc);
+
+	while ( (index = session->watch_dirty) != LIBIRC_DCC_NO_SLOT )
 	{
-	case LIBIRC_STATE_CONNECTING:
-		// While connection, only out_set descriptor should be set
-		libirc_add_to_set (session->sock, out_set, maxfd);
-		break;
+		session->watch_dirty = libirc_dcc_slot (session, index)->watch.next;
+		libirc_dcc_slot (session, index)->watch.dirty = false;
+	}
 
-	case LIBIRC_STATE_CONNECTED:
-		// Add input descriptor if there is space in input buffer
-		if ( session->incoming_offset < (sizeof (session->incoming_buf) - 1) 
-		|| (session->flags & SESSIONFL_SSL_WRITE_WANTS_READ) != 0 )
-			libirc_add_to_set (session->sock, in_set, maxfd);
+	// ...and report everything anew through the new ones
+	for ( i = 0; i < session->dcc_slots; i++ )
+	{
+		irc_dcc_session_t * dcc = libirc_dcc_slot (session, i);
+		socket_t fd = dcc->watch.fd;
 
-		// Add output descriptor if there is something in output buffer
-		if ( libirc_findcrlf (session->outgoing_buf, session->outgoing_offset) > 0
-		|| (session->flags & SESSIONFL_SSL_READ_WANTS_WRITE) != 0 )
-			libirc_add_to_set (session->sock, out_set, maxfd);
+		dcc->watch.fd = -1;
 
-		break;
+		if ( fd >= 0 && old.watch_remove )
+		{
+			libirc_mutex_unlock (&session->mutex_dcc);
+			(*old.watch_remove) (session, fd, 0, old.ctx);
+			libirc_mutex_lock (&session->mutex_dcc);
+		}
+
+		libirc_watch_dirty (session, dcc);
 	}
 
-	libirc_mutex_unlock (&session->mutex_session);
+	libirc_mutex_unlock (&session->mutex_dcc);
 
-	libirc_dcc_add_descriptors (session, in_set, out_set, maxfd);
+	libirc_watch_dirty (session, 0);
+	libirc_watch_update (session);
 	return 0;
 }
 
@@ -542,10 +1168,13 @@ static void libirc_process_incoming_data (irc_session_t * session, size_t proces
 	// Handle PING/PONG
 	if ( command && !strncmp (command, "PING", buf_end - command) && params[0] )
 	{
-		irc_send_raw (session, "PONG %s", params[0]);
+		libirc_send_urgent (session, "PONG %s", params[0]);
 		return;
 	}
 
+	if ( libirc_sasl_process (session, command, code, params, paramindex) )
+		return;
+
 	// and dump
 	if ( code )
 	{
@@ -554,6 +1183,8 @@ static void libirc_process_incoming_data (irc_session_t * session, size_t proces
 		if ( (code == 1 || code == 376 || code == 422) && !(session->flags & SESSIONFL_MOTD_RECEIVED ) )
 		{
 			session->flags |= SESSIONFL_MOTD_RECEIVED;
+			session->reconnect_backoff = session->reconnect_delay;
+			libirc_phase_start (session, 0);
 
 			if ( session->callbacks.event_connect )
 				(*session->callbacks.event_connect) (session, "CONNECT", prefix, params, paramindex);
@@ -735,7 +1366,9 @@ static void libirc_process_incoming_data (irc_session_t * session, size_t proces
 
 int irc_process_select_descriptors (irc_session_t * session, fd_set *in_set, fd_set *out_set)
 {
-	if ( session->sock < 0 
+	int events = 0;
+
+	if ( (session->sock < 0 && session->state != LIBIRC_STATE_CONNECTING)
 	|| session->state == LIBIRC_STATE_INIT
 	|| session->state == LIBIRC_STATE_DISCONNECTED )
 	{
@@ -744,15 +1377,90 @@ int irc_process_select_descriptors (irc_session_t * session, fd_set *in_set, fd_
 	}
 
 	session->lasterror = 0;
+
+	if ( libirc_process_timers (session) )
+		return libirc_reconnect (session);
+
 	libirc_dcc_process_descriptors (session, in_set, out_set);
 
+	if ( session->sock < 0 )
+		return libirc_connect_process_descriptors (session, in_set, out_set) ? libirc_reconnect (session) : 0;
+
+	if ( session->sock >= 0 && FD_ISSET (session->sock, in_set) )
+		events |= LIBIRC_WATCH_READ;
+
+	if ( session->sock >= 0 && FD_ISSET (session->sock, out_set) )
+		events |= LIBIRC_WATCH_WRITE;
+
+	return libirc_session_process (session, events) ? libirc_reconnect (session) : 0;
+}
+
+
+int irc_process_descriptor (irc_session_t * session, int fd, int events)
+{
+	irc_dcc_session_t * dcc;
+	int rc = 0;
+
+	if ( session->state == LIBIRC_STATE_INIT )
+	{
+		session->lasterror = LIBIRC_ERR_STATE;
+		return 1;
+	}
+
+	session->lasterror = 0;
+	session->watch_depth++;
+
+	if ( libirc_process_timers (session) )
+		rc = 1;
+	else if ( fd == session->sock )
+		rc = libirc_session_process (session, events);
+	else if ( libirc_connect_owns (session, fd) )
+		rc = libirc_connect_process (session, fd, events);
+	else if ( fd == libirc_dcc_worker_fd (session) )
+		libirc_dcc_worker_collect (session);
+	else
+	{
+		libirc_mutex_lock (&session->mutex_dcc);
+
+		if ( (dcc = libirc_find_dcc_session_by_fd (session, fd)) != 0 )
+		{
+			libirc_dcc_process (session, dcc, events);
+			libirc_watch_dirty (session, dcc);
+		}
+
+		libirc_mutex_unlock (&session->mutex_dcc);
+	}
+
+	if ( rc )
+		rc = libirc_reconnect (session);
+
+	session->watch_depth--;
+	libirc_watch_update (session);
+	return rc;
+}
+
+
+/*
+ * Processes the readiness \a events of the IRC server socket.
+ */
+static int libirc_session_process (irc_session_t * session, int events)
+{
+	if ( session->sock < 0 
+	|| session->state == LIBIRC_STATE_INIT
+	|| session->state == LIBIRC_STATE_DISCONNECTED )
+	{
+		session->lasterror = LIBIRC_ERR_STATE;
+		return 1;
+	}
+
+	// Whatever happens on the socket may change what it waits for
+	libirc_watch_dirty (session, 0);
+
 	// Handle "connection succeed" / "connection failed"
 	if ( session->state == LIBIRC_STATE_CONNECTING )
 	{
-		char hname[256];
-
 		// If the socket is not connected yet, wait longer - it is not an error
-		if ( !FD_ISSET (session->sock, out_set) )
+		if ( !(events & LIBIRC_WATCH_WRITE) )
 			return 0;
         
 		// Now we have to determine whether the socket is connected 
@@ -770,39 +1478,39 @@ int irc_process_select_descriptors (irc_session_t * session, fd_set *in_set, fd_
 			return 1;
 		}
 
-		if (saddr.ss_family == AF_INET)
-			memcpy (&session->local_addr, &((struct sockaddr_in *)&laddr)->sin_addr, sizeof(struct in_addr));
+		if ( laddr.ss_family == AF_INET6 )
+		{
+#if defined (ENABLE_IPV6)
+			memcpy (&session->local_addr6, &((struct sockaddr_in6 *)&laddr)->sin6_addr, sizeof(struct in6_addr));
+#endif
+			session->flags |= SESSIONFL_USES_IPV6;
+		}
 		else
-			memcpy (&session->local_addr, &((struct sockaddr_in6 *)&laddr)->sin6_addr, sizeof(struct in6_addr));
+			memcpy (&session->local_addr, &((struct sockaddr_in *)&laddr)->sin_addr, sizeof(struct in_addr));
 
 #if defined (ENABLE_DEBUG)
 		if ( IS_DEBUG_ENABLED(session) )
-			fprintf (stderr, "[DEBUG] Detected local address: %s\n", inet_ntoa(session->local_addr));
-#endif
-
-		session->state = LIBIRC_STATE_CONNECTED;
+		{
+			char addr[INET6_ADDRSTRLEN];
 
-		// Get the hostname
-		if ( gethostname (hname, sizeof(hname)) < 0 )
-			strcpy (hname, "unknown");
+			if ( laddr.ss_family == AF_INET6 )
+				inet_ntop (AF_INET6, &((struct sockaddr_in6 *)&laddr)->sin6_addr, addr, sizeof(addr));
+			else
+				inet_ntop (AF_INET, &session->local_addr, addr, sizeof(addr));
 
-		// Prepare the data, which should be sent to the server
-		if ( session->server_password )
-			irc_send_raw (session, "PASS %s", session->server_password);
+			fprintf (stderr, "[DEBUG] Detected local address: %s\n", addr);
+		}
+#endif
 
-		irc_send_raw (session, "NICK %s", session->nick);
+		session->state = LIBIRC_STATE_CONNECTED;
+		libirc_keepalive_start (session);
+		libirc_phase_start (session, session->register_timeout);
 
-		/*
-		 * RFC 1459 states that "hostname and servername are normally 
-		 * ignored by the IRC server when the USER command comes from 
-		 * a directly connected client (for security reasons)", therefore 
-		 * we don't need them.
-		 */
-		irc_send_raw (session, "USER %s unknown unknown :%s",
-			      session->username ? session->username : "nobody",
-			      session->realname ? session->realname : "noname");
+		// Unless it has been sent along with the SYN already
+		libirc_register (session);
 
-		return 0;
+		// The socket is writable: send the whole registration in a single
+		// write now, rather than after another round of the event loop.
 	}
 
 	if ( session->state != LIBIRC_STATE_CONNECTED )
@@ -812,7 +1520,7 @@ int irc_process_select_descriptors (irc_session_t * session, fd_set *in_set, fd_
 	}
 
 	// Hey, we've got something to read!
-	if ( FD_ISSET (session->sock, in_set) )
+	if ( events & LIBIRC_WATCH_READ )
 	{
 		int offset, length = session_socket_read( session );
 
@@ -827,6 +1535,9 @@ int irc_process_select_descriptors (irc_session_t * session, fd_set *in_set, fd_
 
 		session->incoming_offset += length;
 
+		if ( session->keepalive_interval )
+			session->last_recv = libirc_time_ms ();
+
 		// process the incoming data
 		while ( (offset = libirc_findcrlf (session->incoming_buf, session->incoming_offset)) > 0 )
 		{
@@ -844,16 +1555,22 @@ int irc_process_select_descriptors (irc_session_t * session, fd_set *in_set, fd_
 
 			session->incoming_offset -= offset;
 		}
+
+		// A message may have ended the session, such as a failed SASL authentication
+		if ( session->state == LIBIRC_STATE_DISCONNECTED )
+			return 1;
 	}
 
 	// We can write a stored buffer
-	if ( FD_ISSET (session->sock, out_set) )
+	if ( events & LIBIRC_WATCH_WRITE )
 	{
+		unsigned int allowed;
 		int length;
 
 		// Because outgoing_buf could be changed asynchronously, we should lock any change
 		libirc_mutex_lock (&session->mutex_session);
-		length = session_socket_write( session );
+		allowed = libirc_flood_allowance (session);
+		length = session_socket_write( session, allowed );
 
 		if ( length < 0 )
 		{
@@ -871,54 +1588,198 @@ int irc_process_select_descriptors (irc_session_t * session, fd_set *in_set, fd_
 			libirc_dump_data ("SEND", session->outgoing_buf, length);
 #endif
 
-		if ( length > 0 && session->outgoing_offset - length != 0 )
-			memmove (session->outgoing_buf, session->outgoing_buf + length, session->outgoing_offset - length);
-
-		session->outgoing_offset -= length;
+		libirc_outgoing_consume (session, length, length ? length : allowed);
 		libirc_mutex_unlock (&session->mutex_session);
+
+		libirc_flood_wait (session);
 	}
 
 	return 0;
 }
 
 
-int irc_send_raw (irc_session_t * session, const char * format, ...)
+/*
+ * Makes room for size more bytes in the outgoing buffer, which doubles as
+ * needed up to LIBIRC_OUTGOING_MAX. Returns nonzero if it cannot.
+ */
+static int libirc_outgoing_reserve (irc_session_t * session, unsigned int size)
 {
-	char buf[1024];
-	va_list va_alist;
+	unsigned int capacity = session->outgoing_size ? session->outgoing_size : LIBIRC_BUFFER_SIZE;
+	char * buf;
 
-	if ( session->state != LIBIRC_STATE_CONNECTED )
+	if ( size <= session->outgoing_size - session->outgoing_offset )
+		return 0;
+
+	if ( size > LIBIRC_OUTGOING_MAX - session->outgoing_offset )
+		return 1;
+
+	while ( capacity < session->outgoing_offset + size )
+		capacity *= 2;
+
+	if ( capacity > LIBIRC_OUTGOING_MAX )
+		capacity = LIBIRC_OUTGOING_MAX;
+
+	if ( (buf = realloc (session->outgoing_buf, capacity)) == 0 )
+		return 1;
+
+	session->outgoing_buf = buf;
+	session->outgoing_size = capacity;
+	return 0;
+}
+
+
+/*
+ * Appends a line to the outgoing buffer, whatever the state of the session;
+ * an urgent line goes at the end of its head instead. A line longer than
+ * LIBIRC_LINE_MAX with its CRLF is truncated.
+ */
+static int libirc_vqueue_raw (irc_session_t * session, int urgent, const char * format, va_list va_alist)
+{
+	va_list va_measure;
+	unsigned int at;
+	int length;
+
+	va_copy (va_measure, va_alist);
+	length = vsnprintf (0, 0, format, va_measure);
+	va_end (va_measure);
+
+	if ( length < 0 )
 	{
-		session->lasterror = LIBIRC_ERR_STATE;
+		session->lasterror = LIBIRC_ERR_INVAL;
 		return 1;
 	}
 
-	va_start (va_alist, format);
-	vsnprintf (buf, sizeof(buf), format, va_alist);
-	va_end (va_alist);
+	if ( length > LIBIRC_LINE_MAX - 2 )
+		length = LIBIRC_LINE_MAX - 2;
 
 	libirc_mutex_lock (&session->mutex_session);
 
-	if ( (strlen(buf) + 2) >= (sizeof(session->outgoing_buf) - session->outgoing_offset) )
+	// The line, its CRLF, and the terminating zero vsnprintf writes
+	if ( libirc_outgoing_reserve (session, (unsigned int) length + 3) )
 	{
 		libirc_mutex_unlock (&session->mutex_session);
 		session->lasterror = LIBIRC_ERR_NOMEM;
 		return 1;
 	}
 
-	strcpy (session->outgoing_buf + session->outgoing_offset, buf);
-	session->outgoing_offset += strlen (buf);
-	session->outgoing_buf[session->outgoing_offset++] = 0x0D;
-	session->outgoing_buf[session->outgoing_offset++] = 0x0A;
+	at = urgent ? session->outgoing_head : session->outgoing_offset;
+
+	// The terminating zero of vsnprintf lands where the CR goes
+	memmove (session->outgoing_buf + at + length + 2, session->outgoing_buf + at, session->outgoing_offset - at);
+	vsnprintf (session->outgoing_buf + at, length + 1, format, va_alist);
+	session->outgoing_buf[at + length] = 0x0D;
+	session->outgoing_buf[at + length + 1] = 0x0A;
+	session->outgoing_offset += length + 2;
+
+	if ( urgent )
+		session->outgoing_head += length + 2;
 
+	libirc_watch_dirty (session, 0);
 	libirc_mutex_unlock (&session->mutex_session);
+
+	libirc_flood_wait (session);
+	return 0;
+}
+
+
+// Queues the lines the library sends on its own, such as the registration.
+static int libirc_queue_raw (irc_session_t * session, const char * format, ...)
+{
+	va_list va_alist;
+	int rc;
+
+	va_start (va_alist, format);
+	rc = libirc_vqueue_raw (session, 0, format, va_alist);
+	va_end (va_alist);
+
+	return rc;
+}
+
+
+/*
+ * Queues the registration: the SASL capability request, PASS, NICK and
+ * USER. It is queued once per connection, either when the socket connects,
+ * or before, to be sent along with the SYN; see connect.c.
+ */
+static void libirc_register (irc_session_t * session)
+{
+	if ( session->flags & SESSIONFL_REGISTRATION_QUEUED )
+		return;
+
+	session->flags |= SESSIONFL_REGISTRATION_QUEUED;
+
+	// Prepare the data, which should be sent to the server
+	libirc_sasl_start (session);
+
+	if ( session->server_password )
+		libirc_queue_raw (session, "PASS %s", session->server_password);
+
+	libirc_queue_raw (session, "NICK %s", session->nick);
+
+	/*
+	 * RFC 1459 states that "hostname and servername are normally 
+	 * ignored by the IRC server when the USER command comes from 
+	 * a directly connected client (for security reasons)", therefore 
+	 * we don't need them.
+	 */
+	libirc_queue_raw (session, "USER %s unknown unknown :%s",
+		      session->username ? session->username : "nobody",
+		      session->realname ? session->realname : "noname");
+}
+
+
+static int libirc_vsend_raw (irc_session_t * session, int urgent, const char * format, va_list va_alist)
+{
+	if ( session->state != LIBIRC_STATE_CONNECTED )
+	{
+		session->lasterror = LIBIRC_ERR_STATE;
+		return 1;
+	}
+
+	if ( libirc_vqueue_raw (session, urgent, format, va_alist) )
+		return 1;
+
+	libirc_wake_run_loop (session);
+	libirc_watch_update (session);
 	return 0;
 }
 
 
+int irc_send_raw (irc_session_t * session, const char * format, ...)
+{
+	va_list va_alist;
+	int rc;
+
+	va_start (va_alist, format);
+	rc = libirc_vsend_raw (session, 0, format, va_alist);
+	va_end (va_alist);
+
+	return rc;
+}
+
+
+// Sends a line ahead of those the flood control holds back.
+static int libirc_send_urgent (irc_session_t * session, const char * format, ...)
+{
+	va_list va_alist;
+	int rc;
+
+	va_start (va_alist, format);
+	rc = libirc_vsend_raw (session, 1, format, va_alist);
+	va_end (va_alist);
+
+	return rc;
+}
+
+
 int irc_cmd_quit (irc_session_t * session, const char * reason)
 {
-	return irc_send_raw (session, "QUIT :%s", reason ? reason : "quit");
+	if ( irc_send_raw (session, "QUIT :%s", reason ? reason : "quit") )
+		return 1;
+
+	// The server closing the connection now is no reason to reconnect
+	session->flags |= SESSIONFL_QUIT_SENT;
+	return 0;
 }
 
 
@@ -1124,11 +1985,23 @@ void irc_set_ctcp_version (irc_session_t * session, const char * version)
 
 void irc_disconnect (irc_session_t * session)
 {
+	// Withdraw the socket from the host's event loop before it is closed
+	session->state = LIBIRC_STATE_INIT;
+	libirc_watch_dirty (session, 0);
+	libirc_watch_update (session);
+
 	if ( session->sock >= 0 )
 		socket_close (&session->sock);
 
 	session->sock = -1;
-	session->state = LIBIRC_STATE_INIT;
+	libirc_bind_release (&session->binding);
+	libirc_connect_reset (session);
+	libirc_phase_start (session, 0);
+
+	if ( session->reconnect_timer )
+		irc_timer_cancel (session, session->reconnect_timer);
+
+	session->reconnect_timer = 0;
 }
 
 
@@ -20,7 +20,12 @@
 #define LIBIRC_VERSION_LOW		10
 
 #define LIBIRC_BUFFER_SIZE		1024
-#define LIBIRC_DCC_BUFFER_SIZE		1024
+#define LIBIRC_LINE_MAX			512	// an IRC line, with its CRLF
+#define LIBIRC_OUTGOING_MAX		(256 * 1024)	// the most the outgoing queue grows to
+#define LIBIRC_DCC_SLAB_SIZE		64	// DCC sessions allocated at once
+#define LIBIRC_DCC_DRAIN_ROUNDS		16	// reads per wakeup with SO_RCVLOWAT
+#define LIBIRC_CONNECT_ATTEMPTS		4	// server connection attempts raced at once
+#define LIBIRC_CONNECT_STAGGER		250	// ms before the next address is raced
 
 #define LIBIRC_STATE_INIT		0
 #define LIBIRC_STATE_LISTENING		1
@@ -28,6 +33,8 @@
 #define LIBIRC_STATE_CONNECTED		3
 #define LIBIRC_STATE_DISCONNECTED	4
 #define LIBIRC_STATE_CONFIRM_SIZE	5	// Used only by DCC send to confirm the amount of sent data
+#define LIBIRC_STATE_DETACHED		6	// DCC only: the file is received on a data thread
+#define LIBIRC_STATE_HANDSHAKE		7	// DCC only: the TLS handshake of an SDCC receive
 #define LIBIRC_STATE_REMOVED		10	// this state is used only in DCC
 
 
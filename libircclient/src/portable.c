@@ -12,6 +12,13 @@
  * License for more details.
  */
 
+#include "config.h"
+
+// for pthread_setaffinity_np()
+#if defined (__linux__) && !defined (_GNU_SOURCE)
+	#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdarg.h>
 #include <unistd.h>
@@ -27,9 +34,12 @@
 #include <errno.h>
 #include <ctype.h>
 #include <time.h>
+#include <limits.h>
+#include <stdint.h>
 
 #if defined (ENABLE_THREADS)
 	#include <pthread.h>
+	#include <stdatomic.h>
 	typedef pthread_mutex_t		port_mutex_t;
 
 	#if !defined (PTHREAD_MUTEX_RECURSIVE) && defined (PTHREAD_MUTEX_RECURSIVE_NP)
@@ -42,6 +52,7 @@
 	#include <openssl/ssl.h>
 	#include <openssl/err.h>
 	#include <openssl/rand.h>
+	#include <openssl/evp.h>
 #endif
 
 
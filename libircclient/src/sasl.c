@@ -0,0 +1,229 @@
+/*
+ * Copyright (C) 2004-2012 George Yunaev gyunaev@ulduzsoft.com
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ */
+
+/*
+ * SASL authentication, as specified by IRCv3 sasl-3.1. The capability is
+ * requested in the registration burst, ahead of NICK and USER, which holds
+ * the registration back until CAP END; so the account is identified by the
+ * time RPL_WELCOME arrives, without any NickServ round trips.
+ */
+
+#define LIBIRC_SASL_STATE_NONE		0
+#define LIBIRC_SASL_STATE_REQUESTED	1	// CAP REQ sent
+#define LIBIRC_SASL_STATE_AUTHENTICATING 2	// AUTHENTICATE sent
+#define LIBIRC_SASL_STATE_DONE		3
+
+// The longest AUTHENTICATE payload line allowed by the specification.
+#define LIBIRC_SASL_CHUNK_SIZE		400
+
+#define RPL_WELCOME			1
+#define ERR_NICKLOCKED			902
+#define RPL_SASLSUCCESS			903
+#define ERR_SASLFAIL			904
+#define ERR_SASLTOOLONG			905
+#define ERR_SASLABORTED			906
+#define RPL_SASLMECHS			908
+
+
+static void libirc_sasl_free (irc_session_t * session)
+{
+	if ( session->sasl_password )
+	{
+		memset (session->sasl_password, 0, strlen (session->sasl_password));
+		free (session->sasl_password);
+	}
+
+	free (session->sasl_username);
+
+	session->sasl_username = 0;
+	session->sasl_password = 0;
+	session->sasl_mechanism = LIBIRC_SASL_NONE;
+}
+
+
+int irc_set_sasl (irc_session_t * session, int mechanism, const char * username, const char * password)
+{
+	char * u = 0, * p = 0;
+
+	if ( (mechanism != LIBIRC_SASL_NONE && mechanism != LIBIRC_SASL_PLAIN && mechanism != LIBIRC_SASL_EXTERNAL)
+	|| (mechanism == LIBIRC_SASL_PLAIN && (!username || !password)) )
+	{
+		session->lasterror = LIBIRC_ERR_INVAL;
+		return 1;
+	}
+
+	if ( mechanism == LIBIRC_SASL_PLAIN
+	&& ((u = strdup (username)) == 0 || (p = strdup (password)) == 0) )
+	{
+		free (u);
+		session->lasterror = LIBIRC_ERR_NOMEM;
+		return 1;
+	}
+
+	libirc_sasl_free (session);
+
+	session->sasl_mechanism = mechanism;
+	session->sasl_username = u;
+	session->sasl_password = p;
+	return 0;
+}
+
+
+/*
+ * Queues the capability request ahead of the registration.
+ */
+static void libirc_sasl_start (irc_session_t * session)
+{
+	session->sasl_state = LIBIRC_SASL_STATE_NONE;
+
+	if ( session->sasl_mechanism != LIBIRC_SASL_NONE && libirc_queue_raw (session, "CAP REQ :sasl") == 0 )
+		session->sasl_state = LIBIRC_SASL_STATE_REQUESTED;
+}
+
+
+static int libirc_sasl_fail (irc_session_t * session)
+{
+	session->sasl_state = LIBIRC_SASL_STATE_NONE;
+	session->lasterror = LIBIRC_ERR_SASL_FAILED;
+	session->state = LIBIRC_STATE_DISCONNECTED;
+	return 1;
+}
+
+
+static void libirc_sasl_respond (irc_session_t * session)
+{
+	size_t ulen, plen, length, offset;
+	char * message, * encoded;
+
+	if ( session->sasl_mechanism == LIBIRC_SASL_EXTERNAL )
+	{
+		// The identity is the one of the TLS client certificate (see
+		// irc_set_ssl_client_cert)
+		irc_send_raw (session, "AUTHENTICATE +");
+		return;
+	}
+
+	// PLAIN: an empty authorization identity, then the user name and password
+	ulen = strlen (session->sasl_username);
+	plen = strlen (session->sasl_password);
+	length = ulen + plen + 2;
+
+	message = malloc (length);
+	encoded = malloc (4 * ((length + 2) / 3) + 1);
+
+	if ( !message || !encoded )
+	{
+		free (message);
+		free (encoded);
+		libirc_sasl_fail (session);
+		session->lasterror = LIBIRC_ERR_NOMEM;
+		return;
+	}
+
+	message[0] = '\0';
+	memcpy (message + 1, session->sasl_username, ulen + 1);
+	memcpy (message + ulen + 2, session->sasl_password, plen);
+	libirc_base64_encode ((unsigned char *) message, length, encoded);
+
+	length = strlen (encoded);
+
+	for ( offset = 0; offset < length; offset += LIBIRC_SASL_CHUNK_SIZE )
+		irc_send_raw (session, "AUTHENTICATE %.*s", LIBIRC_SASL_CHUNK_SIZE, encoded + offset);
+
+	// A payload that fills the last line exactly is terminated by an empty one
+	if ( length % LIBIRC_SASL_CHUNK_SIZE == 0 )
+		irc_send_raw (session, "AUTHENTICATE +");
+
+	memset (message, 0, ulen + plen + 2);
+	memset (encoded, 0, length);
+	free (message);
+	free (encoded);
+}
+
+
+/*
+ * Tells whether a space-separated list of capabilities holds the given one
+ * as a whole, with or without a value.
+ */
+static int libirc_sasl_has_cap (const char * list, const char * cap)
+{
+	size_t length = strlen (cap), token;
+
+	while ( *(list += strspn (list, " ")) )
+	{
+		token = strcspn (list, " ");
+
+		if ( token >= length && !strncmp (list, cap, length) && (token == length || list[length] == '=') )
+			return 1;
+
+		list += token;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Handles the messages of the SASL exchange. Returns nonzero if the message
+ * has been consumed, and must not be passed on to the callbacks.
+ */
+static int libirc_sasl_process (irc_session_t * session, const char * command, int code, const char ** params, int count)
+{
+	if ( session->sasl_state == LIBIRC_SASL_STATE_NONE || session->sasl_state == LIBIRC_SASL_STATE_DONE )
+		return 0;
+
+	if ( command && !strcmp (command, "CAP") && count >= 3 )
+	{
+		if ( !strcmp (params[1], "ACK") && libirc_sasl_has_cap (params[2], "sasl") )
+		{
+			session->sasl_state = LIBIRC_SASL_STATE_AUTHENTICATING;
+			irc_send_raw (session, "AUTHENTICATE %s", session->sasl_mechanism == LIBIRC_SASL_PLAIN ? "PLAIN" : "EXTERNAL");
+			return 1;
+		}
+
+		if ( !strcmp (params[1], "NAK") )
+			return libirc_sasl_fail (session);
+
+		return 0;
+	}
+
+	if ( command && !strcmp (command, "AUTHENTICATE") && count >= 1 )
+	{
+		if ( session->sasl_state == LIBIRC_SASL_STATE_AUTHENTICATING && !strcmp (params[0], "+") )
+			libirc_sasl_respond (session);
+
+		return 1;
+	}
+
+	switch ( code )
+	{
+	case RPL_SASLSUCCESS:
+		session->sasl_state = LIBIRC_SASL_STATE_DONE;
+		irc_send_raw (session, "CAP END");
+		return 0;
+
+	case ERR_NICKLOCKED:
+	case ERR_SASLFAIL:
+	case ERR_SASLTOOLONG:
+	case ERR_SASLABORTED:
+	case RPL_SASLMECHS:
+		return libirc_sasl_fail (session);
+
+	case RPL_WELCOME:
+		// The server does not support CAP, and has registered us anonymously
+		return libirc_sasl_fail (session);
+	}
+
+	return 0;
+}
@@ -28,13 +28,69 @@
 #define SESSIONFL_SSL_WRITE_WANTS_READ		(0x00000004)
 #define SESSIONFL_SSL_READ_WANTS_WRITE		(0x00000008)
 #define SESSIONFL_USES_IPV6			(0x00000010)
+#define SESSIONFL_REGISTRATION_QUEUED		(0x00000020)
+#define SESSIONFL_QUIT_SENT			(0x00000040)
 
 
 
+// A pending timer; the session keeps them in a min-heap ordered by deadline.
+struct libirc_timer
+{
+	uint64_t		deadline;	// CLOCK_MONOTONIC, in milliseconds
+	irc_timer_t		id;
+	irc_timer_callback_t	callback;
+	void			* ctx;
+};
+
+
+// An address of the IRC server, to be raced against the others.
+struct libirc_endpoint
+{
+	struct sockaddr_storage	addr;
+	socklen_t		addrlen;
+	time_t			expires;	// when the name has to be resolved again
+	uint64_t		started;	// when the last attempt was started
+	unsigned int		srtt;		// the smoothed connect latency, in ms
+	unsigned int		successes;
+	unsigned int		failures;	// since the last success
+};
+
+
+// A connection attempt in progress to one of the server's addresses.
+struct libirc_attempt
+{
+	socket_t		sock;
+	struct libirc_binding	binding;
+	unsigned int		endpoint;	// the index of its address
+	unsigned int		early;		// the registration bytes sent with the SYN
+};
+
+
+// The most descriptors of the session itself (not of its DCC sessions) that are watched at
+// once: the IRC server socket or the connection race, and the DCC data thread completions.
+#define LIBIRC_WATCH_SESSION_MAX	(LIBIRC_CONNECT_ATTEMPTS + 2)
+
+// A descriptor reported to the host through the watch callbacks.
+struct libirc_watch
+{
+	socket_t	fd;
+	int		events;
+};
+
+
 struct irc_session_s
 {
 	void		* ctx;
 	int		dcc_timeout;
+	int		dcc_rcvlowat;
+
+	int		sasl_mechanism;
+	int		sasl_state;
+	char 	*	sasl_username;
+	char 	*	sasl_password;
+
+	struct socket_tuning	tuning_server;
+	struct socket_tuning	tuning_dcc;
 
 	int		options;
 	int		lasterror;
@@ -42,14 +98,37 @@ struct irc_session_s
 	char 		incoming_buf[LIBIRC_BUFFER_SIZE];
 	unsigned int	incoming_offset;
 
-	char 		outgoing_buf[LIBIRC_BUFFER_SIZE];
+	char 		* outgoing_buf;		// grows up to LIBIRC_OUTGOING_MAX
 	unsigned int	outgoing_offset;
+	unsigned int	outgoing_size;
+	unsigned int	outgoing_head;	// the bytes sent first, without tokens
 	port_mutex_t	mutex_session;
 
+	unsigned int	flood_burst;	// lines; 0 disables the flood control
+	unsigned int	flood_interval;	// ms to earn back a line
+	uint64_t	flood_clock;	// when the bucket is full again
+	irc_timer_t	flood_timer;
+
 	socket_t	sock;
+	struct libirc_binding	binding;
+	irc_bind_pool_t	*	bind_pool;
 	int		state;
 	int		flags;
 
+	unsigned short	server_port;
+	int		server_family;	// AF_UNSPEC to race both families
+	char		* endpoint_cache;	// the path of the endpoint cache, or 0
+	unsigned int	endpoint_cache_ttl;
+	bool		endpoints_cached;	// the addresses raced come from the cache
+
+	struct libirc_resolver	* resolver;	// the name resolution in progress
+	struct libirc_endpoint	* endpoints;	// the addresses to race, in order
+	unsigned int	endpoint_count;
+	unsigned int	endpoint_next;
+	struct libirc_attempt	attempts[LIBIRC_CONNECT_ATTEMPTS];
+	unsigned int	attempt_count;
+	irc_timer_t	attempt_timer;
+
 	char 	 	* server;
 	char		* server_password;
 	char 		* realname;
@@ -62,14 +141,59 @@ struct irc_session_s
 #endif
 
 	struct in_addr	local_addr;
-	irc_dcc_t	dcc_last_id;
-	irc_dcc_session_t * dcc_sessions;
+	irc_dcc_session_t ** dcc_slabs;
+	unsigned int	dcc_slots;	// the number of slots ever handed out
+	unsigned int	dcc_free;	// the first free slot, or LIBIRC_DCC_NO_SLOT
+	unsigned int	dcc_count;	// the number of sessions in use
+	irc_dcc_t	* dcc_by_fd;	// the DCC session id for each socket
+	unsigned int	dcc_by_fd_size;
 	port_mutex_t	mutex_dcc;
 
 	irc_callbacks_t	callbacks;
 
+	struct libirc_timer	* timers;
+	unsigned int	timer_count;
+	unsigned int	timer_capacity;
+	irc_timer_t	timer_last_id;
+
+	unsigned int	keepalive_interval;	// seconds; 0 disables the keepalive
+	irc_timer_t	keepalive_timer;
+	uint64_t	last_recv;
+	bool		keepalive_pinged;
+
+	unsigned int	connect_timeout;	// seconds; 0 for no limit
+	unsigned int	register_timeout;	// seconds; 0 for no limit
+	irc_timer_t	phase_timer;
+
+	unsigned int	reconnect_delay;	// seconds; 0 disables reconnecting
+	unsigned int	reconnect_max_delay;	// seconds
+	unsigned int	reconnect_backoff;	// seconds until the next attempt
+	irc_timer_t	reconnect_timer;
+
+	irc_watch_callbacks_t	watch_callbacks;
+	struct libirc_watch	watches[LIBIRC_WATCH_SESSION_MAX];	// the session's own, as reported
+	unsigned int	watch_count;
+	bool		watch_session_dirty;	// its own descriptors may have changed
+	unsigned int	watch_dirty;	// the first DCC slot to report, or LIBIRC_DCC_NO_SLOT
+	int		watch_depth;
+
+#if defined (ENABLE_THREADS)
+	int		run_wakefd[2];
+	pthread_t	run_thread;
+
+	struct libirc_dcc_completions * dcc_completions;
+	int		dcc_donefd[2];	// the data threads report completions here
+#endif
+
+	irc_dcc_pool_t	* dcc_pool;	// the data threads, with LIBIRC_OPTION_DCC_THREAD
+
+	char		* tls_cache;	// the path of the TLS session cache, or 0
+	char		* client_cert;	// the path of the TLS client certificate, or 0
+	char		* client_key;	// the path of its private key, or 0 if in the same file
+
 #if defined (ENABLE_SSL)
 	SSL 		 * ssl;
+	SSL_SESSION	 * tls_session;	// the last session issued by the server
 #endif
 
 	
@@ -19,6 +19,7 @@
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <fcntl.h>
 
 #define IS_SOCKET_ERROR(a)	((a)<0)
@@ -56,6 +57,66 @@ static int socket_close (socket_t * sock)
 }
 
 
+/*
+ * The socket options applied to the connections of a session; see
+ * irc_socket_tuning_t.
+ */
+struct socket_tuning
+{
+	int	rcvbuf;
+	char	congestion[16];
+	int	quickack;
+	int	nodelay;
+	int	busy_poll;
+	int	fastopen;
+};
+
+
+/*
+ * Applies the tuning to a socket that is not connected yet, so that the
+ * receive buffer is taken into account for the window scaling. The options
+ * are best effort: the ones the system does not support are skipped.
+ */
+static void socket_tune (socket_t * sock, const struct socket_tuning * tuning)
+{
+	int on = 1;
+
+	if ( tuning->rcvbuf > 0 )
+		setsockopt (*sock, SOL_SOCKET, SO_RCVBUF, &tuning->rcvbuf, sizeof(tuning->rcvbuf));
+
+#if defined (TCP_CONGESTION)
+	if ( tuning->congestion[0] )
+		setsockopt (*sock, IPPROTO_TCP, TCP_CONGESTION, tuning->congestion, strlen (tuning->congestion));
+#endif
+
+	if ( tuning->nodelay )
+		setsockopt (*sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+#if defined (TCP_QUICKACK)
+	if ( tuning->quickack )
+		setsockopt (*sock, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+#endif
+
+#if defined (SO_BUSY_POLL)
+	if ( tuning->busy_poll > 0 )
+		setsockopt (*sock, SOL_SOCKET, SO_BUSY_POLL, &tuning->busy_poll, sizeof(tuning->busy_poll));
+#endif
+}
+
+
+/*
+ * The kernel leaves the quick acknowledgement mode on its own, so it has to
+ * be requested again after every read.
+ */
+static void socket_quickack (socket_t * sock)
+{
+#if defined (TCP_QUICKACK)
+	int on = 1;
+	setsockopt (*sock, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+#endif
+}
+
+
 static int socket_connect (socket_t * sock, const struct sockaddr *saddr, socklen_t len)
 {
 	while ( 1 )
@@ -73,6 +134,32 @@ static int socket_connect (socket_t * sock, const struct sockaddr *saddr, sockle
 }
 
 
+/*
+ * Connects like socket_connect, but with TCP Fast Open: if the kernel holds
+ * a cookie of the server, the data is sent along with the SYN. Returns the
+ * length of the data sent, 0 if none was, or -1 if the connect failed.
+ */
+static int socket_connect_fastopen (socket_t * sock, const struct sockaddr *saddr, socklen_t len, const void *buf, size_t size)
+{
+#if defined (MSG_FASTOPEN)
+	ssize_t sent = sendto (*sock, buf, size, MSG_FASTOPEN, saddr, len);
+
+	if ( sent >= 0 )
+		return (int) sent;
+
+	// No cookie yet: a plain SYN is on its way, asking for one
+	if ( socket_error() == EINPROGRESS )
+		return 0;
+
+	// Unless Fast Open is disabled on the host, the connect failed
+	if ( socket_error() != EOPNOTSUPP )
+		return -1;
+#endif
+
+	return socket_connect (sock, saddr, len) ? -1 : 0;
+}
+
+
 static int socket_accept (socket_t * sock, socket_t * newsock, struct sockaddr *saddr, socklen_t * len)
 {
 	while ( IS_SOCKET_ERROR(*newsock = accept (*sock, saddr, len)) )
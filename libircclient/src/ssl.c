@@ -15,133 +15,35 @@
 
 #if defined (ENABLE_SSL)
 
-// Nonzero if OpenSSL has been initialized
-static SSL_CTX * ssl_context = 0;
-
-#if defined (_WIN32)
-#include <windows.h>
-// This array will store all of the mutexes available to OpenSSL
-static CRITICAL_SECTION * mutex_buf = 0;
-
-// OpenSSL callback to utilize static locks
-static void cb_openssl_locking_function( int mode, int n, const char * file, int line )
-{
-    if ( mode & CRYPTO_LOCK)
-        EnterCriticalSection( &mutex_buf[n] );
-    else
-        LeaveCriticalSection( &mutex_buf[n] );
-}
-
-// OpenSSL callback to get the thread ID
-static unsigned long cb_openssl_id_function(void)
-{
-    return ((unsigned long) GetCurrentThreadId() );
-}
-
-static int alloc_mutexes( unsigned int total )
-{
-	unsigned int i;
-	
-	// Enable thread safety in OpenSSL
-	mutex_buf = (CRITICAL_SECTION*) malloc( total * sizeof(CRITICAL_SECTION) );
-
-	if ( !mutex_buf )
-		return -1;
-
-	for ( i = 0;  i < total;  i++)
-		InitializeCriticalSection( &(mutex_buf[i]) );
-	
-	return 0;
-}
-
-
-#else
-
-// This array will store all of the mutexes available to OpenSSL
-static pthread_mutex_t * mutex_buf = 0;
-
-// OpenSSL callback to utilize static locks
-static void cb_openssl_locking_function( int mode, int n, const char * file, int line )
-{
-    (void)file;
-    (void)line;
-
-    if ( mode & CRYPTO_LOCK)
-        pthread_mutex_lock( &mutex_buf[n] );
-    else
-        pthread_mutex_unlock( &mutex_buf[n] );
-}
-
-// OpenSSL callback to get the thread ID
-
-static void cb_openssl_id_function( CRYPTO_THREADID * id )
-{
-	CRYPTO_THREADID_set_pointer( id, pthread_self() );
-}
-
-static int alloc_mutexes( unsigned int total )
-{
-	unsigned i;
-	
-	// Enable thread safety in OpenSSL
-	mutex_buf = (pthread_mutex_t*) malloc( total * sizeof(pthread_mutex_t) );
-
-	if ( !mutex_buf )
-		return -1;
-
-	for ( i = 0;  i < total;  i++)
-		pthread_mutex_init( &(mutex_buf[i]), 0 );
-	
-	return 0;
-}
-
+#if OPENSSL_VERSION_NUMBER < 0x10101000L
+	#error "libircclient requires OpenSSL 1.1.1 or newer"
 #endif
 
-static int ssl_init_context( irc_session_t * session )
-{
-	// Load the strings and init the library
-	SSL_load_error_strings();
+// The context shared by all the connections. OpenSSL locks it internally,
+// so it needs no locking callbacks.
+static SSL_CTX * ssl_context = 0;
 
-	// Enable thread safety in OpenSSL
-	if ( alloc_mutexes( CRYPTO_num_locks() ) )
-		return LIBIRC_ERR_NOMEM;
+static int ssl_new_session (SSL * ssl, SSL_SESSION * sess);
 
-	// Register our callbacks
-	CRYPTO_THREADID_set_callback( cb_openssl_id_function );
-	CRYPTO_set_locking_callback( cb_openssl_locking_function );
 
-	// Init it
-#if OPENSSL_VERSION_NUMBER < 0x10100000L
-	SSL_library_init();
-#else
-	OPENSSL_init_ssl(0, NULL);
-#endif 
-
-	if ( RAND_status() == 0 )
+static int ssl_init_context (void)
+{
+	if ( !OPENSSL_init_ssl (OPENSSL_INIT_LOAD_SSL_STRINGS, 0) )
 		return LIBIRC_ERR_SSL_INIT_FAILED;
 
-	// Create an SSL context; currently a single context is used for all connections
-	ssl_context = SSL_CTX_new( SSLv23_method() );
-
-	if ( !ssl_context )
+	if ( (ssl_context = SSL_CTX_new (TLS_client_method ())) == 0 )
 		return LIBIRC_ERR_SSL_INIT_FAILED;
 
-	// Disable SSLv2 as it is unsecure
-	if ( (SSL_CTX_set_options( ssl_context, SSL_OP_NO_SSLv2) & SSL_OP_NO_SSLv2) == 0 )
-		return LIBIRC_ERR_SSL_INIT_FAILED;
+	SSL_CTX_set_min_proto_version (ssl_context, TLS1_2_VERSION);
 
-	// Enable only strong ciphers
-	if ( SSL_CTX_set_cipher_list( ssl_context, "ALL:!ADH:!LOW:!EXP:!MD5:@STRENGTH" ) != 1 )
-		return LIBIRC_ERR_SSL_INIT_FAILED;
+	// The system's trusted certificates; without them no server could be verified
+	SSL_CTX_set_default_verify_paths (ssl_context);
 
-	// Set the verification
-	if ( session->options & LIBIRC_OPTION_SSL_NO_VERIFY )
-		SSL_CTX_set_verify( ssl_context, SSL_VERIFY_NONE, 0 );
-	else
-		SSL_CTX_set_verify( ssl_context, SSL_VERIFY_PEER, 0 );
-	
-	// Disable session caching
-	SSL_CTX_set_session_cache_mode( ssl_context, SSL_SESS_CACHE_OFF );
+	// A client has to keep the sessions it wants to resume itself: they are
+	// handed to ssl_new_session(), TLS 1.3 tickets included, rather than
+	// stored in the context
+	SSL_CTX_set_session_cache_mode (ssl_context, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb (ssl_context, ssl_new_session);
 
 	// Enable SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER so we can move the buffer during sending
 	SSL_CTX_set_mode( ssl_context, SSL_CTX_get_mode(ssl_context) | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_ENABLE_PARTIAL_WRITE );
@@ -153,15 +55,19 @@ static int ssl_init_context( irc_session_t * session )
 #if defined (_WIN32)
 	#define SSLINIT_LOCK_MUTEX(a)		WaitForSingleObject( a, INFINITE )
 	#define SSLINIT_UNLOCK_MUTEX(a)		ReleaseMutex( a )
-#else
+#elif defined (ENABLE_THREADS)
 	#define SSLINIT_LOCK_MUTEX(a)		pthread_mutex_lock( &a )
 	#define SSLINIT_UNLOCK_MUTEX(a)		pthread_mutex_unlock( &a )
+#else
+	#define SSLINIT_LOCK_MUTEX(a)
+	#define SSLINIT_UNLOCK_MUTEX(a)
 #endif
 
-// Initializes the SSL context. Must be called after the socket is created.
-static int ssl_init( irc_session_t * session )
+// Initializes the context once per process; see ssl_init().
+static int ssl_context_get (void)
 {
 	static int ssl_context_initialized = 0;
+	int res = 0;
 	
 #if defined (_WIN32)
 	static HANDLE initmutex = 0;
@@ -177,7 +83,7 @@ static int ssl_init( irc_session_t * session )
 		if ( InterlockedCompareExchangePointer( &m, m, 0 ) != 0 )
 			CloseHandle( m );
 	}
-#else
+#elif defined (ENABLE_THREADS)
 	static pthread_mutex_t initmutex = PTHREAD_MUTEX_INITIALIZER;
 #endif
 	
@@ -187,31 +93,203 @@ static int ssl_init( irc_session_t * session )
 	// we do the sabre dance around it.
 	SSLINIT_LOCK_MUTEX( initmutex );
 
-	if ( ssl_context_initialized == 0 )
+	if ( ssl_context_initialized == 0 && (res = ssl_init_context ()) == 0 )
+		ssl_context_initialized = 1;
+	
+	SSLINIT_UNLOCK_MUTEX( initmutex );
+	return res;
+}
+
+
+/*
+ * The TLS session cache: a file holding the last session, or TLS 1.3
+ * ticket, issued by each server, one line per server:
+ *
+ *   <server> <port> <the session in DER, base64-encoded>
+ *
+ * so that the next connection, even from another process, resumes it
+ * instead of doing a full handshake.
+ */
+static int ssl_session_keep (const char * line, void * ctx)
+{
+	irc_session_t * session = ctx;
+	char server[256];
+	unsigned int port;
+
+	return sscanf (line, "%255s %u", server, &port) == 2
+		&& (strcmp (server, session->server) || port != session->server_port);
+}
+
+
+static void ssl_session_append (FILE * out, void * ctx)
+{
+	irc_session_t * session = ctx;
+	unsigned char * der = 0;
+	char * encoded;
+	int length;
+
+	if ( (length = i2d_SSL_SESSION (session->tls_session, &der)) <= 0 )
+		return;
+
+	if ( (encoded = malloc (4 * ((length + 2) / 3) + 1)) != 0 )
 	{
-		int res = ssl_init_context( session );
-		
-		if ( res )
+		libirc_base64_encode (der, length, encoded);
+		fprintf (out, "%s %u %s\n", session->server, (unsigned) session->server_port, encoded);
+		free (encoded);
+	}
+
+	OPENSSL_free (der);
+}
+
+
+static SSL_SESSION * ssl_session_load (irc_session_t * session)
+{
+	SSL_SESSION * sess = 0;
+	char * line = 0, server[256], * encoded;
+	unsigned char * der;
+	const unsigned char * p;
+	unsigned int port;
+	size_t size = 0;
+	int offset, length;
+	FILE * fp;
+
+	if ( !session->tls_cache || (fp = fopen (session->tls_cache, "r")) == 0 )
+		return 0;
+
+	while ( !sess && getline (&line, &size, fp) > 0 )
+	{
+		if ( sscanf (line, "%255s %u %n", server, &port, &offset) != 2
+		|| strcmp (server, session->server) || port != session->server_port )
+			continue;
+
+		encoded = line + offset;
+		encoded[strcspn (encoded, "\r\n")] = '\0';
+		length = strlen (encoded);
+
+		if ( (der = malloc (length / 4 * 3 + 3)) == 0 )
+			break;
+
+		// The decoded length counts the padding; the DER encoding knows its own
+		if ( (length = EVP_DecodeBlock (der, (unsigned char *) encoded, length)) > 0 )
 		{
-			SSLINIT_UNLOCK_MUTEX( initmutex );
-			return res;
+			p = der;
+			sess = d2i_SSL_SESSION (0, &p, length);
 		}
-		
-		ssl_context_initialized = 1;
+
+		free (der);
 	}
+
+	free (line);
+	fclose (fp);
+	return sess;
+}
+
+
+// Called by OpenSSL when the server has issued a session or a ticket.
+static int ssl_new_session (SSL * ssl, SSL_SESSION * sess)
+{
+	irc_session_t * session = SSL_get_app_data (ssl);
+
+	if ( !session )
+		return 0;
+
+	// Resuming a session skips the certificate check, so only the sessions of
+	// a verified server are kept
+	if ( (session->options & LIBIRC_OPTION_SSL_NO_VERIFY) || SSL_get_verify_result (ssl) != X509_V_OK )
+		return 0;
+
+	if ( session->tls_session )
+		SSL_SESSION_free (session->tls_session);
+
+	session->tls_session = sess;
+
+	if ( session->tls_cache )
+		libirc_cache_rewrite (session->tls_cache, ssl_session_keep, ssl_session_append, session);
+
+	// We keep the reference
+	return 1;
+}
+
+
+/*
+ * Offers the last session issued by the server, if any, for resumption.
+ */
+static void ssl_session_resume (irc_session_t * session, int numeric)
+{
+	const char * hostname;
+
+	// Nor is one offered to a server that is not verified, which could issue
+	// a session of its own for the next connection to resume
+	if ( session->options & LIBIRC_OPTION_SSL_NO_VERIFY )
+		return;
+
+	// A session is only offered to the server that issued it
+	if ( session->tls_session
+	&& ((hostname = SSL_SESSION_get0_hostname (session->tls_session)) ? strcmp (hostname, session->server) != 0 : !numeric) )
+	{
+		SSL_SESSION_free (session->tls_session);
+		session->tls_session = 0;
+	}
+
+	if ( !session->tls_session )
+		session->tls_session = ssl_session_load (session);
+
+	if ( session->tls_session && SSL_SESSION_is_resumable (session->tls_session) )
+		SSL_set_session (session->ssl, session->tls_session);
+}
+
+
+// Initializes the SSL context. Must be called after the socket is created.
+static int ssl_init( irc_session_t * session )
+{
+	struct in6_addr addr;
+	int res, numeric;
+
+	if ( (res = ssl_context_get ()) != 0 )
+		return res;
 	
-	SSLINIT_UNLOCK_MUTEX( initmutex );
-	
+	if ( session->ssl )
+		SSL_free( session->ssl );
+
 	// Get the SSL context
 	session->ssl = SSL_new( ssl_context );
 
 	if ( !session->ssl )
 		return LIBIRC_ERR_SSL_INIT_FAILED;
 
+	SSL_set_app_data (session->ssl, session);
+
 	// Let OpenSSL use our socket
 	if ( SSL_set_fd( session->ssl, session->sock) != 1 )
 		return LIBIRC_ERR_SSL_INIT_FAILED;
-	
+
+	// The client certificate, which SASL EXTERNAL identifies the account with
+	if ( session->client_cert
+	&& (SSL_use_certificate_chain_file (session->ssl, session->client_cert) != 1
+	|| SSL_use_PrivateKey_file (session->ssl, session->client_key ? session->client_key : session->client_cert, SSL_FILETYPE_PEM) != 1
+	|| SSL_check_private_key (session->ssl) != 1) )
+		return LIBIRC_ERR_SSL_INIT_FAILED;
+
+	numeric = inet_pton (AF_INET, session->server, &addr) == 1 || inet_pton (AF_INET6, session->server, &addr) == 1;
+
+	// Set the verification: the certificate must also be the one of the server we connect to
+	if ( session->options & LIBIRC_OPTION_SSL_NO_VERIFY )
+		SSL_set_verify( session->ssl, SSL_VERIFY_NONE, 0 );
+	else
+	{
+		SSL_set_verify( session->ssl, SSL_VERIFY_PEER, 0 );
+
+		if ( numeric ? X509_VERIFY_PARAM_set1_ip_asc (SSL_get0_param (session->ssl), session->server) != 1
+		: SSL_set1_host (session->ssl, session->server) != 1 )
+			return LIBIRC_ERR_SSL_INIT_FAILED;
+	}
+
+	// Server Name Indication, which virtual hosts need to pick the certificate
+	if ( !numeric && SSL_set_tlsext_host_name (session->ssl, session->server) != 1 )
+		return LIBIRC_ERR_SSL_INIT_FAILED;
+
+	ssl_session_resume (session, numeric);
+
 	// Since we're connecting on our own, tell openssl about it
 	SSL_set_connect_state( session->ssl );
 
@@ -242,6 +320,31 @@ static void ssl_handle_error( irc_session_t * session, int ssl_error )
 #endif
 }
 
+/*
+ * Completes the handshake before any data goes through the connection.
+ * Returns 1 once it is complete, or what SSL_do_handshake() returned. A
+ * resumed session keeps the verification result it was issued with instead
+ * of checking the certificate again, so the result is checked here.
+ */
+static int ssl_handshake (irc_session_t * session)
+{
+	int rc;
+
+	if ( SSL_is_init_finished (session->ssl) )
+		return 1;
+
+	if ( (rc = SSL_do_handshake (session->ssl)) != 1 )
+		return rc;
+
+	if ( !(session->options & LIBIRC_OPTION_SSL_NO_VERIFY) && SSL_get_verify_result (session->ssl) != X509_V_OK )
+	{
+		session->lasterror = LIBIRC_ERR_SSL_CERT_VERIFY_FAILED;
+		return 0;
+	}
+
+	return 1;
+}
+
 static int ssl_recv( irc_session_t * session )
 {
 	int count;
@@ -250,7 +353,8 @@ static int ssl_recv( irc_session_t * session )
 	ERR_clear_error();
 
 	// Read up to m_bufferLength bytes
-	count = SSL_read( session->ssl, session->incoming_buf + session->incoming_offset, amount );
+	if ( (count = ssl_handshake (session)) == 1 )
+		count = SSL_read( session->ssl, session->incoming_buf + session->incoming_offset, amount );
 
     if ( count > 0 )
 		return count;
@@ -286,12 +390,17 @@ static int ssl_recv( irc_session_t * session )
 }
 
 
-static int ssl_send( irc_session_t * session )
+static int ssl_send( irc_session_t * session, unsigned int length )
 {
 	int count;
+
+	if ( length == 0 )
+		return 0;
+
     ERR_clear_error();
 
-	count = SSL_write( session->ssl, session->outgoing_buf, session->outgoing_offset );
+	if ( (count = ssl_handshake (session)) == 1 )
+		count = SSL_write( session->ssl, session->outgoing_buf, length );
 
     if ( count > 0 )
 		return count;
@@ -324,6 +433,134 @@ static int ssl_send( irc_session_t * session )
 	return -1;
 }
 
+
+/*
+ * SDCC: a DCC file sent over TLS. The senders use self-signed certificates
+ * that nothing could verify them against, so the certificate is not checked;
+ * SDCC only keeps the file from being read on the way. The handshake is
+ * done here, and then, if the kernel supports kTLS, the records are handed
+ * to it, so that the file is received with a plain recv(2) rather than
+ * decrypted and copied by SSL_read().
+ *
+ * Advances the handshake of the DCC session, and sets dcc->handshake to the
+ * events it waits for, or to 0 once it is done. Returns 0 or the error that
+ * broke it.
+ */
+static int ssl_dcc_handshake (irc_dcc_session_t * dcc)
+{
+	int res;
+
+	if ( !dcc->ssl )
+	{
+		if ( (res = ssl_context_get ()) != 0 )
+			return res;
+
+		// No app data: the sessions of the DCC senders are not kept
+		if ( (dcc->ssl = SSL_new (ssl_context)) == 0
+		|| SSL_set_fd (dcc->ssl, dcc->sock) != 1 )
+			return LIBIRC_ERR_SSL_INIT_FAILED;
+
+		SSL_set_verify (dcc->ssl, SSL_VERIFY_NONE, 0);
+
+#if defined (SSL_OP_ENABLE_KTLS)
+		SSL_set_options (dcc->ssl, SSL_OP_ENABLE_KTLS);
+#endif
+		SSL_set_connect_state (dcc->ssl);
+	}
+
+	ERR_clear_error ();
+
+	if ( (res = SSL_connect (dcc->ssl)) != 1 )
+	{
+		switch ( SSL_get_error (dcc->ssl, res) )
+		{
+		case SSL_ERROR_WANT_READ:
+			dcc->handshake = LIBIRC_WATCH_READ;
+			return 0;
+
+		case SSL_ERROR_WANT_WRITE:
+			dcc->handshake = LIBIRC_WATCH_WRITE;
+			return 0;
+		}
+
+		return LIBIRC_ERR_CONNECT_SSL_FAILED;
+	}
+
+	dcc->handshake = 0;
+
+#if defined (BIO_get_ktls_recv)
+	dcc->ktls_recv = BIO_get_ktls_recv (SSL_get_rbio (dcc->ssl));
+#endif
+	return 0;
+}
+
+
+/*
+ * Reads the file data of an SDCC session, as recv(2) would: returns the
+ * length read, 0 once the sender has closed the connection, or -1 with
+ * errno set, to EAGAIN if there is nothing to read yet.
+ */
+static int ssl_dcc_recv (irc_dcc_session_t * dcc, char * buffer, size_t size)
+{
+	int length;
+
+	/*
+	 * The data OpenSSL has buffered already comes first. Otherwise the
+	 * kernel decrypts the records; only one that is not file data, such as
+	 * a session ticket or an alert, makes recv(2) fail with EIO, and is left
+	 * to SSL_read().
+	 */
+	if ( dcc->ktls_recv && !SSL_has_pending (dcc->ssl) )
+	{
+		length = recv (dcc->sock, buffer, size, 0);
+
+		if ( length >= 0 || socket_error () != EIO )
+			return length;
+	}
+
+	ERR_clear_error ();
+
+	if ( (length = SSL_read (dcc->ssl, buffer, size)) > 0 )
+		return length;
+
+	switch ( SSL_get_error (dcc->ssl, length) )
+	{
+	case SSL_ERROR_ZERO_RETURN:
+		return 0;
+
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+		errno = EAGAIN;
+		return -1;
+	}
+
+	errno = ECONNRESET;
+	return -1;
+}
+
+
+// Sends the acknowledgement of an SDCC session, as send(2) would.
+static int ssl_dcc_send (irc_dcc_session_t * dcc, const char * data, size_t size)
+{
+	int length;
+
+	ERR_clear_error ();
+
+	if ( (length = SSL_write (dcc->ssl, data, size)) > 0 )
+		return length;
+
+	switch ( SSL_get_error (dcc->ssl, length) )
+	{
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+		errno = EAGAIN;
+		return -1;
+	}
+
+	errno = ECONNRESET;
+	return -1;
+}
+
 #endif
 
 
@@ -341,8 +578,18 @@ static int session_socket_read( irc_session_t * session )
 		// Yes, I know this is tricky
 		if ( session->flags & SESSIONFL_SSL_READ_WANTS_WRITE )
 		{
+			unsigned int allowed;
+			int sent;
+
 			session->flags &= ~SESSIONFL_SSL_READ_WANTS_WRITE;
-			ssl_send( session );
+
+			libirc_mutex_lock (&session->mutex_session);
+			allowed = libirc_flood_allowance (session);
+
+			if ( (sent = ssl_send( session, allowed )) >= 0 )
+				libirc_outgoing_consume (session, sent, sent ? sent : allowed);
+
+			libirc_mutex_unlock (&session->mutex_session);
 			return 0;
 		}
 		
@@ -363,7 +610,8 @@ static int session_socket_read( irc_session_t * session )
 // Returns -1 in case there is an error and socket should be closed/connection terminated
 // Returns 0 in case there is a temporary error and the call should be retried (SSL_WANTS_WRITE case)
 // Returns a positive number if we actually sent something
-static int session_socket_write( irc_session_t * session )
+// Sends at most the first length_allowed bytes of the outgoing buffer.
+static int session_socket_write( irc_session_t * session, unsigned int length_allowed )
 {
 	int length;
 
@@ -378,11 +626,16 @@ static int session_socket_write( irc_session_t * session )
 			return 0;
 		}
 		
-		return ssl_send( session );
+		return ssl_send( session, length_allowed );
 	}
 #endif
+
+	// Nothing to send, such as when the registration went with the SYN,
+	// or the flood control holds the next line back
+	if ( length_allowed == 0 )
+		return 0;
 	
-	length = socket_send (&session->sock, session->outgoing_buf, session->outgoing_offset);
+	length = socket_send (&session->sock, session->outgoing_buf, length_allowed);
 	
 	// There is no "retry" errors for regular sockets
 	if ( length <= 0 )
@@ -390,3 +643,37 @@ static int session_socket_write( irc_session_t * session )
 	
 	return length;
 }
+
+
+void irc_set_tls_session_cache (irc_session_t * session, const char * path)
+{
+	free (session->tls_cache);
+	session->tls_cache = path ? strdup (path) : 0;
+}
+
+
+int irc_set_ssl_client_cert (irc_session_t * session, const char * cert, const char * key)
+{
+	char * c = 0, * k = 0;
+
+#if !defined (ENABLE_SSL)
+	if ( cert )
+	{
+		session->lasterror = LIBIRC_ERR_SSL_NOT_SUPPORTED;
+		return 1;
+	}
+#endif
+
+	if ( (cert && (c = strdup (cert)) == 0) || (cert && key && (k = strdup (key)) == 0) )
+	{
+		free (c);
+		session->lasterror = LIBIRC_ERR_NOMEM;
+		return 1;
+	}
+
+	free (session->client_cert);
+	free (session->client_key);
+	session->client_cert = c;
+	session->client_key = k;
+	return 0;
+}
@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2004-2012 George Yunaev gyunaev@ulduzsoft.com
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ */
+
+/*
+ * The session timers are kept in a binary min-heap ordered by deadline, so
+ * the event loop can sleep exactly until the next one is due instead of
+ * waking up periodically to check.
+ */
+
+static uint64_t libirc_time_ms (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+static void libirc_timer_sift_up (struct libirc_timer * heap, unsigned int i)
+{
+	while ( i > 0 )
+	{
+		unsigned int parent = (i - 1) / 2;
+		struct libirc_timer tmp;
+
+		if ( heap[parent].deadline <= heap[i].deadline )
+			break;
+
+		tmp = heap[parent];
+		heap[parent] = heap[i];
+		heap[i] = tmp;
+		i = parent;
+	}
+}
+
+
+static void libirc_timer_sift_down (struct libirc_timer * heap, unsigned int count, unsigned int i)
+{
+	while ( 1 )
+	{
+		unsigned int smallest = i, left = 2 * i + 1, right = 2 * i + 2;
+		struct libirc_timer tmp;
+
+		if ( left < count && heap[left].deadline < heap[smallest].deadline )
+			smallest = left;
+
+		if ( right < count && heap[right].deadline < heap[smallest].deadline )
+			smallest = right;
+
+		if ( smallest == i )
+			break;
+
+		tmp = heap[smallest];
+		heap[smallest] = heap[i];
+		heap[i] = tmp;
+		i = smallest;
+	}
+}
+
+
+// The session mutex must be locked.
+static void libirc_timer_remove_at (irc_session_t * session, unsigned int i)
+{
+	session->timer_count--;
+
+	if ( i == session->timer_count )
+		return;
+
+	session->timers[i] = session->timers[session->timer_count];
+	libirc_timer_sift_down (session->timers, session->timer_count, i);
+	libirc_timer_sift_up (session->timers, i);
+}
+
+
+/*
+ * Adds a timer; called with the session mutex held, which irc_timer_add
+ * takes itself.
+ */
+static irc_timer_t libirc_timer_add_locked (irc_session_t * session, unsigned int msec, irc_timer_callback_t callback, void * ctx)
+{
+	struct libirc_timer * timer;
+
+	if ( session->timer_count == session->timer_capacity )
+	{
+		unsigned int capacity = session->timer_capacity ? session->timer_capacity * 2 : 4;
+		struct libirc_timer * timers = realloc (session->timers, capacity * sizeof(*timers));
+
+		if ( !timers )
+		{
+			session->lasterror = LIBIRC_ERR_NOMEM;
+			return 0;
+		}
+
+		session->timers = timers;
+		session->timer_capacity = capacity;
+	}
+
+	// Zero is never a valid timer id
+	if ( ++session->timer_last_id == 0 )
+		session->timer_last_id++;
+
+	timer = &session->timers[session->timer_count];
+	timer->deadline = libirc_time_ms () + msec;
+	timer->id = session->timer_last_id;
+	timer->callback = callback;
+	timer->ctx = ctx;
+
+	libirc_timer_sift_up (session->timers, session->timer_count++);
+	return session->timer_last_id;
+}
+
+
+irc_timer_t irc_timer_add (irc_session_t * session, unsigned int msec, irc_timer_callback_t callback, void * ctx)
+{
+	irc_timer_t id;
+
+	if ( !callback )
+	{
+		session->lasterror = LIBIRC_ERR_INVAL;
+		return 0;
+	}
+
+	libirc_mutex_lock (&session->mutex_session);
+	id = libirc_timer_add_locked (session, msec, callback, ctx);
+	libirc_mutex_unlock (&session->mutex_session);
+
+	if ( id )
+		libirc_wake_run_loop (session);
+
+	return id;
+}
+
+
+int irc_timer_cancel (irc_session_t * session, irc_timer_t id)
+{
+	unsigned int i;
+
+	libirc_mutex_lock (&session->mutex_session);
+
+	for ( i = 0; i < session->timer_count; i++ )
+	{
+		if ( session->timers[i].id == id )
+		{
+			libirc_timer_remove_at (session, i);
+			libirc_mutex_unlock (&session->mutex_session);
+			return 0;
+		}
+	}
+
+	libirc_mutex_unlock (&session->mutex_session);
+	return 1;
+}
+
+
+int irc_next_timeout (irc_session_t * session)
+{
+	uint64_t now, deadline;
+
+	libirc_mutex_lock (&session->mutex_session);
+
+	if ( session->timer_count == 0 )
+	{
+		libirc_mutex_unlock (&session->mutex_session);
+		return -1;
+	}
+
+	deadline = session->timers[0].deadline;
+	libirc_mutex_unlock (&session->mutex_session);
+
+	now = libirc_time_ms ();
+
+	if ( deadline <= now )
+		return 0;
+
+	if ( deadline - now > INT_MAX )
+		return INT_MAX;
+
+	return (int) (deadline - now);
+}
+
+
+/*
+ * Invokes the callbacks of the timers that are due. Returns nonzero if
+ * a timer has disconnected the session.
+ */
+static int libirc_process_timers (irc_session_t * session)
+{
+	uint64_t now = libirc_time_ms ();
+
+	libirc_mutex_lock (&session->mutex_session);
+
+	while ( session->timer_count > 0 && session->timers[0].deadline <= now )
+	{
+		struct libirc_timer timer = session->timers[0];
+
+		libirc_timer_remove_at (session, 0);
+		libirc_mutex_unlock (&session->mutex_session);
+
+		(*timer.callback) (session, timer.id, timer.ctx);
+
+		libirc_mutex_lock (&session->mutex_session);
+	}
+
+	libirc_mutex_unlock (&session->mutex_session);
+
+	return session->state == LIBIRC_STATE_DISCONNECTED;
+}
@@ -30,6 +30,98 @@ static void libirc_dump_data (const char * prefix, const char * buf, unsigned in
 #endif
 
 
+/*
+ * Encodes length bytes of data in base64 into out, which must have room for
+ * 4 * ((length + 2) / 3) + 1 characters.
+ */
+static void libirc_base64_encode (const unsigned char * data, size_t length, char * out)
+{
+	static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	size_t i;
+
+	for ( i = 0; i + 2 < length; i += 3 )
+	{
+		*out++ = alphabet[data[i] >> 2];
+		*out++ = alphabet[((data[i] & 0x03) << 4) | (data[i+1] >> 4)];
+		*out++ = alphabet[((data[i+1] & 0x0F) << 2) | (data[i+2] >> 6)];
+		*out++ = alphabet[data[i+2] & 0x3F];
+	}
+
+	if ( i < length )
+	{
+		*out++ = alphabet[data[i] >> 2];
+
+		if ( i + 1 < length )
+		{
+			*out++ = alphabet[((data[i] & 0x03) << 4) | (data[i+1] >> 4)];
+			*out++ = alphabet[(data[i+1] & 0x0F) << 2];
+		}
+		else
+		{
+			*out++ = alphabet[(data[i] & 0x03) << 4];
+			*out++ = '=';
+		}
+
+		*out++ = '=';
+	}
+
+	*out = '\0';
+}
+
+
+/*
+ * Replaces a cache file atomically, so that concurrent readers never see a
+ * partial one: the lines of the current file that keep() accepts are
+ * copied over, then append() writes the new ones. Returns nonzero if the
+ * file could not be replaced.
+ */
+static int libirc_cache_rewrite (const char * path, int (*keep) (const char * line, void * ctx), void (*append) (FILE * out, void * ctx), void * ctx)
+{
+	char * tmppath, * line = 0;
+	size_t size = 0;
+	FILE * in, * out;
+	int fd, err;
+
+	if ( (tmppath = malloc (strlen (path) + 8)) == 0 )
+		return 1;
+
+	sprintf (tmppath, "%s.XXXXXX", path);
+
+	// Created readable by the owner only
+	if ( (fd = mkstemp (tmppath)) < 0 )
+	{
+		free (tmppath);
+		return 1;
+	}
+
+	if ( (out = fdopen (fd, "w")) == 0 )
+	{
+		close (fd);
+		unlink (tmppath);
+		free (tmppath);
+		return 1;
+	}
+
+	if ( (in = fopen (path, "r")) != 0 )
+	{
+		while ( getline (&line, &size, in) > 0 )
+			if ( (*keep) (line, ctx) )
+				fputs (line, out);
+
+		free (line);
+		fclose (in);
+	}
+
+	(*append) (out, ctx);
+
+	if ( (err = (fclose (out) != 0 || rename (tmppath, path) != 0)) != 0 )
+		unlink (tmppath);
+
+	free (tmppath);
+	return err;
+}
+
+
 /*
  * Finds a separator (\x0D\x0A), which separates two lines.
  */
@@ -0,0 +1,863 @@
+/*
+ * Copyright (C) 2004-2012 George Yunaev gyunaev@ulduzsoft.com
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ */
+
+/*
+ * With LIBIRC_OPTION_DCC_THREAD, a DCC file receive is handed over to a data
+ * thread as soon as it is connected, so a burst of IRC traffic does not delay
+ * the transfer and a slow transfer does not delay the PONGs. The thread that
+ * drives the session and the data thread talk through rings: attach and
+ * cancel requests go to the data thread, completions go back to the session.
+ * A pipe wakes up the side that has to look at a ring.
+ *
+ * The data threads belong to a DCC pool (see irc_dcc_pool_create), which may
+ * be shared by any number of sessions, as a bind pool is. Each thread has its
+ * own event loop and is optionally pinned to a CPU. New transfers go to the
+ * least loaded thread, counted across all the sessions sharing the pool;
+ * another thread is only started once all the running ones are busy.
+ */
+
+struct irc_dcc_pool_s
+{
+	port_mutex_t		mutex;
+	unsigned int		refs;
+
+#if defined (ENABLE_THREADS)
+	struct libirc_dcc_worker ** workers;	// max entries, started as needed
+	unsigned int		count;
+	unsigned int		max;
+	int			* cpus;
+#endif
+};
+
+static void libirc_dcc_pool_ref (irc_dcc_pool_t * pool);
+static void libirc_dcc_pool_unref (irc_dcc_pool_t * pool);
+
+
+#if defined (ENABLE_THREADS)
+
+#include <poll.h>
+#include <sched.h>
+
+// The number of DCC sessions a data thread serves at most.
+#define LIBIRC_DCC_WORKER_SESSIONS	128
+
+/*
+ * An attached session causes at most an attach and a cancel request, and
+ * exactly one completion, so the rings should rarely overflow. Should one do
+ * so anyway, a session is not attached but stays with the driving thread,
+ * a cancel request waits for the data thread to make room, and a completion
+ * goes to a locked overflow list, as the data thread must never wait for
+ * the driving thread.
+ */
+#define LIBIRC_DCC_RING_SIZE		(2 * LIBIRC_DCC_WORKER_SESSIONS)
+
+enum
+{
+	LIBIRC_DCC_MSG_ATTACH,
+	LIBIRC_DCC_MSG_CANCEL,
+	LIBIRC_DCC_MSG_DONE
+};
+
+struct libirc_dcc_msg
+{
+	int			type;
+	irc_session_t		* session;
+	irc_dcc_session_t	* dcc;
+	irc_dcc_t		id;
+	int			status;
+};
+
+/*
+ * A ring with a single consumer. Several threads may produce into it, as
+ * long as they are serialised by a lock of their own.
+ */
+struct libirc_ring
+{
+	atomic_uint		head;	// written by the consumer only
+	atomic_uint		tail;	// written by the producer only
+	struct libirc_dcc_msg	msgs[LIBIRC_DCC_RING_SIZE];
+};
+
+// A completion that found its ring full.
+struct libirc_dcc_overflow
+{
+	struct libirc_dcc_msg	msg;
+	struct libirc_dcc_overflow	* next;
+};
+
+// The completions of a session's transfers, from any of the data threads.
+struct libirc_dcc_completions
+{
+	port_mutex_t		mutex;		// serialises the data threads
+	struct libirc_ring	ring;
+	struct libirc_dcc_overflow	* overflow;
+	atomic_bool		overflowed;
+};
+
+struct libirc_dcc_worker
+{
+	irc_dcc_pool_t		* pool;
+	pthread_t		thread;
+	int			wakefd[2];
+	atomic_bool		stop;
+
+	port_mutex_t		requests_mutex;	// serialises the driving threads
+	struct libirc_ring	requests;
+
+	// Sessions attached and not yet released, across all the sessions
+	atomic_uint		load;
+
+	// Used by the data thread only
+	irc_dcc_session_t	* dccs[LIBIRC_DCC_WORKER_SESSIONS];
+	irc_dcc_t		ids[LIBIRC_DCC_WORKER_SESSIONS];
+	irc_session_t		* sessions[LIBIRC_DCC_WORKER_SESSIONS];
+	unsigned int		count;
+};
+
+
+// The data thread that the calling thread is, if any.
+static _Thread_local struct libirc_dcc_worker * libirc_dcc_worker_current;
+
+
+static int libirc_ring_push (struct libirc_ring * ring, const struct libirc_dcc_msg * msg)
+{
+	unsigned int tail = atomic_load_explicit (&ring->tail, memory_order_relaxed);
+
+	if ( tail - atomic_load_explicit (&ring->head, memory_order_acquire) == LIBIRC_DCC_RING_SIZE )
+		return 1;
+
+	ring->msgs[tail % LIBIRC_DCC_RING_SIZE] = *msg;
+	atomic_store_explicit (&ring->tail, tail + 1, memory_order_release);
+	return 0;
+}
+
+
+static int libirc_ring_pop (struct libirc_ring * ring, struct libirc_dcc_msg * msg)
+{
+	unsigned int head = atomic_load_explicit (&ring->head, memory_order_relaxed);
+
+	if ( head == atomic_load_explicit (&ring->tail, memory_order_acquire) )
+		return 1;
+
+	*msg = ring->msgs[head % LIBIRC_DCC_RING_SIZE];
+	atomic_store_explicit (&ring->head, head + 1, memory_order_release);
+	return 0;
+}
+
+
+static void libirc_pipe_wake (int fd)
+{
+	(void) write (fd, "", 1);
+}
+
+
+static void libirc_pipe_drain (int fd)
+{
+	char drain[64];
+
+	while ( read (fd, drain, sizeof(drain)) > 0 )
+		;
+}
+
+
+// Passes a request to the data thread. Returns nonzero if its ring is full.
+static int libirc_dcc_worker_request (struct libirc_dcc_worker * worker, const struct libirc_dcc_msg * msg)
+{
+	int full;
+
+	libirc_mutex_lock (&worker->requests_mutex);
+	full = libirc_ring_push (&worker->requests, msg);
+	libirc_mutex_unlock (&worker->requests_mutex);
+
+	libirc_pipe_wake (worker->wakefd[1]);
+	return full;
+}
+
+
+/*
+ * Passes a completion to the thread that drives its session, through the
+ * overflow list if the ring is full.
+ */
+static void libirc_dcc_worker_complete (const struct libirc_dcc_msg * msg)
+{
+	irc_session_t * session = msg->session;
+	struct libirc_dcc_completions * done = session->dcc_completions;
+	struct libirc_dcc_overflow * node, ** last;
+
+	libirc_mutex_lock (&done->mutex);
+
+	if ( libirc_ring_push (&done->ring, msg) )
+	{
+		// A completion must not be lost, or its session would never be given back
+		while ( (node = malloc (sizeof(*node))) == 0 )
+			sched_yield ();
+
+		node->msg = *msg;
+		node->next = 0;
+
+		for ( last = &done->overflow; *last; last = &(*last)->next )
+			;
+
+		*last = node;
+		atomic_store_explicit (&done->overflowed, true, memory_order_relaxed);
+	}
+
+	libirc_mutex_unlock (&done->mutex);
+	libirc_pipe_wake (session->dcc_donefd[1]);
+}
+
+
+/*
+ * Gives the session back to the thread that drives it. The data thread must
+ * not touch the session, nor the IRC session it belongs to, afterwards: they
+ * may be freed as soon as worker_owned is cleared.
+ */
+static void libirc_dcc_worker_release (struct libirc_dcc_worker * worker, unsigned int index, int status)
+{
+	irc_dcc_session_t * dcc = worker->dccs[index];
+	struct libirc_dcc_msg msg = { LIBIRC_DCC_MSG_DONE, worker->sessions[index], dcc, worker->ids[index], status };
+
+	worker->count--;
+	worker->dccs[index] = worker->dccs[worker->count];
+	worker->ids[index] = worker->ids[worker->count];
+	worker->sessions[index] = worker->sessions[worker->count];
+
+	atomic_fetch_sub_explicit (&worker->load, 1, memory_order_relaxed);
+
+	libirc_dcc_worker_complete (&msg);
+
+	atomic_store_explicit (&dcc->worker_owned, false, memory_order_release);
+}
+
+
+static void libirc_dcc_worker_requests (struct libirc_dcc_worker * worker)
+{
+	struct libirc_dcc_msg msg;
+	unsigned int i;
+
+	while ( libirc_ring_pop (&worker->requests, &msg) == 0 )
+	{
+		if ( msg.type == LIBIRC_DCC_MSG_ATTACH )
+		{
+			worker->dccs[worker->count] = msg.dcc;
+			worker->ids[worker->count] = msg.id;
+			worker->sessions[worker->count] = msg.session;
+			worker->count++;
+			continue;
+		}
+
+		// The session may have completed, and been freed, already; then there
+		// is nothing to do
+		for ( i = 0; i < worker->count; i++ )
+		{
+			if ( worker->dccs[i] == msg.dcc && worker->ids[i] == msg.id )
+			{
+				libirc_dcc_worker_release (worker, i, LIBIRC_ERR_TERMINATED);
+				break;
+			}
+		}
+	}
+}
+
+
+static void libirc_dcc_worker_process (struct libirc_dcc_worker * worker, unsigned int index, int revents)
+{
+	irc_dcc_session_t * dcc = worker->dccs[index];
+	int err = 0;
+
+	if ( revents & (POLLIN | POLLERR | POLLHUP) )
+	{
+		libirc_dcc_receive (worker->sessions[index], dcc);
+
+		if ( dcc->cancelled )
+		{
+			libirc_dcc_worker_release (worker, index, LIBIRC_ERR_TERMINATED);
+			return;
+		}
+
+		err = dcc->read_error;
+
+		// The acknowledgement is sent right away instead of waiting for POLLOUT
+		if ( !err && dcc->acknowledge && dcc->outgoing_offset == 0 )
+		{
+			dcc->outgoing_file_confirm_offset = htonl(dcc->file_confirm_offset);
+			dcc->outgoing_offset = sizeof(dcc->outgoing_file_confirm_offset);
+			revents |= POLLOUT;
+		}
+	}
+
+	if ( !err && (revents & POLLOUT) )
+		err = libirc_dcc_send_ack (dcc);
+
+	if ( err || dcc->received_file_size == dcc->file_confirm_offset )
+		libirc_dcc_worker_release (worker, index, err);
+}
+
+
+static void * libirc_dcc_worker_main (void * arg)
+{
+	struct libirc_dcc_worker * worker = arg;
+	struct pollfd pfd[LIBIRC_DCC_WORKER_SESSIONS + 1];
+
+	libirc_dcc_worker_current = worker;
+
+	while ( !atomic_load_explicit (&worker->stop, memory_order_acquire) )
+	{
+		unsigned int i, count;
+
+		libirc_dcc_worker_requests (worker);
+
+		pfd[0].fd = worker->wakefd[0];
+		pfd[0].events = POLLIN;
+
+		for ( i = 0, count = worker->count; i < count; i++ )
+		{
+			irc_dcc_session_t * dcc = worker->dccs[i];
+
+			pfd[i + 1].events = (dcc->paused ? 0 : POLLIN) | (dcc->outgoing_offset > 0 ? POLLOUT : 0);
+			pfd[i + 1].revents = 0;
+
+			// A hangup would be reported even with no events; a paused session is left alone
+			pfd[i + 1].fd = pfd[i + 1].events ? dcc->sock : -1;
+		}
+
+		if ( poll (pfd, count + 1, -1) < 0 )
+			continue;
+
+		if ( pfd[0].revents )
+			libirc_pipe_drain (worker->wakefd[0]);
+
+		// Backwards, as a released session is replaced by the last one
+		for ( i = count; i-- > 0; )
+			if ( pfd[i + 1].revents )
+				libirc_dcc_worker_process (worker, i, pfd[i + 1].revents);
+	}
+
+	return 0;
+}
+
+
+static int libirc_make_pipe (int fds[2])
+{
+	if ( pipe (fds) )
+		return 1;
+
+	socket_make_nonblocking (&fds[0]);
+	socket_make_nonblocking (&fds[1]);
+	return 0;
+}
+
+
+// Starts another data thread in the pool. The pool must be locked.
+static struct libirc_dcc_worker * libirc_dcc_worker_start (irc_dcc_pool_t * pool)
+{
+	struct libirc_dcc_worker * worker;
+	unsigned int index = pool->count;
+
+	if ( (worker = calloc (1, sizeof(*worker))) == 0 )
+		return 0;
+
+	worker->pool = pool;
+
+	if ( libirc_mutex_init (&worker->requests_mutex) )
+	{
+		free (worker);
+		return 0;
+	}
+
+	if ( libirc_make_pipe (worker->wakefd) )
+	{
+		libirc_mutex_destroy (&worker->requests_mutex);
+		free (worker);
+		return 0;
+	}
+
+	if ( pthread_create (&worker->thread, 0, libirc_dcc_worker_main, worker) )
+	{
+		close (worker->wakefd[0]);
+		close (worker->wakefd[1]);
+		libirc_mutex_destroy (&worker->requests_mutex);
+		free (worker);
+		return 0;
+	}
+
+#if defined (__linux__)
+	if ( pool->cpus && pool->cpus[index] >= 0 )
+	{
+		cpu_set_t cpus;
+
+		CPU_ZERO (&cpus);
+		CPU_SET (pool->cpus[index], &cpus);
+
+		// Not fatal: the thread just runs unpinned
+		pthread_setaffinity_np (worker->thread, sizeof(cpus), &cpus);
+	}
+#endif
+
+	pool->workers[index] = worker;
+	pool->count++;
+	return worker;
+}
+
+
+/*
+ * Returns the least loaded data thread of the pool, starting a new one if
+ * all of them are busy and the pool allows for more.
+ */
+static struct libirc_dcc_worker * libirc_dcc_worker_pick (irc_dcc_pool_t * pool)
+{
+	struct libirc_dcc_worker * best = 0, * worker;
+	unsigned int i, load, best_load = 0;
+
+	libirc_mutex_lock (&pool->mutex);
+
+	for ( i = 0; i < pool->count; i++ )
+	{
+		load = atomic_load_explicit (&pool->workers[i]->load, memory_order_relaxed);
+
+		if ( !best || load < best_load )
+		{
+			best = pool->workers[i];
+			best_load = load;
+		}
+	}
+
+	if ( (!best || best_load > 0)
+	&& pool->count < pool->max
+	&& (worker = libirc_dcc_worker_start (pool)) != 0 )
+		best = worker;
+
+	libirc_mutex_unlock (&pool->mutex);
+	return best;
+}
+
+
+/*
+ * Sets up where the data threads report the session's completions. The
+ * session list must be locked.
+ */
+static int libirc_dcc_worker_prepare (irc_session_t * session)
+{
+	struct libirc_dcc_completions * done;
+
+	if ( session->dcc_completions )
+		return 0;
+
+	if ( (done = calloc (1, sizeof(*done))) == 0 )
+		return 1;
+
+	if ( libirc_mutex_init (&done->mutex) )
+	{
+		free (done);
+		return 1;
+	}
+
+	if ( libirc_make_pipe (session->dcc_donefd) )
+	{
+		libirc_mutex_destroy (&done->mutex);
+		free (done);
+		return 1;
+	}
+
+	session->dcc_completions = done;
+
+	// The completions descriptor is watched from now on
+	libirc_watch_dirty (session, 0);
+	return 0;
+}
+
+
+/*
+ * Hands a connected DCC session over to a data thread, if the session asks
+ * for it. The session list must be locked. Returns 0 if the session has been
+ * handed over.
+ */
+static int libirc_dcc_worker_attach (irc_session_t * session, irc_dcc_session_t * dcc)
+{
+	struct libirc_dcc_msg msg = { LIBIRC_DCC_MSG_ATTACH, session, dcc, dcc->id, 0 };
+	struct libirc_dcc_worker * worker;
+
+	if ( !(session->options & LIBIRC_OPTION_DCC_THREAD) || !dcc->cb_datum )
+		return 1;
+
+	// A session given no pool gets a single data thread of its own
+	if ( !session->dcc_pool && (session->dcc_pool = irc_dcc_pool_create (1, 0)) == 0 )
+		return 1;
+
+	if ( libirc_dcc_worker_prepare (session) || (worker = libirc_dcc_worker_pick (session->dcc_pool)) == 0 )
+		return 1;
+
+	// Other sessions may be attaching to the same thread
+	if ( atomic_fetch_add_explicit (&worker->load, 1, memory_order_relaxed) >= LIBIRC_DCC_WORKER_SESSIONS )
+	{
+		atomic_fetch_sub_explicit (&worker->load, 1, memory_order_relaxed);
+		return 1;
+	}
+
+	atomic_store_explicit (&dcc->worker_owned, true, memory_order_relaxed);
+
+	// The session stays with the driving thread then
+	if ( libirc_dcc_worker_request (worker, &msg) )
+	{
+		atomic_store_explicit (&dcc->worker_owned, false, memory_order_relaxed);
+		atomic_fetch_sub_explicit (&worker->load, 1, memory_order_relaxed);
+		return 1;
+	}
+
+	// The pool is kept until the session is taken back, whatever pool the IRC
+	// session uses by then
+	libirc_dcc_pool_ref (worker->pool);
+
+	dcc->state = LIBIRC_STATE_DETACHED;
+	dcc->worker = worker;
+	return 0;
+}
+
+
+/*
+ * Takes a detached session back from the data thread. The session list
+ * must be locked; it is unlocked while waiting for the data thread to let
+ * go of the session. Returns nonzero if called from the data thread itself,
+ * in which case the session is released once its callback returns.
+ */
+static int libirc_dcc_worker_cancel (irc_session_t * session, irc_dcc_session_t * dcc)
+{
+	struct libirc_dcc_msg msg = { LIBIRC_DCC_MSG_CANCEL, session, dcc, dcc->id, 0 };
+	struct libirc_dcc_worker * worker = dcc->worker;
+
+	if ( libirc_dcc_worker_current == worker )
+	{
+		dcc->cancelled = true;
+		return 1;
+	}
+
+	// The data thread may need the session list to make room for the request
+	libirc_mutex_unlock (&session->mutex_dcc);
+
+	while ( libirc_dcc_worker_request (worker, &msg) )
+		sched_yield ();
+
+	// At most a single chunk is being received at this point
+	while ( atomic_load_explicit (&dcc->worker_owned, memory_order_acquire) )
+		sched_yield ();
+
+	libirc_mutex_lock (&session->mutex_dcc);
+
+	dcc->worker = 0;
+	libirc_dcc_pool_unref (worker->pool);
+	return 0;
+}
+
+
+// Wakes up the data thread that has the session, for it to poll the session anew.
+static void libirc_dcc_worker_wake (irc_session_t * session, irc_dcc_session_t * dcc)
+{
+	libirc_pipe_wake (dcc->worker->wakefd[1]);
+}
+
+
+// Returns the descriptor through which the data threads report completions, or -1.
+static int libirc_dcc_worker_fd (irc_session_t * session)
+{
+	return session->dcc_donefd[0];
+}
+
+
+/*
+ * Returns nonzero if called from a data thread, after waking up the thread
+ * that drives the session, which then does the work (such as a watch update)
+ * that only it may do.
+ */
+static int libirc_dcc_worker_defer (irc_session_t * session)
+{
+	if ( !libirc_dcc_worker_current || session->dcc_donefd[1] < 0 )
+		return 0;
+
+	libirc_pipe_wake (session->dcc_donefd[1]);
+	return 1;
+}
+
+
+/*
+ * Hands a completed session back: invokes its callback, unless it has been
+ * cancelled, and destroys it.
+ */
+static void libirc_dcc_worker_done (irc_session_t * session, const struct libirc_dcc_msg * msg)
+{
+	irc_dcc_session_t * dcc;
+	irc_dcc_pool_t * pool;
+
+	if ( (dcc = libirc_find_dcc_session (session, msg->id, 1)) == 0 )
+		return;
+
+	// Destroyed by the caller in the meantime
+	if ( dcc->state != LIBIRC_STATE_DETACHED )
+	{
+		libirc_mutex_unlock (&session->mutex_dcc);
+		return;
+	}
+
+	// The completion is reported just before the data thread lets go of it
+	while ( atomic_load_explicit (&dcc->worker_owned, memory_order_acquire) )
+		sched_yield ();
+
+	pool = dcc->worker->pool;
+	dcc->worker = 0;
+	dcc->state = LIBIRC_STATE_CONNECTED;
+
+	if ( msg->status != LIBIRC_ERR_TERMINATED )
+	{
+		libirc_mutex_unlock (&session->mutex_dcc);
+
+		if ( msg->status )
+			(*dcc->cb_datum)(session, dcc->id, msg->status, dcc->ctx);
+		else
+			(*dcc->cb_close)(session, dcc->id, LIBIRC_ERR_OK, dcc->ctx);
+
+		libirc_mutex_lock (&session->mutex_dcc);
+	}
+
+	libirc_dcc_destroy_nolock (session, dcc->id);
+	libirc_mutex_unlock (&session->mutex_dcc);
+
+	libirc_dcc_pool_unref (pool);
+}
+
+
+/*
+ * Processes the completions reported by the data threads, invoking the
+ * callbacks from the thread that drives the session.
+ */
+static void libirc_dcc_worker_collect (irc_session_t * session)
+{
+	struct libirc_dcc_completions * done = session->dcc_completions;
+	struct libirc_dcc_overflow * overflow, * next;
+	struct libirc_dcc_msg msg;
+
+	if ( !done )
+		return;
+
+	libirc_pipe_drain (session->dcc_donefd[0]);
+
+	while ( libirc_ring_pop (&done->ring, &msg) == 0 )
+		libirc_dcc_worker_done (session, &msg);
+
+	if ( !atomic_load_explicit (&done->overflowed, memory_order_relaxed) )
+		return;
+
+	libirc_mutex_lock (&done->mutex);
+	overflow = done->overflow;
+	done->overflow = 0;
+	atomic_store_explicit (&done->overflowed, false, memory_order_relaxed);
+	libirc_mutex_unlock (&done->mutex);
+
+	for ( ; overflow; overflow = next )
+	{
+		next = overflow->next;
+		libirc_dcc_worker_done (session, &overflow->msg);
+		free (overflow);
+	}
+}
+
+
+/*
+ * Takes all the sessions back from the data threads, and releases the pool.
+ * The threads themselves stop once no IRC session uses the pool any more.
+ */
+static void libirc_dcc_worker_stop (irc_session_t * session)
+{
+	struct libirc_dcc_completions * done = session->dcc_completions;
+	unsigned int i;
+
+	libirc_mutex_lock (&session->mutex_dcc);
+
+	for ( i = 0; i < session->dcc_slots; i++ )
+	{
+		irc_dcc_session_t * dcc = libirc_dcc_slot (session, i);
+
+		if ( dcc->id && dcc->state == LIBIRC_STATE_DETACHED && libirc_dcc_worker_cancel (session, dcc) == 0 )
+			dcc->state = LIBIRC_STATE_CONNECTED;
+	}
+
+	libirc_mutex_unlock (&session->mutex_dcc);
+
+	irc_set_dcc_pool (session, 0);
+
+	if ( !done )
+		return;
+
+	while ( done->overflow )
+	{
+		struct libirc_dcc_overflow * next = done->overflow->next;
+
+		free (done->overflow);
+		done->overflow = next;
+	}
+
+	libirc_mutex_destroy (&done->mutex);
+	free (done);
+	session->dcc_completions = 0;
+
+	close (session->dcc_donefd[0]);
+	close (session->dcc_donefd[1]);
+	session->dcc_donefd[0] = session->dcc_donefd[1] = -1;
+	libirc_watch_dirty (session, 0);
+}
+
+
+// Stops the data threads of a pool that is no longer used.
+static void libirc_dcc_pool_stop (irc_dcc_pool_t * pool)
+{
+	unsigned int i;
+
+	for ( i = 0; i < pool->count; i++ )
+	{
+		struct libirc_dcc_worker * worker = pool->workers[i];
+
+		atomic_store_explicit (&worker->stop, true, memory_order_release);
+		libirc_pipe_wake (worker->wakefd[1]);
+		pthread_join (worker->thread, 0);
+
+		close (worker->wakefd[0]);
+		close (worker->wakefd[1]);
+		libirc_mutex_destroy (&worker->requests_mutex);
+		free (worker);
+	}
+
+	free (pool->workers);
+	free (pool->cpus);
+}
+
+#else
+
+static int libirc_dcc_worker_attach (irc_session_t * session, irc_dcc_session_t * dcc) { return 1; }
+static int libirc_dcc_worker_cancel (irc_session_t * session, irc_dcc_session_t * dcc) { return 0; }
+static void libirc_dcc_worker_wake (irc_session_t * session, irc_dcc_session_t * dcc) {}
+static int libirc_dcc_worker_fd (irc_session_t * session) { return -1; }
+static int libirc_dcc_worker_defer (irc_session_t * session) { return 0; }
+static void libirc_dcc_worker_collect (irc_session_t * session) {}
+static void libirc_dcc_worker_stop (irc_session_t * session) { irc_set_dcc_pool (session, 0); }
+
+#endif /* ENABLE_THREADS */
+
+
+irc_dcc_pool_t * irc_dcc_pool_create (unsigned int count, const int * cpus)
+{
+	irc_dcc_pool_t * pool;
+
+	if ( count == 0 || count > LIBIRC_DCC_INDEX_MASK )
+		return 0;
+
+	if ( (pool = calloc (1, sizeof(*pool))) == 0 )
+		return 0;
+
+	if ( libirc_mutex_init (&pool->mutex) )
+	{
+		free (pool);
+		return 0;
+	}
+
+#if defined (ENABLE_THREADS)
+	if ( (pool->workers = calloc (count, sizeof(*pool->workers))) == 0
+	|| (cpus && (pool->cpus = malloc (count * sizeof(*pool->cpus))) == 0) )
+	{
+		free (pool->workers);
+		libirc_mutex_destroy (&pool->mutex);
+		free (pool);
+		return 0;
+	}
+
+	if ( cpus )
+		memcpy (pool->cpus, cpus, count * sizeof(*pool->cpus));
+
+	pool->max = count;
+#endif
+
+	pool->refs = 1;
+	return pool;
+}
+
+
+static void libirc_dcc_pool_ref (irc_dcc_pool_t * pool)
+{
+	libirc_mutex_lock (&pool->mutex);
+	pool->refs++;
+	libirc_mutex_unlock (&pool->mutex);
+}
+
+
+static void libirc_dcc_pool_unref (irc_dcc_pool_t * pool)
+{
+	unsigned int refs;
+
+	libirc_mutex_lock (&pool->mutex);
+	refs = --pool->refs;
+	libirc_mutex_unlock (&pool->mutex);
+
+	if ( refs )
+		return;
+
+#if defined (ENABLE_THREADS)
+	libirc_dcc_pool_stop (pool);
+#endif
+	libirc_mutex_destroy (&pool->mutex);
+	free (pool);
+}
+
+
+void irc_dcc_pool_destroy (irc_dcc_pool_t * pool)
+{
+	if ( pool )
+		libirc_dcc_pool_unref (pool);
+}
+
+
+void irc_set_dcc_pool (irc_session_t * session, irc_dcc_pool_t * pool)
+{
+	irc_dcc_pool_t * old;
+
+	if ( pool )
+		libirc_dcc_pool_ref (pool);
+
+	// The transfers already handed over keep their reference to the old pool
+	libirc_mutex_lock (&session->mutex_dcc);
+	old = session->dcc_pool;
+	session->dcc_pool = pool;
+	libirc_mutex_unlock (&session->mutex_dcc);
+
+	if ( old )
+		libirc_dcc_pool_unref (old);
+}
+
+
+int irc_set_dcc_threads (irc_session_t * session, unsigned int count, const int * cpus)
+{
+	irc_dcc_pool_t * pool;
+
+	if ( count == 0 || count > LIBIRC_DCC_INDEX_MASK )
+	{
+		session->lasterror = LIBIRC_ERR_INVAL;
+		return 1;
+	}
+
+	if ( (pool = irc_dcc_pool_create (count, cpus)) == 0 )
+	{
+		session->lasterror = LIBIRC_ERR_NOMEM;
+		return 1;
+	}
+
+	irc_set_dcc_pool (session, pool);
+	irc_dcc_pool_destroy (pool);
+	return 0;
+}
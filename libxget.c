@@ -0,0 +1,1338 @@
+#include <stdio.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <assert.h>
+#include <regex.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <time.h>
+
+#include "libircclient/include/libircclient.h"
+#include "libircclient/include/libirc_rfcnumeric.h"
+#include "xget.h"
+
+/*
+ * Match Groups:
+ * 1. The entire matched string.
+ * 2. The scheme ("irc" or "ircs").
+ * 3. The hostname or IP address.
+ * 4. [optional] The ':' and port number.
+ * 5. [optional] The port number.
+ * 6. One or more channels.
+ * 7. The last channel (if more than one).
+ */
+#define IRC_URI_REGEX \
+    "(ircs?)://([[:alnum:]\\.-]{3,})" \
+    "(:([0-9]|[1-9][0-9]{1,3}|[1-5][0-9]{4}|6[0-4][0-9]{3}|65[0-4][0-9]{2}|655[0-2][0-9]|6553[0-5]))?" \
+    "/(#[[:alnum:]_-]+(,#[[:alnum:]_-]+)*)"
+
+// The longest JOIN line sent, well below the 512-byte limit of an IRC message.
+#define XGET_JOIN_LINE_MAX 400
+
+// The most data staged in memory while the output file is being prepared.
+#define XGET_STAGING_SIZE (256 * 1024)
+
+// How often the presence of the DCC sender is polled with ISON, in milliseconds, while
+// waiting for it on an IRC server without MONITOR.
+#define XGET_ISON_INTERVAL 30000
+
+// The numerics of MONITOR (IRCv3), which RFC 1459 does not know.
+#define XGET_RPL_ISUPPORT 5
+#define XGET_RPL_MONONLINE 730
+#define XGET_ERR_MONLISTFULL 734
+
+// The most groups a notice pattern may refer to, plus one for the whole match.
+#define XGET_NOTICE_GROUPS 10
+
+// How many times per idle deadline the transfer is checked for progress.
+#define XGET_IDLE_CHECKS 4
+
+struct job_notice_pattern
+{
+    struct xget_notice_pattern pattern;
+    regex_t re;
+};
+
+struct xget_job
+{
+    struct xdccGetConfig cfg;
+    struct xget_callbacks callbacks;
+    void *ctx;
+
+    irc_session_t *session;
+    char nick[20];
+
+    // The name of the file being downloaded, if it was chosen by the DCC sender.
+    char *sender_filename;
+
+    // The output file and its mapping, while a transfer is in progress.
+    const char *path;
+    int fd;
+    void *maddr;
+    irc_dcc_size_t filesize;
+
+    // How much of the file has been received, updated on the DCC data thread and
+    // reported to on_progress by the driving thread. Guarded by the mutex below.
+    irc_dcc_size_t currsize;
+    bool progress_due;
+
+    // A small file is received into the staging buffer as a whole, and written out
+    // once complete.
+    bool small_file;
+
+    // The output file is prepared on a separate thread while the DCC connection is
+    // being established. The data received before it is ready is staged in memory,
+    // and copied into the file by that thread; once the staging buffer is full, the
+    // transfer is paused until then. Guarded by the mutex below.
+    pthread_t prep_thread;
+    bool has_prep_thread;
+    bool paused;
+    bool sink_ready;
+    const char *sink_errop;
+    int sink_errnum;
+    char *staging;
+    size_t staging_size;
+    size_t staged;
+
+    // The XDCC request is sent once, as selected by cfg.request_trigger, and once the
+    // DCC sender is known to be online (see cfg.presence).
+    bool requested;
+    bool request_due;
+    bool bot_online;
+    uint32_t joined;
+
+    // Whether the IRC server supports MONITOR, and the DCC sender is monitored.
+    bool has_monitor;
+    bool monitoring;
+
+    // The notice patterns, compiled: cfg.notice_patterns, then the built-in ones.
+    struct job_notice_pattern *notice_patterns;
+    size_t num_notice_patterns;
+
+    irc_dcc_t dccid;
+    bool has_dcc;
+
+    // The deadlines of the phases in progress (see cfg.deadlines), and how much the
+    // transfer had received when last checked, and since when.
+    irc_timer_t join_timer;
+    irc_timer_t offer_timer;
+    irc_timer_t idle_timer;
+    irc_dcc_size_t idle_size;
+    uint64_t idle_since;
+
+    int status;
+    bool finished;
+    char errmsg[256];
+
+    // A cancellation request may come from any thread; the pipe wakes up the driving thread.
+    pthread_mutex_t mutex;
+    bool cancelled;
+    int wakefd[2];
+};
+
+static void job_release_file (xget_job_t *job)
+{
+    if ( job->has_prep_thread )
+    {
+	pthread_join (job->prep_thread, NULL);
+	job->has_prep_thread = false;
+    }
+
+    free (job->staging);
+    job->staging = NULL;
+    job->staging_size = job->staged = 0;
+
+    if ( job->maddr )
+    {
+	munmap (job->maddr, job->filesize);
+	job->maddr = NULL;
+    }
+
+    if ( job->fd >= 0 )
+    {
+	close (job->fd);
+	job->fd = -1;
+    }
+}
+
+// Stops the transfer in progress, if any, before its output file is released.
+static void job_abort_transfer (xget_job_t *job)
+{
+    if ( job->has_dcc )
+    {
+	irc_dcc_destroy (job->session, job->dccid);
+	job->has_dcc = false;
+    }
+
+    job_release_file (job);
+}
+
+/*
+ * Wakes up the thread that drives the job. Returns 0, or the errno of the failure;
+ * a full pipe is no failure, as the thread is woken up already.
+ */
+static int job_wake (xget_job_t *job)
+{
+    while ( write (job->wakefd[1], "", 1) < 0 )
+    {
+	if ( errno == EAGAIN )
+	    break;
+	if ( errno != EINTR )
+	    return errno;
+    }
+
+    return 0;
+}
+
+static uint64_t job_time_ms (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void job_cancel_deadline (xget_job_t *job, irc_timer_t *timer)
+{
+    if ( *timer )
+	irc_timer_cancel (job->session, *timer);
+
+    *timer = 0;
+}
+
+/*
+ * Records the final status of the job, informs the host and leaves the IRC network.
+ * Only the first call has any effect, so the original cause of a failure is kept.
+ */
+static void job_finish (xget_job_t *job, int status, const char *fmt, ...)
+{
+    if ( job->finished )
+	return;
+
+    job->finished = true;
+    job->status = status;
+
+    job_cancel_deadline (job, &job->join_timer);
+    job_cancel_deadline (job, &job->offer_timer);
+    job_cancel_deadline (job, &job->idle_timer);
+
+    if ( fmt )
+    {
+	va_list ap;
+	va_start (ap, fmt);
+	vsnprintf (job->errmsg, sizeof job->errmsg, fmt, ap);
+	va_end (ap);
+    }
+
+    if ( job->callbacks.on_complete )
+	job->callbacks.on_complete (job, status, job->ctx);
+
+    if ( irc_cmd_quit (job->session, NULL) )
+	irc_disconnect (job->session);
+}
+
+// Starts the deadline of a phase, unless it is unbounded.
+static void job_start_deadline (xget_job_t *job, irc_timer_t *timer, uint32_t seconds, irc_timer_callback_t callback)
+{
+    job_cancel_deadline (job, timer);
+
+    if ( !seconds || job->finished )
+	return;
+
+    if ( !(*timer = irc_timer_add (job->session, seconds * 1000, callback, job)) )
+	job_finish (job, XGET_ERR_FAILURE, "failed to schedule a deadline: %s", irc_strerror (irc_errno (job->session)));
+}
+
+static void timer_join (irc_session_t *session, irc_timer_t id, void *ctx)
+{
+    xget_job_t *job = ctx;
+
+    job->join_timer = 0;
+    job_finish (job, XGET_ERR_JOIN_TIMEOUT, "channels not joined within %u seconds", job->cfg.deadlines.join);
+}
+
+static void timer_offer (irc_session_t *session, irc_timer_t id, void *ctx)
+{
+    xget_job_t *job = ctx;
+
+    job->offer_timer = 0;
+    job_finish (job, XGET_ERR_OFFER_TIMEOUT, "no DCC offer from nick '%s' within %u seconds",
+		job->cfg.botNick, job->cfg.deadlines.offer);
+}
+
+/*
+ * Checks a few times per idle deadline whether the transfer has received anything
+ * since the last check, and gives up on it once it has not for a whole deadline.
+ */
+static void timer_idle (irc_session_t *session, irc_timer_t id, void *ctx)
+{
+    xget_job_t *job = ctx;
+    uint64_t now = job_time_ms ();
+
+    pthread_mutex_lock (&job->mutex);
+    irc_dcc_size_t currsize = job->currsize;
+    pthread_mutex_unlock (&job->mutex);
+
+    job->idle_timer = 0;
+
+    if ( job->finished || !job->has_dcc )
+	return;
+
+    if ( currsize != job->idle_size )
+    {
+	job->idle_size = currsize;
+	job->idle_since = now;
+    }
+    else if ( now - job->idle_since >= job->cfg.deadlines.idle * 1000ULL )
+    {
+	job_abort_transfer (job);
+	job_finish (job, XGET_ERR_IDLE_TIMEOUT, "no data received for %u seconds", job->cfg.deadlines.idle);
+	return;
+    }
+
+    if ( !(job->idle_timer = irc_timer_add (session, job->cfg.deadlines.idle * 1000 / XGET_IDLE_CHECKS, timer_idle, job)) )
+	job_finish (job, XGET_ERR_FAILURE, "failed to schedule a deadline: %s", irc_strerror (irc_errno (session)));
+}
+
+static void job_send_request (xget_job_t *job)
+{
+    job->request_due = true;
+
+    if ( job->requested || job->finished || !job->bot_online )
+	return;
+
+    job->requested = true;
+
+    char xdcc_command[24];
+    snprintf (xdcc_command, sizeof xdcc_command, "XDCC SEND #%u", job->cfg.pack);
+
+    if ( irc_cmd_msg (job->session, job->cfg.botNick, xdcc_command) )
+    {
+	job_finish (job, XGET_ERR_IRC, "failed to send XDCC command '%s' to nick '%s': %s",
+		    xdcc_command, job->cfg.botNick, irc_strerror (irc_errno (job->session)));
+	return;
+    }
+
+    job_start_deadline (job, &job->offer_timer, job->cfg.deadlines.offer, timer_offer);
+}
+
+static void timer_request (irc_session_t *session, irc_timer_t id, void *ctx)
+{
+    job_send_request (ctx);
+}
+
+static void job_check_presence (xget_job_t *job)
+{
+    if ( irc_send_raw (job->session, "ISON %s", job->cfg.botNick) )
+	job_finish (job, XGET_ERR_IRC, "failed to check the presence of nick '%s': %s",
+		    job->cfg.botNick, irc_strerror (irc_errno (job->session)));
+}
+
+static void timer_ison (irc_session_t *session, irc_timer_t id, void *ctx)
+{
+    xget_job_t *job = ctx;
+
+    if ( !job->bot_online && !job->finished )
+	job_check_presence (job);
+}
+
+// Returns true if the DCC sender is among the space- or comma-separated nicks (or
+// nick!user@host masks) in list.
+static bool job_list_has_bot (xget_job_t *job, const char *list)
+{
+    size_t len = strlen (job->cfg.botNick);
+
+    for ( const char *p = list; *p; p++ )
+    {
+	if ( *p == ' ' || *p == ',' || *p == ':' )
+	    continue;
+
+	if ( !strncasecmp (p, job->cfg.botNick, len) && (p[len] == '\0' || strchr (" ,!", p[len])) )
+	    return true;
+
+	p += strcspn (p, " ,");
+	if ( !*p )
+	    break;
+    }
+
+    return false;
+}
+
+static void job_bot_online (xget_job_t *job)
+{
+    if ( job->bot_online )
+	return;
+
+    job->bot_online = true;
+
+    if ( job->monitoring )
+	irc_send_raw (job->session, "MONITOR - %s", job->cfg.botNick);
+
+    if ( job->request_due )
+	job_send_request (job);
+}
+
+// Waits for the DCC sender to come online: the IRC server notifies us with MONITOR,
+// or else it is asked again every XGET_ISON_INTERVAL.
+static void job_wait_for_bot (xget_job_t *job)
+{
+    if ( job->has_monitor && !job->monitoring )
+    {
+	job->monitoring = true;
+
+	if ( irc_send_raw (job->session, "MONITOR + %s", job->cfg.botNick) == 0 )
+	    return;
+    }
+
+    if ( !irc_timer_add (job->session, XGET_ISON_INTERVAL, timer_ison, job) )
+	job_finish (job, XGET_ERR_FAILURE, "failed to schedule the presence check: %s", irc_strerror (irc_errno (job->session)));
+}
+
+static void event_numeric (irc_session_t *session, unsigned int event, const char *origin, const char **params, unsigned int count)
+{
+    assert (session);
+
+    xget_job_t *job = irc_get_ctx (session);
+
+    switch ( event )
+    {
+	case XGET_RPL_ISUPPORT:
+	    for ( unsigned int i = 1; i + 1 < count; i++ )
+		if ( !strncmp (params[i], "MONITOR", 7) && (params[i][7] == '\0' || params[i][7] == '=') )
+		    job->has_monitor = true;
+	    break;
+
+	case LIBIRC_RFC_RPL_ISON:
+	    if ( job->bot_online || job->finished )
+		break;
+
+	    if ( count > 1 && job_list_has_bot (job, params[1]) )
+		job_bot_online (job);
+	    else if ( job->cfg.presence == XGET_PRESENCE_WAIT )
+		job_wait_for_bot (job);
+	    else
+		job_finish (job, XGET_ERR_BOT_OFFLINE, "nick '%s' is not online on %s", job->cfg.botNick, job->cfg.host);
+	    break;
+
+	case XGET_RPL_MONONLINE:
+	    if ( count > 1 && job_list_has_bot (job, params[1]) )
+		job_bot_online (job);
+	    break;
+
+	case XGET_ERR_MONLISTFULL:
+	    // Poll with ISON instead
+	    job->has_monitor = false;
+	    if ( !job->bot_online )
+		job_wait_for_bot (job);
+	    break;
+    }
+}
+
+/*
+ * Returns the number of seconds in a duration such as "1h20m", "1 hr 20 min" or
+ * "2 days 3 hours", or 0 if there is none.
+ */
+static uint32_t parse_duration (const char *text)
+{
+    uint32_t seconds = 0;
+    char *p = (char *) text;
+
+    while ( *p )
+    {
+	if ( !isdigit ((unsigned char) *p) )
+	{
+	    p++;
+	    continue;
+	}
+
+	unsigned long n = strtoul (p, &p, 10);
+	while ( *p == ' ' )
+	    p++;
+
+	switch ( tolower ((unsigned char) *p) )
+	{
+	    case 'd': seconds += n * 86400; break;
+	    case 'h': seconds += n * 3600; break;
+	    case 'm': seconds += n * 60; break;
+	    case 's': seconds += n; break;
+	}
+    }
+
+    return seconds;
+}
+
+// Returns the text captured by a group of a notice, or an empty string.
+static const char * notice_group (const char *text, const regmatch_t *matches, unsigned int group, char *buf, size_t size)
+{
+    buf[0] = '\0';
+
+    if ( group && group < XGET_NOTICE_GROUPS && matches[group].rm_so >= 0 )
+	snprintf (buf, size, "%.*s", (int) (matches[group].rm_eo - matches[group].rm_so), text + matches[group].rm_so);
+
+    return buf;
+}
+
+static void job_queued (xget_job_t *job, uint32_t position, uint32_t total, uint32_t eta)
+{
+    // The offer comes once the queue has moved up, however long that takes.
+    job_cancel_deadline (job, &job->offer_timer);
+
+    if ( job->callbacks.on_queue )
+	job->callbacks.on_queue (job, position, total, eta, job->ctx);
+
+    if ( job->cfg.max_queue_position && position > job->cfg.max_queue_position )
+    {
+	// Leave the queue rather than hold a place in it.
+	irc_cmd_msg (job->session, job->cfg.botNick, "XDCC REMOVE");
+	job_finish (job, XGET_ERR_QUEUE_FULL, "queued in position %u by nick '%s', beyond the limit of %u",
+		    position, job->cfg.botNick, job->cfg.max_queue_position);
+    }
+}
+
+// Acts on what a notice of the DCC sender says about the request, if anything.
+static void job_classify_notice (xget_job_t *job, const char *text)
+{
+    regmatch_t matches[XGET_NOTICE_GROUPS];
+    char buf[32];
+
+    for ( size_t i = 0; i < job->num_notice_patterns; i++ )
+    {
+	const struct xget_notice_pattern *pattern = &job->notice_patterns[i].pattern;
+
+	if ( regexec (&job->notice_patterns[i].re, text, XGET_NOTICE_GROUPS, matches, 0) )
+	    continue;
+
+	switch ( pattern->kind )
+	{
+	    case XGET_NOTICE_QUEUED:
+		job_queued (job, strtoul (notice_group (text, matches, pattern->position, buf, sizeof buf), NULL, 10),
+			    strtoul (notice_group (text, matches, pattern->total, buf, sizeof buf), NULL, 10),
+			    parse_duration (notice_group (text, matches, pattern->eta, buf, sizeof buf)));
+		break;
+
+	    case XGET_NOTICE_QUEUE_FULL:
+		job_finish (job, XGET_ERR_QUEUE_FULL, "the queue of nick '%s' is full: %s", job->cfg.botNick, text);
+		break;
+
+	    case XGET_NOTICE_DENIED:
+		job_finish (job, XGET_ERR_DENIED, "nick '%s' denied the request: %s", job->cfg.botNick, text);
+		break;
+	}
+
+	return;
+    }
+}
+
+// The DCC sender answers the request with notices, or with private messages.
+static void event_notice (irc_session_t *session, const char *event, const char *origin, const char **params, unsigned int count)
+{
+    assert (session);
+
+    xget_job_t *job = irc_get_ctx (session);
+    char nick[128], *text;
+
+    if ( !origin || count < 2 || !job->requested || job->has_dcc || job->finished )
+	return;
+
+    irc_target_get_nick (origin, nick, sizeof nick);
+    if ( strcasecmp (nick, job->cfg.botNick) )
+	return;
+
+    if ( (text = irc_color_strip_from_mirc (params[1])) )
+    {
+	job_classify_notice (job, text);
+	free (text);
+    }
+}
+
+static void event_join (irc_session_t *session, const char *event, const char *origin, const char **params, unsigned int count)
+{
+    assert (session);
+
+    xget_job_t *job = irc_get_ctx (session);
+    char nick[sizeof job->nick];
+
+    // Only our own JOINs count; other users joining the channels are of no interest.
+    if ( !origin )
+	return;
+
+    irc_target_get_nick (origin, nick, sizeof nick);
+    if ( strcasecmp (nick, job->nick) )
+	return;
+
+    job->joined++;
+
+    if ( job->cfg.request_trigger != XGET_REQUEST_ON_ALL_JOINS || job->joined >= job->cfg.numChannels )
+	job_cancel_deadline (job, &job->join_timer);
+
+    if ( job->cfg.request_trigger == XGET_REQUEST_ON_JOIN
+	 || (job->cfg.request_trigger == XGET_REQUEST_ON_ALL_JOINS && job->joined >= job->cfg.numChannels) )
+	job_send_request (job);
+}
+
+/*
+ * Joins all the channels with as few JOIN commands as possible, each of which
+ * lists several channels separated by commas.
+ */
+static void job_join_channels (xget_job_t *job)
+{
+    char line[XGET_JOIN_LINE_MAX];
+    size_t len = 0;
+
+    for ( uint32_t i = 0; i < job->cfg.numChannels; i++ )
+    {
+	const char *channel = job->cfg.channelsToJoin[i];
+	size_t n = strlen (channel);
+
+	if ( len && len + 1 + n >= sizeof line )
+	{
+	    irc_cmd_join (job->session, line, 0);
+	    len = 0;
+	}
+
+	// A channel name this long would not be accepted by any IRC server anyway.
+	if ( n >= sizeof line )
+	    continue;
+
+	if ( len )
+	    line[len++] = ',';
+	memcpy (line + len, channel, n + 1);
+	len += n;
+    }
+
+    if ( len )
+	irc_cmd_join (job->session, line, 0);
+}
+
+static void event_connect (irc_session_t *session, const char *event, const char *origin, const char **params, unsigned int count)
+{
+    assert (session);
+
+    xget_job_t *job = irc_get_ctx (session);
+    job_join_channels (job);
+
+    // Reconnected during the transfer; the request is not repeated.
+    if ( job->requested )
+	return;
+
+    job_start_deadline (job, &job->join_timer, job->cfg.deadlines.join, timer_join);
+
+    if ( job->cfg.presence == XGET_PRESENCE_IGNORE )
+	job->bot_online = true;
+    else
+	job_check_presence (job);
+
+    if ( job->cfg.request_trigger == XGET_REQUEST_ON_WELCOME )
+	job_send_request (job);
+    else if ( job->cfg.request_trigger == XGET_REQUEST_AFTER_DELAY
+	      && !irc_timer_add (session, job->cfg.request_delay, timer_request, job) )
+	job_finish (job, XGET_ERR_FAILURE, "failed to schedule the XDCC request: %s", irc_strerror (irc_errno (session)));
+}
+
+static void callback_dcc_recv_file (irc_session_t *session, irc_dcc_t id, int status, void *ctx)
+{
+    assert (session);
+
+    int nread;
+    xget_job_t *job = ctx;
+
+    if ( status )
+    {
+	job->has_dcc = false;
+	job_release_file (job);
+	if ( status == LIBIRC_ERR_CLOSED )
+	    job_finish (job, XGET_ERR_DCC, "DCC sender closed the connection");
+	else
+	    job_finish (job, XGET_ERR_DCC, "failed to download file: %s", irc_strerror (status));
+	return;
+    }
+
+    // This may run on libircclient's DCC data thread. A failed read is reported
+    // back through this callback, with a nonzero status, on the driving thread.
+    pthread_mutex_lock (&job->mutex);
+
+    // Nowhere to put the data for now: it is left to TCP until the driving thread
+    // resumes the transfer, or aborts it once the output file has failed.
+    if ( job->sink_errnum || (!job->small_file && !job->sink_ready && job->staged == job->staging_size) )
+    {
+	job->paused = true;
+	irc_dcc_pause (session, id);
+	pthread_mutex_unlock (&job->mutex);
+	return;
+    }
+
+    if ( !job->sink_ready )
+    {
+	if ( (nread = irc_dcc_read (session, id, job->staging + job->staged, job->staging_size - job->staged)) > 0 )
+	    job->staged += nread;
+    }
+    else
+    {
+	// Only this thread moves currsize, so the file can be read into unlocked.
+	irc_dcc_size_t offset = job->currsize;
+	pthread_mutex_unlock (&job->mutex);
+	nread = irc_dcc_read (session, id, (char *)job->maddr + offset, job->filesize - offset);
+	pthread_mutex_lock (&job->mutex);
+    }
+
+    // The progress is reported by the driving thread, which is woken up once for
+    // however many chunks arrive before it gets to it.
+    bool wake = false;
+    if ( nread > 0 )
+    {
+	job->currsize += nread;
+	wake = !job->progress_due;
+	job->progress_due = true;
+    }
+    pthread_mutex_unlock (&job->mutex);
+
+    if ( wake )
+	job_wake (job);
+}
+
+/*
+ * Reports to on_progress whatever has been received since it was last called.
+ */
+static void job_report_progress (xget_job_t *job)
+{
+    pthread_mutex_lock (&job->mutex);
+    bool due = job->progress_due;
+    irc_dcc_size_t currsize = job->currsize;
+    job->progress_due = false;
+    pthread_mutex_unlock (&job->mutex);
+
+    if ( due && job->callbacks.on_progress )
+	job->callbacks.on_progress (job, currsize, job->filesize, job->ctx);
+}
+
+/*
+ * Writes a small file, received as a whole into the staging buffer, with a single write.
+ */
+static void job_write_small_file (xget_job_t *job)
+{
+    int fd = open (job->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if ( fd < 0 )
+    {
+	job_release_file (job);
+	job_finish (job, XGET_ERR_FILE, "open: %s: %s", job->path, strerror (errno));
+	return;
+    }
+
+    ssize_t size = job->staged;
+    ssize_t nwritten = write (fd, job->staging, size);
+    int errnum = nwritten < 0 ? errno : ENOSPC;
+
+    if ( close (fd) && nwritten == size )
+    {
+	nwritten = -1;
+	errnum = errno;
+    }
+
+    job_release_file (job);
+
+    if ( nwritten != size )
+	job_finish (job, XGET_ERR_FILE, "write: %s: %s", job->path, strerror (errnum));
+    else
+	job_finish (job, XGET_OK, NULL);
+}
+
+static void callback_dcc_close (irc_session_t *session, irc_dcc_t id, int status, void *ctx)
+{
+    assert (session);
+
+    xget_job_t *job = ctx;
+
+    job->has_dcc = false;
+    job_report_progress (job);
+
+    if ( job->small_file )
+    {
+	job_write_small_file (job);
+	return;
+    }
+
+    // A file that fits in the staging buffer may be complete before its output file is.
+    if ( job->has_prep_thread )
+    {
+	pthread_join (job->prep_thread, NULL);
+	job->has_prep_thread = false;
+    }
+
+    if ( job->sink_errnum )
+	return;
+
+    if ( munmap (job->maddr, job->filesize) )
+	job_finish (job, XGET_ERR_FILE, "munmap: %s", strerror (errno));
+
+    job->maddr = NULL;
+    job_release_file (job);
+    job_finish (job, XGET_OK, NULL);
+}
+
+/*
+ * Creates the output file and maps it. This runs on its own thread while the
+ * DCC connection is being established, since on a network file system it can
+ * take longer than the connection itself.
+ */
+static void * job_prepare_file (void *arg)
+{
+    xget_job_t *job = arg;
+    const char *errop = NULL;
+    void *maddr = MAP_FAILED;
+    int errnum = 0;
+
+    int fd = open (job->path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if ( fd < 0 )
+    {
+	errop = "open";
+	errnum = errno;
+    }
+    else
+    {
+	// The file must be allocated to its final size in order for the mmap(2) below to succeed.
+	if ( ftruncate (fd, job->filesize) )
+	{
+	    errop = "ftruncate";
+	    errnum = errno;
+	}
+	else if ( (maddr = mmap (NULL, job->filesize, PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED )
+	{
+	    errop = "mmap";
+	    errnum = errno;
+	}
+	else
+	    madvise (maddr, job->filesize, MADV_SEQUENTIAL);
+    }
+
+    pthread_mutex_lock (&job->mutex);
+
+    job->fd = fd;
+    bool wake = errop || job->paused;
+
+    if ( errop )
+    {
+	job->sink_errop = errop;
+	job->sink_errnum = errnum;
+    }
+    else
+    {
+	memcpy (maddr, job->staging, job->staged);
+	job->maddr = maddr;
+	job->sink_ready = true;
+    }
+
+    pthread_mutex_unlock (&job->mutex);
+
+    // The driving thread reports the failure, or resumes the transfer. Should it not be
+    // woken up, it still finds out the next time it processes its descriptors.
+    if ( wake )
+	job_wake (job);
+
+    return NULL;
+}
+
+static void event_dcc_send_req (irc_session_t *session, const char *nick, const char *addr, const char *filename, irc_dcc_size_t size, irc_dcc_t dccid)
+{
+    assert (session);
+
+    xget_job_t *job = irc_get_ctx (session);
+    const char *path = job->cfg.filename;
+
+    // Only a single file is downloaded per job; ignore further offers.
+    if ( job->finished || job->has_dcc || job->has_prep_thread )
+    {
+	irc_dcc_decline (session, dccid);
+	return;
+    }
+
+    if ( !job->cfg.has_opt_output_document )
+    {
+	// Check that the file's name is only a file name and not a path. DCC senders
+	// should not be sending file paths as file names, and we should not be opening
+	// untrusted files outside the current working directory.
+	char *name = strdup (filename);
+	if ( !name || strcmp (basename (name), filename) )
+	{
+	    free (name);
+	    irc_dcc_decline (session, dccid);
+	    job_finish (job, XGET_ERR_DCC, "DCC sender sent a file path as the name: '%s'", filename);
+	    return;
+	}
+
+	free (name);
+	free (job->sender_filename);
+	path = job->sender_filename = strdup (filename);
+    }
+
+    job->path = path;
+    job->filesize = size;
+    job->currsize = 0;
+    job->progress_due = false;
+    job->paused = false;
+    job->sink_ready = false;
+    job->sink_errnum = 0;
+    job->staged = 0;
+    job->small_file = size <= (job->cfg.small_file_size ? job->cfg.small_file_size : XGET_SMALL_FILE_SIZE);
+    job->staging_size = job->small_file || size < XGET_STAGING_SIZE ? size : XGET_STAGING_SIZE;
+
+    if ( !(job->staging = malloc (job->staging_size ? job->staging_size : 1)) )
+    {
+	// Without a staging buffer, the data is only read once the file is ready.
+	job->small_file = false;
+	job->staging_size = 0;
+    }
+
+    // Connect right away, and prepare the output file in the meantime.
+    if ( irc_dcc_accept (session, dccid, job, callback_dcc_recv_file, callback_dcc_close, !job->cfg.has_opt_no_acknowledge) )
+    {
+	job_release_file (job);
+	job_finish (job, XGET_ERR_DCC, "failed to accept DCC offer: %s", irc_strerror (irc_errno (session)));
+	return;
+    }
+
+    job->dccid = dccid;
+    job->has_dcc = true;
+
+    // The offer has come; from now on, the transfer has to keep going, even if the
+    // connection to the IRC network is lost.
+    job_cancel_deadline (job, &job->offer_timer);
+    irc_set_reconnect (session, job->cfg.reconnect_delay ? job->cfg.reconnect_delay : XGET_RECONNECT_DELAY,
+		       job->cfg.reconnect_max_delay ? job->cfg.reconnect_max_delay : XGET_RECONNECT_MAX_DELAY);
+    if ( job->cfg.deadlines.idle )
+    {
+	job->idle_size = 0;
+	job->idle_since = job_time_ms ();
+	timer_idle (session, 0, job);
+    }
+
+    // A small file needs no preparation: it is written out once complete.
+    if ( !job->small_file )
+    {
+	if ( pthread_create (&job->prep_thread, NULL, job_prepare_file, job) == 0 )
+	    job->has_prep_thread = true;
+	else
+	    job_prepare_file (job);
+    }
+
+    if ( job->callbacks.on_start )
+	job->callbacks.on_start (job, path, size, job->small_file, job->ctx);
+}
+
+int xget_parse_uri (struct xdccGetConfig *cfg, char *uri)
+{
+    regex_t re;
+    int regex_errno = regcomp (&re, IRC_URI_REGEX, REG_EXTENDED);
+    assert (0 == regex_errno);
+
+    regmatch_t matches[6];
+    regex_errno = regexec (&re, uri, sizeof matches / sizeof matches[0], matches, 0);
+    regfree (&re);
+
+    if ( regex_errno )
+    {
+	assert (REG_NOMATCH == regex_errno);
+	return -1;
+    }
+
+    cfg->is_ircs = matches[1].rm_eo == 4;
+
+    // Capture the IRC server hostname or IP address. If TLS is to be used, libircclient
+    // requires the hostname to be prepended with a '#' character.
+    if ( cfg->is_ircs ) uri[--matches[2].rm_so] = '#';
+    uri[matches[2].rm_eo] = '\0';
+    cfg->host = &uri[matches[2].rm_so];
+
+    if ( matches[3].rm_so < 0 )
+	cfg->port = cfg->is_ircs ? 6697 : 6667;
+    else
+	// atoi(3) is no longer recommended, but, in this case, I think it's appropriate
+	// because the string has been validated by the regular-expression pattern
+	// and atoi(3) handles mixed-text, like '6667/', better than strtonum(3).
+	cfg->port = atoi (&uri[matches[4].rm_so]);
+
+    char *channels = &uri[matches[5].rm_so];
+    uint32_t count = 1;
+
+    for ( char *sep = channels; (sep = strchr (sep, ',')); sep++ )
+	count++;
+
+    if ( !(cfg->channelsToJoin = calloc (count, sizeof *cfg->channelsToJoin)) )
+	return -1;
+
+    cfg->channelsToJoin[0] = channels;
+    cfg->numChannels = 1;
+
+    // If other IRC channels were supplied, capture those as well.
+    char *sep = channels;
+    while ( (sep = strchr (sep, ',')) )
+    {
+	*sep = '\0';
+	cfg->channelsToJoin[cfg->numChannels++] = ++sep;
+    }
+
+    return 0;
+}
+
+void xget_free_uri (struct xdccGetConfig *cfg)
+{
+    free (cfg->channelsToJoin);
+    cfg->channelsToJoin = NULL;
+    cfg->numChannels = 0;
+}
+
+static const struct
+{
+    const char *name;
+    struct xget_tuning tuning;
+} tuning_profiles[] = {
+    { "default", { {0}, {0} } },
+    { "lfn", {
+	.irc = { .nodelay = true },
+	.dcc = { .rcvbuf = 4 * 1024 * 1024, .congestion = "bbr", .quickack = true, .nodelay = true },
+    } },
+    { "low-latency", {
+	.irc = { .nodelay = true },
+	.dcc = { .quickack = true, .nodelay = true, .busy_poll = 50 },
+    } },
+};
+
+// The notices of iroffer and iroffer-dinoex, the most common DCC senders.
+static const struct xget_notice_pattern builtin_notice_patterns[] = {
+    // "Queued 0h12m for "file", in position 2 of 5. 1h05m or more remaining."
+    { XGET_NOTICE_QUEUED, "in position ([0-9]+) of ([0-9]+)(\\. *(([0-9]+ *[a-z]+ *)+) or)?", 1, 2, 4 },
+    // "** All Slots Full, Added you to the main queue for pack 3 ("file") in position 4."
+    { XGET_NOTICE_QUEUED, "added you to the (main |idle )?queue .*in position ([0-9]+)", 2, 0, 0 },
+    // "** You have been queued for 5 minutes, your position is 2 of 5"
+    { XGET_NOTICE_QUEUED, "your position is ([0-9]+)( of ([0-9]+))?", 1, 3, 0 },
+    // "** All Slots Full, Main queue of size 20 is Full, Try Again Later"
+    { XGET_NOTICE_QUEUE_FULL, "queue (of size [0-9]+ )?is full", 0, 0, 0 },
+    // "** Invalid Pack Number, Try Again"
+    { XGET_NOTICE_DENIED, "invalid pack number", 0, 0, 0 },
+    // "** XDCC SEND denied, you must be on a known channel to request a pack"
+    { XGET_NOTICE_DENIED, "xdcc send denied", 0, 0, 0 },
+    // "** You already requested that pack"
+    { XGET_NOTICE_DENIED, "you already requested that pack", 0, 0, 0 },
+};
+
+// Compiles the notice patterns of the host, then the built-in ones. Returns -1 if
+// out of memory or one of them is invalid.
+static int job_compile_notice_patterns (xget_job_t *job)
+{
+    size_t builtins = sizeof builtin_notice_patterns / sizeof builtin_notice_patterns[0];
+    size_t count = job->cfg.num_notice_patterns + builtins;
+
+    if ( !(job->notice_patterns = calloc (count, sizeof *job->notice_patterns)) )
+	return -1;
+
+    for ( size_t i = 0; i < count; i++ )
+    {
+	struct job_notice_pattern *notice = &job->notice_patterns[i];
+
+	notice->pattern = i < job->cfg.num_notice_patterns ? job->cfg.notice_patterns[i]
+							    : builtin_notice_patterns[i - job->cfg.num_notice_patterns];
+
+	if ( regcomp (&notice->re, notice->pattern.regex, REG_EXTENDED | REG_ICASE) )
+	    return -1;
+
+	job->num_notice_patterns++;
+    }
+
+    return 0;
+}
+
+int xget_tuning_profile (const char *name, struct xget_tuning *tuning)
+{
+    for ( size_t i = 0; i < sizeof tuning_profiles / sizeof tuning_profiles[0]; i++ )
+    {
+	if ( !strcmp (name, tuning_profiles[i].name) )
+	{
+	    *tuning = tuning_profiles[i].tuning;
+	    return 0;
+	}
+    }
+
+    return -1;
+}
+
+xget_job_t * xget_job_create (const struct xdccGetConfig *cfg, const struct xget_callbacks *callbacks, void *ctx)
+{
+    xget_job_t *job = calloc (1, sizeof *job);
+    if ( !job )
+	return NULL;
+
+    job->cfg = *cfg;
+    if ( callbacks )
+	job->callbacks = *callbacks;
+    job->ctx = ctx;
+    job->fd = -1;
+
+    if ( pipe (job->wakefd) )
+    {
+	free (job);
+	return NULL;
+    }
+
+    fcntl (job->wakefd[0], F_SETFL, fcntl (job->wakefd[0], F_GETFL) | O_NONBLOCK);
+    fcntl (job->wakefd[1], F_SETFL, fcntl (job->wakefd[1], F_GETFL) | O_NONBLOCK);
+    pthread_mutex_init (&job->mutex, NULL);
+
+    if ( job_compile_notice_patterns (job) )
+    {
+	xget_job_destroy (job);
+	return NULL;
+    }
+
+    irc_callbacks_t irc_callbacks = {0};
+    irc_callbacks.event_connect = event_connect;
+    irc_callbacks.event_join = event_join;
+    irc_callbacks.event_numeric = event_numeric;
+    irc_callbacks.event_notice = event_notice;
+    irc_callbacks.event_privmsg = event_notice;
+    irc_callbacks.event_dcc_send_req = event_dcc_send_req;
+
+    if ( !(job->session = irc_create_session (&irc_callbacks)) )
+    {
+	xget_job_destroy (job);
+	return NULL;
+    }
+
+    irc_set_ctx (job->session, job);
+    irc_option_set (job->session, LIBIRC_OPTION_DCC_THREAD);
+    irc_set_socket_tuning (job->session, LIBIRC_TUNE_SERVER, &cfg->tuning.irc);
+    irc_set_socket_tuning (job->session, LIBIRC_TUNE_DCC, &cfg->tuning.dcc);
+    if ( cfg->rcvlowat )
+	irc_set_dcc_rcvlowat (job->session, cfg->rcvlowat);
+    irc_set_bind_pool (job->session, cfg->bind_pool);
+    irc_set_dcc_pool (job->session, cfg->dcc_pool);
+    irc_set_connect_timeout (job->session, cfg->deadlines.connect, cfg->deadlines.registration);
+    irc_set_flood_control (job->session, cfg->flood_burst ? cfg->flood_burst : XGET_FLOOD_BURST,
+			   cfg->flood_interval ? cfg->flood_interval : XGET_FLOOD_INTERVAL);
+
+    if ( cfg->endpoint_cache )
+	irc_set_endpoint_cache (job->session, cfg->endpoint_cache,
+				cfg->endpoint_cache_ttl ? cfg->endpoint_cache_ttl : XGET_ENDPOINT_CACHE_TTL);
+
+    if ( cfg->tls_session_cache )
+	irc_set_tls_session_cache (job->session, cfg->tls_session_cache);
+
+    if ( (cfg->client_cert && irc_set_ssl_client_cert (job->session, cfg->client_cert, NULL))
+	|| (cfg->sasl_external && irc_set_sasl (job->session, LIBIRC_SASL_EXTERNAL, NULL, NULL))
+	|| (cfg->sasl_user && !cfg->sasl_external
+	    && irc_set_sasl (job->session, LIBIRC_SASL_PLAIN, cfg->sasl_user, cfg->sasl_password ? cfg->sasl_password : "")) )
+    {
+	xget_job_destroy (job);
+	return NULL;
+    }
+
+    if ( cfg->nick )
+	strlcpy (job->nick, cfg->nick, sizeof job->nick);
+    else
+	snprintf (job->nick, sizeof job->nick, "xget[%d]", getpid ());
+
+    return job;
+}
+
+int xget_job_start (xget_job_t *job)
+{
+    if ( irc_connect (job->session, job->cfg.host, job->cfg.port, 0, job->nick, 0, 0) )
+    {
+	job_finish (job, XGET_ERR_CONNECT, "failed to establish TCP connection to %s:%u: %s",
+		    job->cfg.host, job->cfg.port, irc_strerror (irc_errno (job->session)));
+	return job->status;
+    }
+
+    return XGET_OK;
+}
+
+/*
+ * Acts on what the other threads left for the driving thread: a cancellation, an
+ * output file that failed or became ready, the progress of the transfer. Looked at
+ * on every pass, in case they failed to wake the driving thread up.
+ */
+static void job_process_shared (xget_job_t *job)
+{
+    if ( job->has_dcc )
+	job_report_progress (job);
+
+    pthread_mutex_lock (&job->mutex);
+    bool cancelled = job->cancelled;
+    int sink_errnum = job->sink_errnum;
+    bool resume = job->paused && job->sink_ready;
+    if ( resume )
+	job->paused = false;
+    pthread_mutex_unlock (&job->mutex);
+
+    if ( resume && job->has_dcc )
+	irc_dcc_resume (job->session, job->dccid);
+
+    if ( sink_errnum && !job->finished )
+    {
+	job_abort_transfer (job);
+	job_finish (job, XGET_ERR_FILE, "%s: %s: %s", job->sink_errop, job->path, strerror (sink_errnum));
+    }
+
+    if ( cancelled && !job->finished )
+    {
+	job_abort_transfer (job);
+	job_finish (job, XGET_ERR_CANCELLED, "job cancelled");
+    }
+}
+
+int xget_job_add_select_descriptors (xget_job_t *job, fd_set *in_set, fd_set *out_set, int *maxfd)
+{
+    if ( !irc_is_connected (job->session) )
+	return 1;
+
+    FD_SET (job->wakefd[0], in_set);
+    if ( *maxfd < job->wakefd[0] )
+	*maxfd = job->wakefd[0];
+
+    return irc_add_select_descriptors (job->session, in_set, out_set, maxfd);
+}
+
+int xget_job_process_select_descriptors (xget_job_t *job, fd_set *in_set, fd_set *out_set)
+{
+    if ( FD_ISSET (job->wakefd[0], in_set) )
+    {
+	char drain[16];
+	while ( read (job->wakefd[0], drain, sizeof drain) > 0 );
+    }
+
+    job_process_shared (job);
+
+    if ( irc_is_connected (job->session) && irc_process_select_descriptors (job->session, in_set, out_set) )
+    {
+	int errnum = irc_errno (job->session);
+	if ( errnum == LIBIRC_ERR_RESOLV || errnum == LIBIRC_ERR_CONNECT )
+	{
+	    // The server name is resolved and its addresses raced in the background
+	    job_finish (job, XGET_ERR_CONNECT, "failed to establish TCP connection to %s:%u: %s",
+			job->cfg.host, job->cfg.port, irc_strerror (errnum));
+	}
+	else if ( errnum == LIBIRC_ERR_CONNECT_TIMEOUT )
+	{
+	    job_finish (job, XGET_ERR_CONNECT_TIMEOUT, "failed to establish TCP connection to %s:%u within %u seconds",
+			job->cfg.host, job->cfg.port, job->cfg.deadlines.connect);
+	}
+	else if ( errnum == LIBIRC_ERR_REGISTER_TIMEOUT )
+	{
+	    job_finish (job, XGET_ERR_REGISTER_TIMEOUT, "%s:%u did not accept the registration within %u seconds",
+			job->cfg.host, job->cfg.port, job->cfg.deadlines.registration);
+	}
+	else if ( errnum != LIBIRC_ERR_TERMINATED && errnum != LIBIRC_ERR_CLOSED )
+	{
+	    job_abort_transfer (job);
+	    job_finish (job, XGET_ERR_IRC, "IRC session failed: %s", irc_strerror (errnum));
+	}
+	irc_disconnect (job->session);
+    }
+
+    if ( irc_is_connected (job->session) )
+	return 0;
+
+    // The IRC connection is gone for good; a job that has not finished by now has failed.
+    job_abort_transfer (job);
+    job_finish (job, XGET_ERR_IRC, "IRC connection closed before the file was received");
+    return 1;
+}
+
+int xget_job_next_timeout (xget_job_t *job)
+{
+    return irc_next_timeout (job->session);
+}
+
+int xget_job_run (xget_job_t *job)
+{
+    while ( !job->finished || irc_is_connected (job->session) )
+    {
+	struct timeval tv, *timeout = NULL;
+	int msec = xget_job_next_timeout (job);
+	fd_set in_set, out_set;
+	int maxfd = 0;
+
+	FD_ZERO (&in_set);
+	FD_ZERO (&out_set);
+
+	if ( xget_job_add_select_descriptors (job, &in_set, &out_set, &maxfd) )
+	{
+	    // Either the connection is gone, or it is not ready to be polled.
+	    if ( xget_job_process_select_descriptors (job, &in_set, &out_set) )
+		break;
+	    continue;
+	}
+
+	if ( msec >= 0 )
+	{
+	    tv.tv_sec = msec / 1000;
+	    tv.tv_usec = (msec % 1000) * 1000;
+	    timeout = &tv;
+	}
+
+	if ( select (maxfd + 1, &in_set, &out_set, 0, timeout) < 0 )
+	{
+	    if ( errno == EINTR )
+		continue;
+
+	    job_abort_transfer (job);
+	    job_finish (job, XGET_ERR_FAILURE, "select: %s", strerror (errno));
+	    irc_disconnect (job->session);
+	    break;
+	}
+
+	if ( xget_job_process_select_descriptors (job, &in_set, &out_set) )
+	    break;
+    }
+
+    return job->status;
+}
+
+int xget_job_cancel (xget_job_t *job)
+{
+    pthread_mutex_lock (&job->mutex);
+    job->cancelled = true;
+    pthread_mutex_unlock (&job->mutex);
+
+    if ( (errno = job_wake (job)) )
+	return XGET_ERR_FAILURE;
+
+    return XGET_OK;
+}
+
+int xget_job_status (xget_job_t *job)
+{
+    return job->status;
+}
+
+const char * xget_job_strerror (xget_job_t *job)
+{
+    return job->status ? job->errmsg : "no error";
+}
+
+void * xget_job_get_ctx (xget_job_t *job)
+{
+    return job->ctx;
+}
+
+void xget_job_destroy (xget_job_t *job)
+{
+    if ( job->session )
+	irc_destroy_session (job->session);
+
+    job_release_file (job);
+    close (job->wakefd[0]);
+    close (job->wakefd[1]);
+    pthread_mutex_destroy (&job->mutex);
+    for ( size_t i = 0; i < job->num_notice_patterns; i++ )
+	regfree (&job->notice_patterns[i].re);
+    free (job->notice_patterns);
+    free (job->sender_filename);
+    free (job);
+}
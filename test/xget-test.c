@@ -9,11 +9,35 @@
 #include <arpa/inet.h>
 #include <sys/fcntl.h>
 #include <sys/wait.h>
+#include <stdbool.h>
 
 #define IRC_MSG_MAX_SIZE 512
 
-// TODO: delete this global variable
+// How the server plays the DCC sender in a test, and how xget should exit.
+struct test_case {
+    const char *name;
+    const char *options[4];
+    int status;
+
+    // Whether ISON reports the bot online, or else MONITOR does once asked.
+    bool bot_online;
+    bool monitor;
+
+    // The notice the bot answers the request with, instead of offering the file.
+    const char *notice;
+    bool expect_remove;
+
+    // Whether the bot ignores the request, or stalls half-way through the file.
+    bool no_offer;
+    bool stall;
+
+    // The size of the file the bot sends, 1 KiB if not set.
+    size_t file_size;
+};
+
+// TODO: delete these global variables
 pid_t xget_pid;
+const struct test_case *test;
 
 typedef struct irc_server irc_server_t;
 typedef struct irc_session irc_session_t;
@@ -26,6 +50,8 @@ struct irc_server {
     irc_callback_t on_cmd_nick;
     irc_callback_t on_cmd_user;
     irc_callback_t on_cmd_join;
+    irc_callback_t on_cmd_ison;
+    irc_callback_t on_cmd_monitor;
     irc_callback_t on_cmd_quit;
     irc_callback_t on_cmd_privmsg;
 };
@@ -35,6 +61,8 @@ struct irc_session {
     irc_server_t *server;
     char nick[32];
     char user[32];
+    bool removed;
+    int dcc_fd;
     union {
 	struct sockaddr_storage sas;
 	struct sockaddr_in sai;
@@ -72,9 +100,10 @@ void irc_serve(irc_server_t *server)
 	err(EXIT_FAILURE, "listen");
 }
 
-void irc_run(irc_server_t *server)
+// Serves one xget session. Returns whether xget sent 'XDCC REMOVE' before quitting.
+bool irc_run(irc_server_t *server)
 {
-    irc_session_t session = {.server = server};
+    irc_session_t session = {.server = server, .dcc_fd = -1};
 
     socklen_t conn_sa_size = sizeof session.sas;
     if ((session.socket_fd = accept(server->socket_fd, (struct sockaddr *) &session.sas, &conn_sa_size)) == -1)
@@ -86,46 +115,64 @@ void irc_run(irc_server_t *server)
 
     server->on_accept(&session, NULL);
 
-    int counter;
-    char nick[IRC_MSG_MAX_SIZE], user[IRC_MSG_MAX_SIZE], channel[IRC_MSG_MAX_SIZE], peer[IRC_MSG_MAX_SIZE];
-    char buf[IRC_MSG_MAX_SIZE], param1[IRC_MSG_MAX_SIZE], param2[IRC_MSG_MAX_SIZE], param3[IRC_MSG_MAX_SIZE], param4[IRC_MSG_MAX_SIZE];
-    char *p = buf;
+    /*
+     * xget may send several commands in a single segment, or a command across two,
+     * so the commands are handled line by line, in whatever order they come.
+     */
+    char buf[IRC_MSG_MAX_SIZE * 4], arg[IRC_MSG_MAX_SIZE];
+    size_t len = 0;
+    ssize_t n;
 
-    recv(session.socket_fd, buf, sizeof buf, 0);
-    if (!sscanf(p, "NICK %s\r\n%n", nick, &counter))
+    while ((n = recv(session.socket_fd, buf + len, sizeof buf - len - 1, 0)) > 0)
     {
-	kill(xget_pid, SIGINT);
-	wait(NULL);
-	errx(EXIT_FAILURE, "expected IRC 'NICK' command");
+	char *line = buf, *end;
+
+	len += n;
+	buf[len] = '\0';
+
+	while ((end = strstr(line, "\r\n")))
+	{
+	    *end = '\0';
+
+	    if (sscanf(line, "NICK %511s", arg) == 1)
+		server->on_cmd_nick(&session, arg);
+	    else if (sscanf(line, "USER %511s", arg) == 1)
+		server->on_cmd_user(&session, arg);
+	    else if (sscanf(line, "JOIN %511s", arg) == 1)
+		server->on_cmd_join(&session, arg);
+	    else if (sscanf(line, "ISON %511s", arg) == 1)
+		server->on_cmd_ison(&session, arg);
+	    else if (sscanf(line, "MONITOR + %511s", arg) == 1)
+		server->on_cmd_monitor(&session, arg);
+	    else if (sscanf(line, "PRIVMSG %511s", arg) == 1 && strstr(line, ":XDCC SEND #"))
+		server->on_cmd_privmsg(&session, arg);
+	    else if (sscanf(line, "PRIVMSG %511s", arg) == 1 && strstr(line, ":XDCC REMOVE"))
+		session.removed = true;
+	    else if (!strncmp(line, "QUIT", 4))
+	    {
+		server->on_cmd_quit(&session, line + 4);
+		if (session.dcc_fd != -1)
+		    close(session.dcc_fd);
+		return session.removed;
+	    }
+
+	    line = end + 2;
+	}
+
+	len -= line - buf;
+	memmove(buf, line, len);
+
+	if (len == sizeof buf - 1)
+	{
+	    kill(xget_pid, SIGINT);
+	    wait(NULL);
+	    errx(EXIT_FAILURE, "IRC line too long");
+	}
     }
 
-    server->on_cmd_nick(&session, nick);
-    p += counter;
-
-    if (!sscanf(p, "USER %s %s %s %s\r\n%n", user, param2, param3, param4, &counter))
-    {
-	kill(xget_pid, SIGINT);
-	wait(NULL);
-	errx(EXIT_FAILURE, "expected IRC 'USER' command");
-    }
-
-    server->on_cmd_user(&session, user);
-
-    recv(session.socket_fd, buf, sizeof buf, 0);
-    sscanf(buf, "JOIN %s\r\n%n", channel, &counter);
-
-    server->on_cmd_join(&session, channel);
-
-    int pack;
-    recv(session.socket_fd, buf, sizeof buf, 0);
-    sscanf(buf, "PRIVMSG %s :XDCC SEND #%d\r\n", peer, &pack);
-
-    server->on_cmd_privmsg(&session, peer);
-
-    recv(session.socket_fd, buf, sizeof buf, 0);
-    sscanf(buf, "QUIT %s\r\n", param1);
-
-    server->on_cmd_quit(&session, param1);
+    kill(xget_pid, SIGINT);
+    wait(NULL);
+    errx(EXIT_FAILURE, "expected IRC 'QUIT' command");
 }
 
 void cb_accept(irc_session_t *session, const char *null)
@@ -162,6 +209,12 @@ void cb_cmd_user(irc_session_t *session, const char *user)
     snprintf(buf, sizeof buf, "127.0.0.1 005 %s MAXCHANNELS=30 :are supported by this server\r\n", session->nick);
     send(session->socket_fd, buf, strlen(buf), 0);
 
+    if (test->monitor)
+    {
+	snprintf(buf, sizeof buf, ":127.0.0.1 005 %s MONITOR=100 :are supported by this server\r\n", session->nick);
+	send(session->socket_fd, buf, strlen(buf), 0);
+    }
+
     strlcpy(session->user, user, sizeof session->user);
 }
 
@@ -186,6 +239,26 @@ void cb_cmd_join(irc_session_t *session, const char *channel)
     send(session->socket_fd, buf, strlen(buf), 0);
 }
 
+void cb_cmd_ison(irc_session_t *session, const char *nick)
+{
+    char buf[IRC_MSG_MAX_SIZE];
+
+    // RPL_ISON: the bot is online, or none of the nicks is
+    snprintf(buf, sizeof buf, ":127.0.0.1 303 %s :%s\r\n", session->nick, test->bot_online ? nick : "");
+    send(session->socket_fd, buf, strlen(buf), 0);
+}
+
+void cb_cmd_monitor(irc_session_t *session, const char *nick)
+{
+    char buf[IRC_MSG_MAX_SIZE];
+
+    // RPL_MONOFFLINE, then RPL_MONONLINE once the bot signs on
+    snprintf(buf, sizeof buf, ":127.0.0.1 731 %s :%s\r\n", session->nick, nick);
+    send(session->socket_fd, buf, strlen(buf), 0);
+    snprintf(buf, sizeof buf, ":127.0.0.1 730 %s :%s!%s@127.0.0.1\r\n", session->nick, nick, nick);
+    send(session->socket_fd, buf, strlen(buf), 0);
+}
+
 void cb_cmd_quit(irc_session_t *session, const char *message)
 {
     char buf[IRC_MSG_MAX_SIZE];
@@ -202,10 +275,17 @@ void cb_cmd_privmsg(irc_session_t *session, const char *peer)
 	.ai_socktype = SOCK_STREAM,
     };
 
-    // Set up DCC listening socket
-    snprintf(buf, sizeof buf, ":%s PRIVMSG %s :\001DCC SEND %s %u %u %u\001\r\n", peer, session->nick, "file.txt", htonl(session->sai.sin_addr.s_addr), 6668, 1024);
-    send(session->socket_fd, buf, strlen(buf), 0);
+    if (test->notice)
+    {
+	snprintf(buf, sizeof buf, ":%s!%s@127.0.0.1 NOTICE %s :%s\r\n", peer, peer, session->nick, test->notice);
+	send(session->socket_fd, buf, strlen(buf), 0);
+	return;
+    }
 
+    if (test->no_offer)
+	return;
+
+    // Set up DCC listening socket
     int errnum;
     if ((errnum = getaddrinfo("127.0.0.1", "6668", &hints, &res2)))
 	errx(EXIT_FAILURE, "getaddrinfo: %s", gai_strerror(errnum));
@@ -223,6 +303,11 @@ void cb_cmd_privmsg(irc_session_t *session, const char *peer)
     if (listen(dcc_sockfd, 100))
 	err(EXIT_FAILURE, "listen");
 
+    // Only offer the file once xget can connect.
+    size_t file_size = test->file_size ? test->file_size : 1024;
+    snprintf(buf, sizeof buf, ":%s PRIVMSG %s :\001DCC SEND %s %u %u %zu\001\r\n", peer, session->nick, "file.txt", htonl(session->sai.sin_addr.s_addr), 6668, file_size);
+    send(session->socket_fd, buf, strlen(buf), 0);
+
     int xget_dcc_sockfd;
     struct sockaddr_storage conn_sa;
     socklen_t conn_sa_size = sizeof conn_sa;
@@ -233,23 +318,72 @@ void cb_cmd_privmsg(irc_session_t *session, const char *peer)
 	err(EXIT_FAILURE, "accept");
     }
 
-    char file_buffer[1025] = {0};
-    memset(file_buffer, 'A', 1024);
-    send(xget_dcc_sockfd, file_buffer, strlen(file_buffer), 0);
+    char file_buffer[4096];
+    memset(file_buffer, 'A', sizeof file_buffer);
+
+    // A stalled transfer is left open until xget gives up on it and quits.
+    if (test->stall)
+    {
+	send(xget_dcc_sockfd, file_buffer, file_size / 2 < sizeof file_buffer ? file_size / 2 : sizeof file_buffer, 0);
+	session->dcc_fd = xget_dcc_sockfd;
+	close(dcc_sockfd);
+	freeaddrinfo(res2);
+	return;
+    }
+
+    for (size_t sent = 0; sent < file_size; )
+    {
+	size_t len = file_size - sent < sizeof file_buffer ? file_size - sent : sizeof file_buffer;
+	ssize_t n = send(xget_dcc_sockfd, file_buffer, len, 0);
+	if (n == -1)
+	    break;
+	sent += n;
+    }
 
-    unlink("file.txt");
     close(xget_dcc_sockfd);
     close(dcc_sockfd);
     freeaddrinfo(res2);
 }
 
+// Whether the file xget saved holds exactly what the bot sent.
+bool check_file(const char *path, size_t size)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+	return false;
+
+    size_t count = 0;
+    int c;
+    while ((c = getc(file)) == 'A')
+	count++;
+    fclose(file);
+    return c == EOF && count == size;
+}
+
 int main(int argc, char *argv[])
 {
+    const struct test_case tests[] = {
+	{ .name = "download", .status = 0, .bot_online = true },
+	// Either side of XGET_SMALL_FILE_SIZE (64 KiB): written from memory, or through a mapping.
+	{ .name = "small file", .status = 0, .bot_online = true, .file_size = 60 * 1024 },
+	{ .name = "large file", .status = 0, .bot_online = true, .file_size = 1024 * 1024 + 1 },
+	{ .name = "bot offline", .status = 7 },
+	{ .name = "wait for bot", .options = {"-W"}, .status = 0, .monitor = true },
+	{ .name = "queued too far", .options = {"-q", "2"}, .status = 13, .bot_online = true, .expect_remove = true,
+	  .notice = "** All Slots Full, Added you to the main queue for pack 42 (\"file.txt\") in position 4. "
+		    "To Remove yourself at a later time type \"/MSG bot XDCC REMOVE\"." },
+	{ .name = "denied", .status = 14, .bot_online = true, .notice = "** Invalid Pack Number, Try Again" },
+	{ .name = "offer timeout", .options = {"-t", "offer=1"}, .status = 11, .bot_online = true, .no_offer = true },
+	{ .name = "idle timeout", .options = {"-t", "idle=1"}, .status = 12, .bot_online = true, .stall = true },
+    };
+
     irc_server_t server = {
 	.on_accept = cb_accept,
 	.on_cmd_nick = cb_cmd_nick,
 	.on_cmd_user = cb_cmd_user,
 	.on_cmd_join = cb_cmd_join,
+	.on_cmd_ison = cb_cmd_ison,
+	.on_cmd_monitor = cb_cmd_monitor,
 	.on_cmd_privmsg = cb_cmd_privmsg,
 	.on_cmd_quit = cb_cmd_quit,
     };
@@ -260,32 +394,57 @@ int main(int argc, char *argv[])
     char *s = rindex(argv[0], 'x');
     strcpy(s, "xget");
 
-    // TODO: randomize arguments (within spec) to test xget's input handling/parsing.
-    char *xget_argv[] = {
-	    argv[0],
-	    "-A",
-	    "irc://localhost/#ch",
-	    "bot",
-	    "send",
-	    "42",
-	    NULL,
-    };
-
-    if ((xget_pid = fork()) == -1)
-	err(EXIT_FAILURE, "fork");
-    if (0 == xget_pid) {
-	int fd = open("/dev/null", O_RDONLY);
-	dup2(fd, STDIN_FILENO);
-	dup2(fd, STDOUT_FILENO);
-	dup2(fd, STDERR_FILENO);
-	execvp(argv[0], xget_argv);
+    int failures = 0;
+    for (size_t i = 0; i < sizeof tests / sizeof *tests; i++)
+    {
+	test = &tests[i];
+
+	// TODO: randomize arguments (within spec) to test xget's input handling/parsing.
+	char *xget_argv[12] = {argv[0], "-A"};
+	int xget_argc = 2;
+	for (int j = 0; test->options[j]; j++)
+	    xget_argv[xget_argc++] = (char *) test->options[j];
+	xget_argv[xget_argc++] = "irc://localhost/#ch";
+	xget_argv[xget_argc++] = "bot";
+	xget_argv[xget_argc++] = "send";
+	xget_argv[xget_argc++] = "42";
+
+	if ((xget_pid = fork()) == -1)
+	    err(EXIT_FAILURE, "fork");
+	if (0 == xget_pid) {
+	    int fd = open("/dev/null", O_RDONLY);
+	    dup2(fd, STDIN_FILENO);
+	    dup2(fd, STDOUT_FILENO);
+	    dup2(fd, STDERR_FILENO);
+	    execvp(argv[0], xget_argv);
+	}
+
+	bool removed = irc_run(&server);
+	if (removed != test->expect_remove)
+	{
+	    warnx("%s: expected %s 'XDCC REMOVE'", test->name, test->expect_remove ? "an" : "no");
+	    failures++;
+	}
+
+	int xget_status, xget_exit;
+	waitpid(xget_pid, &xget_status, 0);
+	xget_exit = WIFEXITED(xget_status) ? WEXITSTATUS(xget_status) : EXIT_FAILURE;
+	if (xget_exit != test->status)
+	{
+	    warnx("%s: expected exit status %d, got %d", test->name, test->status, xget_exit);
+	    failures++;
+	}
+
+	if (xget_exit == 0 && !check_file("file.txt", test->file_size ? test->file_size : 1024))
+	{
+	    warnx("%s: file.txt does not hold what the bot sent", test->name);
+	    failures++;
+	}
+	unlink("file.txt");
     }
 
-    irc_run(&server);
     irc_free(&server);
 
-    int xget_exit;
-    wait(&xget_exit);
-    if (xget_exit == 0) puts("PASS");
-    exit(xget_exit);
-}
\ No newline at end of file
+    if (failures == 0) puts("PASS");
+    exit(failures ? EXIT_FAILURE : EXIT_SUCCESS);
+}
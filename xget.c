@@ -4,18 +4,17 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdint.h>
 #include <err.h>
 #include <time.h>
 #include <assert.h>
-#include <regex.h>
 #include <errno.h>
 #include <getopt.h>
+#include <regex.h>
 #include <pthread.h>
 #include <sys/ioctl.h>
-#include <sys/mman.h>
-#include <fcntl.h>
-#include <libgen.h>
+#include <sys/stat.h>
 
 #include "libircclient/include/libircclient.h"
 #include "xget.h"
@@ -27,145 +26,192 @@
 #define ANSI_CURSOR_SHOW "\x1b[?25h"
 #define ANSI_CURSOR_HIDE "\x1b[?25l"
 
-/*
- * Match Groups:
- * 1. The entire matched string.
- * 2. The scheme ("irc" or "ircs").
- * 3. The hostname or IP address.
- * 4. [optional] The ':' and port number.
- * 5. [optional] The port number.
- * 6. Between one and five channels.
- * 7. The last channel (if more than one).
- */
-#define IRC_URI_REGEX \
-    "(ircs?)://([[:alnum:]\\.-]{3,})" \
-    "(:([0-9]|[1-9][0-9]{1,3}|[1-5][0-9]{4}|6[0-4][0-9]{3}|65[0-4][0-9]{2}|655[0-2][0-9]|6553[0-5]))?" \
-    "/(#[[:alnum:]_-]+(,#[[:alnum:]_-]+){0,4})"
+// The most data threads, or CPUs to pin them to, that --dcc-threads and --dcc-cpus take.
+#define MAX_DCC_THREADS 256
 
-void event_join (irc_session_t *session, const char *event, const char *origin, const char **params, unsigned int count)
+// The state shared between the job's callbacks and the progress-display thread.
+struct progress
 {
-    assert (session);
+    const char *filename;
+    irc_dcc_size_t filesize;
+    irc_dcc_size_t currsize;
+    bool done;
 
-    struct xdccGetConfig *state = irc_get_ctx (session);
+    pthread_mutex_t mutex;
+    pthread_cond_t cv;
 
-    char xdcc_command[24];
-    snprintf (xdcc_command, sizeof xdcc_command, "XDCC SEND #%u", state->pack);
+    // The display is only started for files that take a while to download.
+    pthread_t thread;
+    bool has_thread;
+};
 
-    if ( irc_cmd_msg (session, state->botNick, xdcc_command) )
-    {
-        warnx ("failed to send XDCC command '%s' to nick '%s': %s", xdcc_command, state->botNick, irc_strerror(irc_errno(session)));
-        irc_cmd_quit (session, NULL);
-    }
+void * thread_progress (void *arg);
+
+void on_start (xget_job_t *job, const char *filename, irc_dcc_size_t filesize, bool small_file, void *ctx)
+{
+    struct progress *cfg = ctx;
+
+    pthread_mutex_lock (&cfg->mutex);
+    cfg->filename = filename;
+    cfg->filesize = filesize;
+    pthread_mutex_unlock (&cfg->mutex);
+
+    if ( small_file )
+	return;
+
+    int errnum;
+    if ( (errnum = pthread_create (&cfg->thread, NULL, thread_progress, cfg)) )
+	warnx ("pthread_create: %s", strerror (errnum));
+    else
+	cfg->has_thread = true;
 }
 
-void event_connect (irc_session_t *session, const char *event, const char *origin, const char **params, unsigned int count)
+void on_progress (xget_job_t *job, irc_dcc_size_t currsize, irc_dcc_size_t filesize, void *ctx)
 {
-    assert (session);
+    struct progress *cfg = ctx;
 
-    struct xdccGetConfig *state = irc_get_ctx (session);
-    for ( uint32_t i = 0; i < state->numChannels; i++ )
-    {
-        irc_cmd_join (session, state->channelsToJoin[i], 0);
-    }
+    pthread_mutex_lock (&cfg->mutex);
+    cfg->currsize = currsize;
+    pthread_mutex_unlock (&cfg->mutex);
 }
 
-void callback_dcc_recv_file (irc_session_t *session, irc_dcc_t id, int status, void *addr)
+void on_queue (xget_job_t *job, uint32_t position, uint32_t total, uint32_t eta, void *ctx)
 {
-    assert (session);
+    char of_total[32] = "", remaining[64] = "";
 
-    int nread;
-    struct xdccGetConfig *cfg = irc_get_ctx (session);
+    if ( total )
+	snprintf (of_total, sizeof of_total, " of %" PRIu32, total);
+    if ( eta )
+	snprintf (remaining, sizeof remaining, ", %02" PRIu32 ":%02" PRIu32 ":%02" PRIu32 " remaining",
+		  eta / 3600, eta / 60 % 60, eta % 60);
 
-    if ( status )
-    {
-        warnx ("failed to download file: %s", irc_strerror(status));
-        irc_cmd_quit (session, NULL);
-        return;
-    }
+    printf ("Queued in position %" PRIu32 "%s%s\n", position, of_total, remaining);
+    fflush (stdout);
+}
 
-    if ( (nread = irc_dcc_read (session, id, (char *)addr + cfg->currsize, cfg->filesize - cfg->currsize)) < 0 )
-    {
-	warnx ("irc_dcc_read: socket read error");
-	return;
-    }
+void on_complete (xget_job_t *job, int status, void *ctx)
+{
+    struct progress *cfg = ctx;
 
     pthread_mutex_lock (&cfg->mutex);
-    cfg->currsize += nread;
+    cfg->done = true;
     pthread_mutex_unlock (&cfg->mutex);
+    pthread_cond_signal (&cfg->cv);
 }
 
-void callback_dcc_close (irc_session_t *session, irc_dcc_t id, int status, void *addr)
+void usage (int exit_status)
 {
-    assert (session);
+    fputs ("usage: xget [-A|--no-acknowledge] [-O|--output-document] [-L|--rcvlowat <bytes>] [-T|--tune <profile>] [-b|--bind <address|interface>]...\n"
+	   "            [-R|--request-on <welcome|join|all-joins|msec>] [-a|--sasl <account>] [-C|--no-endpoint-cache] [-F|--fast-open]\n"
+	   "            [-c|--client-cert <file>] [-E|--sasl-external] [-W|--wait-for-bot] [-t|--timeout <phase>=<seconds>]...\n"
+	   "            [-q|--max-queue <position>] [-P|--notice-patterns <file>] [-j|--dcc-threads <count>] [-k|--dcc-cpus <cpu,...>]\n"
+	   "            <uri> <nick> send <pack>\n", stderr);
+    exit (exit_status);
+}
 
-    irc_cmd_quit (session, NULL);
+// Fills path with the path of the named file in xget's XDG cache directory, which is
+// created as needed. Returns NULL if there is no cache directory.
+const char * cache_path (char *path, size_t size, const char *name)
+{
+    const char *base = getenv ("XDG_CACHE_HOME");
+    int len;
+
+    if ( base && *base )
+	len = snprintf (path, size, "%s/xget", base);
+    else if ( (base = getenv ("HOME")) && *base )
+    {
+	snprintf (path, size, "%s/.cache", base);
+	mkdir (path, 0700);
+	len = snprintf (path, size, "%s/.cache/xget", base);
+    }
+    else
+	return NULL;
 
-    struct xdccGetConfig *cfg = irc_get_ctx (session);
+    if ( len < 0 || (size_t) len + strlen (name) + 2 > size || (mkdir (path, 0700) && errno != EEXIST) )
+	return NULL;
 
-    if ( munmap (addr, cfg->filesize) )
-	warn ("munmap");
-    close (cfg->fd);
+    strlcat (path, "/", size);
+    strlcat (path, name, size);
+    return path;
 }
 
-void event_dcc_send_req (irc_session_t *session, const char *nick, const char *addr, const char *filename, irc_dcc_size_t size, irc_dcc_t dccid)
+/*
+ * Reads the notice patterns of a file into cfg, one per line: the kind of notice
+ * (queued, full or denied), a space and a POSIX extended regular expression. In the
+ * queued ones, groups 1, 2 and 3 are the position, the length of the queue and the
+ * time remaining. Empty lines and lines starting with '#' are skipped.
+ */
+void read_notice_patterns (struct xdccGetConfig *cfg, const char *path)
 {
-    assert (session);
-    struct xdccGetConfig *cfg = irc_get_ctx (session);
+    const struct { const char *name; enum xget_notice_kind kind; } kinds[] = {
+	{"queued", XGET_NOTICE_QUEUED},
+	{"full",   XGET_NOTICE_QUEUE_FULL},
+	{"denied", XGET_NOTICE_DENIED},
+    };
+    struct xget_notice_pattern *patterns = NULL;
+    size_t count = 0, size = 0, lineno = 0;
+    char *line = NULL;
+    ssize_t len;
+
+    FILE *fp = fopen (path, "r");
+    if ( !fp )
+	err (EXIT_FAILURE, "%s", path);
 
-    if ( !cfg->has_opt_output_document )
+    while ( (len = getline (&line, &size, fp)) != -1 )
     {
-	// Check that the file's name is only a file name and not a path. DCC senders
-	// should not be sending file paths as file names, and we should not be opening
-	// untrusted files outside the current working directory.
-	if ( strcmp (basename((char *)filename), filename) )
-	{
-	    warnx ("DCC sender sent a file path as the name: '%s'", filename);
-	    irc_cmd_quit (session, NULL);
-	    return;
-	}
-	else
+	lineno++;
+	line[strcspn (line, "\r\n")] = '\0';
+	if ( !*line || *line == '#' )
+	    continue;
+
+	struct xget_notice_pattern pattern = {0};
+	size_t kindlen = strcspn (line, " \t");
+	for ( size_t i = 0; i < sizeof kinds / sizeof *kinds; i++ )
 	{
-	    cfg->filename = strdup(filename);
+	    if ( strlen (kinds[i].name) == kindlen && !strncmp (line, kinds[i].name, kindlen) )
+		pattern.kind = kinds[i].kind;
 	}
-    }
 
-    int fd = open (cfg->filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
-    if ( fd < 0 )
-    {
-        warn ("open");
-        irc_cmd_quit (session, NULL);
-        return;
-    }
+	const char *regex = line + kindlen + strspn (line + kindlen, " \t");
+	if ( !pattern.kind || !*regex )
+	    errx (EXIT_FAILURE, "%s:%zu: expected queued, full or denied and a regular expression", path, lineno);
 
-    // The file must be allocated to its final size in order for the mmap(2) below to succeed.
-    ftruncate (fd, size);
+	regex_t re;
+	int errcode = regcomp (&re, regex, REG_EXTENDED | REG_ICASE);
+	if ( errcode )
+	{
+	    char errbuf[128];
+	    regerror (errcode, &re, errbuf, sizeof errbuf);
+	    errx (EXIT_FAILURE, "%s:%zu: %s", path, lineno, errbuf);
+	}
+	regfree (&re);
 
-    void *maddr = mmap (NULL, size, PROT_WRITE, MAP_SHARED, fd, 0);
-    if ( maddr == MAP_FAILED )
-    {
-	warn ("mmap");
-	irc_cmd_quit (session, NULL);
-	return;
-    }
+	if ( pattern.kind == XGET_NOTICE_QUEUED )
+	{
+	    pattern.position = 1;
+	    pattern.total = 2;
+	    pattern.eta = 3;
+	}
 
-    if ( madvise (maddr, size, MADV_SEQUENTIAL) < 0 )
-    {
-	warn ("madvise");
+	if ( !(patterns = reallocarray (patterns, count + 1, sizeof *patterns)) || !(pattern.regex = strdup (regex)) )
+	    err (EXIT_FAILURE, "%s", path);
+	patterns[count++] = pattern;
     }
 
-    pthread_mutex_lock (&cfg->mutex);
-    cfg->fd = fd;
-    cfg->filesize = size;
-    pthread_mutex_unlock (&cfg->mutex);
-    pthread_cond_signal (&cfg->cv);
+    if ( ferror (fp) )
+	err (EXIT_FAILURE, "%s", path);
 
-    irc_dcc_accept (session, dccid, maddr, callback_dcc_recv_file, callback_dcc_close, !cfg->has_opt_no_acknowledge);
+    free (line);
+    fclose (fp);
+    cfg->notice_patterns = patterns;
+    cfg->num_notice_patterns = count;
 }
 
-void usage (int exit_status)
+void free_notice_patterns (struct xdccGetConfig *cfg)
 {
-    fputs ("usage: xget [-A|--no-acknowledge] [-O|--output-document] <uri> <nick> send <pack>\n", stderr);
-    exit (exit_status);
+    for ( size_t i = 0; i < cfg->num_notice_patterns; i++ )
+	free ((char *) cfg->notice_patterns[i].regex);
+    free ((struct xget_notice_pattern *) cfg->notice_patterns);
 }
 
 char * unit (size_t size)
@@ -181,7 +227,7 @@ char * unit (size_t size)
 
 void * thread_progress (void *arg)
 {
-    struct xdccGetConfig *cfg = arg;
+    struct progress *cfg = arg;
 
     size_t stat_len;
     char line_buffer[1024], stat_buffer[60];
@@ -193,13 +239,16 @@ void * thread_progress (void *arg)
     struct winsize ws;
     ioctl (STDOUT_FILENO, TIOCGWINSZ, &ws);
 
-    // Wait until the download size is known.
+    // Wait until the download size is known, or the job has failed before it began.
     pthread_mutex_lock (&cfg->mutex);
     // Program defensively against spurious wake-ups.
-    while ( !cfg->filesize ) pthread_cond_wait (&cfg->cv, &cfg->mutex);
+    while ( !cfg->filesize && !cfg->done ) pthread_cond_wait (&cfg->cv, &cfg->mutex);
     irc_dcc_size_t total_size = cfg->filesize;
     pthread_mutex_unlock (&cfg->mutex);
 
+    if ( !total_size )
+	return NULL;
+
     size_t name_len = strlen (cfg->filename);
 
     double humanscaled_total_size = total_size;
@@ -208,13 +257,26 @@ void * thread_progress (void *arg)
     irc_dcc_size_t this_size = 0;
     while ( this_size != total_size )
     {
-	sleep (1);
+	// Refresh once a second, or as soon as the job has finished.
+	struct timespec deadline;
+	clock_gettime (CLOCK_REALTIME, &deadline);
+	deadline.tv_sec++;
 
 	pthread_mutex_lock (&cfg->mutex);
+	while ( !cfg->done && pthread_cond_timedwait (&cfg->cv, &cfg->mutex, &deadline) != ETIMEDOUT );
 	irc_dcc_size_t size_delta = cfg->currsize - this_size;
 	this_size = cfg->currsize;
+	bool done = cfg->done;
 	pthread_mutex_unlock (&cfg->mutex);
 
+	// The job has failed part-way through the download.
+	if ( done && this_size != total_size )
+	{
+	    printf (ANSI_TEXT_NORMAL "\n" ANSI_CURSOR_SHOW);
+	    fflush (stdout);
+	    return NULL;
+	}
+
 	int progress_percentage = (this_size * 100) / total_size;
 
 	// Translate the progress percentage relative to the terminal's width (in columns).
@@ -227,7 +289,7 @@ void * thread_progress (void *arg)
 	double humanscaled_size_delta = size_delta;
 	while ( humanscaled_size_delta > 1024 ) humanscaled_size_delta /= 1024;
 
-	int eta = (total_size - this_size) / size_delta;
+	int eta = size_delta ? (total_size - this_size) / size_delta : 0;
 	int eta_hours = eta / 3600;
 	int eta_minutes = (eta - eta_hours * 3600) / 60;
 	int eta_seconds = (eta - eta_hours * 3600) % 60;
@@ -259,7 +321,7 @@ void * thread_progress (void *arg)
     int ttd_minutes = (ttd - ttd_hours * 3600) / 60;
     int ttd_seconds = (ttd - ttd_hours * 3600) % 60;
 
-    size_t avg_throughput = total_size / ttd;
+    size_t avg_throughput = ttd ? total_size / ttd : total_size;
     double humanscaled_avg_throughput = avg_throughput;
     while ( humanscaled_avg_throughput > 1024 ) humanscaled_avg_throughput /= 1024;
 
@@ -287,7 +349,8 @@ void * thread_progress (void *arg)
 
 int main (int argc, char **argv)
 {
-    struct xdccGetConfig cfg = {
+    struct xdccGetConfig cfg = {0};
+    struct progress progress = {
 	    .mutex = PTHREAD_MUTEX_INITIALIZER,
 	    .cv = PTHREAD_COND_INITIALIZER,
     };
@@ -295,13 +358,33 @@ int main (int argc, char **argv)
     const struct option long_options[] = {
 	{"output-document", required_argument, 0, 'O'},
 	{"no-acknowledge",  no_argument,       0, 'A'},
+	{"rcvlowat",        required_argument, 0, 'L'},
+	{"tune",            required_argument, 0, 'T'},
+	{"bind",            required_argument, 0, 'b'},
+	{"request-on",      required_argument, 0, 'R'},
+	{"sasl",            required_argument, 0, 'a'},
+	{"client-cert",     required_argument, 0, 'c'},
+	{"sasl-external",   no_argument,       0, 'E'},
+	{"no-endpoint-cache", no_argument,     0, 'C'},
+	{"fast-open",       no_argument,       0, 'F'},
+	{"wait-for-bot",    no_argument,       0, 'W'},
+	{"timeout",         required_argument, 0, 't'},
+	{"max-queue",       required_argument, 0, 'q'},
+	{"notice-patterns", required_argument, 0, 'P'},
+	{"dcc-threads",     required_argument, 0, 'j'},
+	{"dcc-cpus",        required_argument, 0, 'k'},
 	{"version",         no_argument,       0, 'V'},
 	{"help",            no_argument,       0, 'h'},
 	{NULL,              0,                 0,  0 },
     };
 
+    char endpoint_cache[PATH_MAX], tls_cache[PATH_MAX];
+    bool no_endpoint_cache = false, fast_open = false;
+    unsigned int dcc_threads = 0, dcc_cpu_count = 0;
+    int dcc_cpus[MAX_DCC_THREADS];
+
     int opt;
-    while ( (opt = getopt_long (argc, argv, "O:AVh", long_options, NULL)) != -1 )
+    while ( (opt = getopt_long (argc, argv, "O:AL:T:b:R:a:c:ECFWt:q:P:j:k:Vh", long_options, NULL)) != -1 )
     {
         switch ( opt )
 	{
@@ -312,6 +395,116 @@ int main (int argc, char **argv)
 	    case 'A':
 		cfg.has_opt_no_acknowledge = true;
 		break;
+	    case 'L': {
+		const char *errstr;
+		cfg.rcvlowat = strtonum (optarg, 0, INT32_MAX, &errstr);
+		if ( errstr )
+		    errx (EXIT_FAILURE, "invalid receive watermark: %s", optarg);
+		break;
+	    }
+	    case 'T':
+		if ( xget_tuning_profile (optarg, &cfg.tuning) )
+		    errx (EXIT_FAILURE, "unknown tuning profile: %s (expected default, lfn or low-latency)", optarg);
+		break;
+	    case 'b':
+		if ( !cfg.bind_pool && !(cfg.bind_pool = irc_bind_pool_create (LIBIRC_BIND_LEAST_LOAD)) )
+		    errx (EXIT_FAILURE, "failed to create bind pool");
+		if ( irc_bind_pool_add (cfg.bind_pool, optarg) )
+		    errx (EXIT_FAILURE, "invalid bind address or interface: %s", optarg);
+		break;
+	    case 'R': {
+		const char *errstr;
+		if ( !strcmp (optarg, "welcome") )
+		    cfg.request_trigger = XGET_REQUEST_ON_WELCOME;
+		else if ( !strcmp (optarg, "join") )
+		    cfg.request_trigger = XGET_REQUEST_ON_JOIN;
+		else if ( !strcmp (optarg, "all-joins") )
+		    cfg.request_trigger = XGET_REQUEST_ON_ALL_JOINS;
+		else
+		{
+		    cfg.request_trigger = XGET_REQUEST_AFTER_DELAY;
+		    cfg.request_delay = strtonum (optarg, 0, INT32_MAX, &errstr);
+		    if ( errstr )
+			errx (EXIT_FAILURE, "invalid request trigger: %s (expected welcome, join, all-joins or a delay in milliseconds)", optarg);
+		}
+		break;
+	    }
+	    case 'a':
+		// The password is not taken from the command line, where other users could see it.
+		if ( !(cfg.sasl_password = getenv ("XGET_SASL_PASSWORD")) )
+		    errx (EXIT_FAILURE, "--sasl requires the XGET_SASL_PASSWORD environment variable");
+		cfg.sasl_user = optarg;
+		break;
+	    case 'c':
+		cfg.client_cert = optarg;
+		break;
+	    case 'E':
+		cfg.sasl_external = true;
+		break;
+	    case 'C':
+		no_endpoint_cache = true;
+		break;
+	    case 'F':
+		fast_open = true;
+		break;
+	    case 'W':
+		cfg.presence = XGET_PRESENCE_WAIT;
+		break;
+	    case 't': {
+		const struct { const char *name; uint32_t *deadline; } phases[] = {
+		    {"connect",  &cfg.deadlines.connect},
+		    {"register", &cfg.deadlines.registration},
+		    {"join",     &cfg.deadlines.join},
+		    {"offer",    &cfg.deadlines.offer},
+		    {"idle",     &cfg.deadlines.idle},
+		};
+		const char *errstr = "unknown phase";
+		size_t len = strcspn (optarg, "=");
+		for ( size_t i = 0; i < sizeof phases / sizeof *phases; i++ )
+		{
+		    if ( optarg[len] == '=' && strlen (phases[i].name) == len && !strncmp (optarg, phases[i].name, len) )
+			*phases[i].deadline = strtonum (optarg + len + 1, 0, UINT32_MAX / 1000, &errstr);
+		}
+		if ( errstr )
+		    errx (EXIT_FAILURE, "invalid timeout: %s (expected connect, register, join, offer or idle=<seconds>)", optarg);
+		break;
+	    }
+	    case 'q': {
+		const char *errstr;
+		cfg.max_queue_position = strtonum (optarg, 1, UINT32_MAX, &errstr);
+		if ( errstr )
+		    errx (EXIT_FAILURE, "invalid queue position: %s", optarg);
+		break;
+	    }
+	    case 'P':
+		free_notice_patterns (&cfg);
+		read_notice_patterns (&cfg, optarg);
+		break;
+	    case 'j': {
+		const char *errstr;
+		dcc_threads = strtonum (optarg, 1, MAX_DCC_THREADS, &errstr);
+		if ( errstr )
+		    errx (EXIT_FAILURE, "invalid number of DCC threads: %s", optarg);
+		break;
+	    }
+	    case 'k': {
+		const char *errstr = NULL;
+		char *copy = strdup (optarg), *list = copy, *cpu;
+		if ( !copy )
+		    err (EXIT_FAILURE, "strdup");
+		dcc_cpu_count = 0;
+		while ( !errstr && (cpu = strsep (&list, ",")) )
+		{
+		    if ( dcc_cpu_count == MAX_DCC_THREADS )
+			errstr = "too many";
+		    else
+			dcc_cpus[dcc_cpu_count++] = strtonum (cpu, 0, INT_MAX, &errstr);
+		}
+		free (copy);
+		if ( errstr )
+		    errx (EXIT_FAILURE, "invalid DCC thread CPUs: %s (expected a comma-separated list of CPU numbers)", optarg);
+		break;
+	    }
             case 'V': {
                 unsigned int major, minor;
                 irc_get_version (&major, &minor);
@@ -332,92 +525,74 @@ int main (int argc, char **argv)
     if ( argc != 4 || strcmp (argv[2], "send") )
 	usage (EXIT_FAILURE);
 
-    regex_t re;
-    int regex_errno = regcomp (&re, IRC_URI_REGEX, REG_EXTENDED);
-    assert (0 == regex_errno);
-
-    regmatch_t matches[6];
-    if ( (regex_errno = regexec (&re, argv[0], sizeof matches / sizeof matches[0], matches, 0)) )
-    {
-	assert (REG_NOMATCH == regex_errno);
+    if ( xget_parse_uri (&cfg, argv[0]) )
         usage (EXIT_FAILURE);
-    }
-
-    regfree (&re);
 
-    cfg.is_ircs = matches[1].rm_eo == 4;
+    if ( cfg.sasl_external && (!cfg.client_cert || cfg.sasl_user) )
+	errx (EXIT_FAILURE, "--sasl-external requires --client-cert, and excludes --sasl");
+    if ( cfg.client_cert && !cfg.is_ircs )
+	errx (EXIT_FAILURE, "--client-cert requires an ircs:// URI");
 
-    // Capture the IRC server hostname or IP address. If TLS is to be used, libircclient
-    // requires the hostname to be prepended with a '#' character.
-    if ( cfg.is_ircs ) argv[0][--matches[2].rm_so] = '#';
-    argv[0][matches[2].rm_eo] = '\0';
-    cfg.host = &argv[0][matches[2].rm_so];
+    // Whatever tuning profile is chosen, TCP Fast Open follows -F
+    cfg.tuning.irc.fastopen = fast_open;
 
-    if ( matches[3].rm_so < 0 )
-	cfg.port = cfg.is_ircs ? 6697 : 6667;
-    else
-	// atoi(3) is no longer recommended, but, in this case, I think it's appropriate
-	// because the string has been validated by the regular-expression pattern
-	// and atoi(3) handles mixed-text, like '6667/', better than strtonum(3).
-    	cfg.port = atoi (&argv[0][matches[4].rm_so]);
+    if ( !no_endpoint_cache )
+	cfg.endpoint_cache = cache_path (endpoint_cache, sizeof endpoint_cache, "endpoints");
 
-    cfg.channelsToJoin[0] = &argv[0][matches[5].rm_so];
-    cfg.numChannels = 1;
+    cfg.tls_session_cache = cache_path (tls_cache, sizeof tls_cache, "tls-sessions");
 
-    // If other IRC channels were supplied, capture those as well.
-    char *sep = cfg.channelsToJoin[0];
-    while ( (sep = strchr (sep, ',')) )
+    // The threads without a CPU of their own are left unpinned
+    if ( dcc_threads || dcc_cpu_count )
     {
-	if ( cfg.numChannels >= sizeof cfg.channelsToJoin / sizeof cfg.channelsToJoin[0] ) break;
-	*sep = '\0';
-	cfg.channelsToJoin[cfg.numChannels++] = ++sep;
+	if ( !dcc_threads )
+	    dcc_threads = dcc_cpu_count;
+	for ( unsigned int i = dcc_cpu_count; dcc_cpu_count && i < dcc_threads; i++ )
+	    dcc_cpus[i] = -1;
+	if ( !(cfg.dcc_pool = irc_dcc_pool_create (dcc_threads, dcc_cpu_count ? dcc_cpus : NULL)) )
+	    errx (EXIT_FAILURE, "failed to create DCC pool");
     }
 
     cfg.botNick = argv[1];
-    cfg.pack = strtonum (argv[3], 1, UINT32_MAX, NULL);
-    if ( errno )
+    const char *errstr;
+    cfg.pack = strtonum (argv[3], 1, UINT32_MAX, &errstr);
+    if ( errstr )
 	errx (EXIT_FAILURE, "invalid pack number: %s", argv[3]);
 
-    irc_callbacks_t callbacks = {0};
-    callbacks.event_connect = event_connect;
-    callbacks.event_join = event_join;
-    callbacks.event_dcc_send_req = event_dcc_send_req;
-
-    irc_session_t *session = irc_create_session (&callbacks);
-    if ( !session ) errx (EXIT_FAILURE, "failed to create IRC session object");
-
-    irc_set_ctx (session, &cfg);
-
-    char nick[20];
-    snprintf (nick, sizeof nick, "xget[%d]", getpid());
+    struct xget_callbacks callbacks = {
+	    .on_start = on_start,
+	    .on_progress = on_progress,
+	    .on_complete = on_complete,
+	    .on_queue = on_queue,
+    };
 
-    if ( irc_connect (session, cfg.host, cfg.port, 0, nick, 0, 0) )
-    {
-        irc_destroy_session (session);
-        errx (EXIT_FAILURE, "failed to establish TCP connection to %s:%u: %s", cfg.host, cfg.port, irc_strerror(irc_errno(session)));
-    }
+    xget_job_t *job = xget_job_create (&cfg, &callbacks, &progress);
+    if ( !job ) errx (EXIT_FAILURE, "failed to create IRC session object");
 
-    int errnum;
-    pthread_t display_thread;
-    if ( (errnum = pthread_create (&display_thread, NULL, thread_progress, &cfg)) )
-    {
-	irc_destroy_session (session);
-	errc (EXIT_FAILURE, errnum, "pthread_create: ");
-    }
+    // The job holds its own reference to the pools.
+    irc_bind_pool_destroy (cfg.bind_pool);
+    irc_dcc_pool_destroy (cfg.dcc_pool);
 
-    if ( irc_run (session) )
+    // The exit status is the job's status, so that scripts can tell the failures apart.
+    int status = xget_job_start (job);
+    if ( status )
     {
-        if ( irc_errno (session) != LIBIRC_ERR_TERMINATED && irc_errno (session) != LIBIRC_ERR_CLOSED )
-	{
-            irc_destroy_session (session);
-            errx (EXIT_FAILURE, "failed to start IRC session: %s", irc_strerror(irc_errno(session)));
-        }
+	warnx ("%s", xget_job_strerror (job));
+	xget_job_destroy (job);
+	exit (status);
     }
 
-    irc_destroy_session (session);
+    status = xget_job_run (job);
+    if ( status )
+	warnx ("%s", xget_job_strerror (job));
 
-    if ( (errnum = pthread_join (display_thread, NULL)) )
+    int errnum;
+    if ( progress.has_thread && (errnum = pthread_join (progress.thread, NULL)) )
     {
 	errc (EXIT_FAILURE, errnum, "pthread_join: ");
     }
+
+    xget_job_destroy (job);
+    xget_free_uri (&cfg);
+    free_notice_patterns (&cfg);
+    return status;
 }
@@ -2,10 +2,164 @@
 #define XGET_H
 
 #include <stdbool.h>
-#include <pthread.h>
+#include <stdint.h>
+#include <sys/select.h>
 
 #include "libircclient/include/libircclient.h"
 
+// The status of an xget job, as reported to xget_callbacks.on_complete
+// and returned by xget_job_run().
+enum xget_status
+{
+	XGET_OK = 0,
+
+	// A failure that does not fit any of the categories below.
+	XGET_ERR_FAILURE,
+
+	// The IRC session could not be created or the connection could not be initiated.
+	XGET_ERR_CONNECT,
+
+	// The IRC connection was lost before the transfer began, or could not be made again
+	// during the transfer.
+	XGET_ERR_IRC,
+
+	// The output file could not be created or written.
+	XGET_ERR_FILE,
+
+	// The DCC sender misbehaved or the DCC transfer failed.
+	XGET_ERR_DCC,
+
+	// The job was cancelled with xget_job_cancel().
+	XGET_ERR_CANCELLED,
+
+	// The DCC sender is not online on the IRC network; see xget_presence.
+	XGET_ERR_BOT_OFFLINE,
+
+	// A phase of the job missed its deadline; see xget_deadlines.
+	XGET_ERR_CONNECT_TIMEOUT,
+	XGET_ERR_REGISTER_TIMEOUT,
+	XGET_ERR_JOIN_TIMEOUT,
+	XGET_ERR_OFFER_TIMEOUT,
+	XGET_ERR_IDLE_TIMEOUT,
+
+	// The queue of the DCC sender is full, or the job is queued beyond
+	// cfg.max_queue_position; another DCC sender may serve it sooner.
+	XGET_ERR_QUEUE_FULL,
+
+	// The DCC sender refused the request, for instance for an invalid pack number.
+	XGET_ERR_DENIED,
+};
+
+// The socket options of a job's connections; see irc_set_socket_tuning.
+struct xget_tuning
+{
+	// Applied to the connection to the IRC server.
+	irc_socket_tuning_t irc;
+
+	// Applied to the DCC connections.
+	irc_socket_tuning_t dcc;
+};
+
+// How long each phase of a job may take, in seconds; 0 leaves the phase unbounded.
+// A job that misses a deadline fails with the status of its phase.
+struct xget_deadlines
+{
+	// Resolving the name of the IRC network and connecting to it: XGET_ERR_CONNECT_TIMEOUT.
+	uint32_t connect;
+
+	// From then on, until the IRC server has accepted the registration, including the
+	// TLS handshake and SASL: XGET_ERR_REGISTER_TIMEOUT.
+	uint32_t registration;
+
+	// From then on, until the channels the request waits for have been joined (all of
+	// them with XGET_REQUEST_ON_ALL_JOINS, the first otherwise): XGET_ERR_JOIN_TIMEOUT.
+	uint32_t join;
+
+	// From the XDCC request until the offer of the DCC sender, unless the request gets
+	// queued: XGET_ERR_OFFER_TIMEOUT.
+	uint32_t offer;
+
+	// The longest the transfer may go without receiving any data, from the offer on,
+	// so that this includes connecting to the DCC sender: XGET_ERR_IDLE_TIMEOUT.
+	uint32_t idle;
+};
+
+// When the XDCC request is sent to the DCC sender. It is sent exactly once per job.
+enum xget_request_trigger
+{
+	// Once the first of the IRC channels has been joined.
+	XGET_REQUEST_ON_JOIN = 0,
+
+	// As soon as the IRC server has accepted the registration, without waiting
+	// for the channels to be joined. Only for DCC senders that do not check
+	// that the requester shares a channel with them.
+	XGET_REQUEST_ON_WELCOME,
+
+	// Once all the IRC channels have been joined.
+	XGET_REQUEST_ON_ALL_JOINS,
+
+	// A fixed delay after the IRC server has accepted the registration.
+	XGET_REQUEST_AFTER_DELAY,
+};
+
+// Whether the XDCC request waits for the DCC sender to be online. Its presence is
+// checked with ISON once the IRC server has accepted the registration.
+enum xget_presence
+{
+	// The job fails at once with XGET_ERR_BOT_OFFLINE if the DCC sender is offline.
+	XGET_PRESENCE_REQUIRE = 0,
+
+	// The job waits for the DCC sender to come online, notified by MONITOR where the
+	// IRC server supports it, and by polling with ISON otherwise.
+	XGET_PRESENCE_WAIT,
+
+	// The request is sent without checking.
+	XGET_PRESENCE_IGNORE,
+};
+
+// What a notice of the DCC sender says about the request.
+enum xget_notice_kind
+{
+	// The request has been queued.
+	XGET_NOTICE_QUEUED = 1,
+
+	// The queue is full: the job fails with XGET_ERR_QUEUE_FULL.
+	XGET_NOTICE_QUEUE_FULL,
+
+	// The request is refused: the job fails with XGET_ERR_DENIED.
+	XGET_NOTICE_DENIED,
+};
+
+// Recognises a notice (or message) of the DCC sender. The regex is a POSIX extended
+// regular expression, matched case-insensitively against the text without its mIRC
+// formatting. For XGET_NOTICE_QUEUED, position, total and eta are the numbers of
+// the groups that capture the position in the queue, the length of the queue and the
+// time remaining (such as "1h20m" or "1 hr 20 min"), or 0 where there is none.
+struct xget_notice_pattern
+{
+	enum xget_notice_kind kind;
+	const char *regex;
+	unsigned int position;
+	unsigned int total;
+	unsigned int eta;
+};
+
+// The default size up to which a file is received into memory and written at once.
+#define XGET_SMALL_FILE_SIZE (64 * 1024)
+
+// The default number of seconds before connecting again to an IRC network lost during a
+// transfer, and the longest it grows to.
+#define XGET_RECONNECT_DELAY 2
+#define XGET_RECONNECT_MAX_DELAY 300
+
+// The default pacing of the lines sent to the IRC network: a burst of up to 5 lines,
+// then one every 2 seconds, within the limits of the common IRC servers.
+#define XGET_FLOOD_BURST 5
+#define XGET_FLOOD_INTERVAL 2000
+
+// The default number of seconds the cached addresses of an IRC network are used for.
+#define XGET_ENDPOINT_CACHE_TTL 3600
+
 struct xdccGetConfig
 {
 	// The hostname of the IRC network to connect to.
@@ -17,23 +171,29 @@ struct xdccGetConfig
 	// The nick of the DCC sender.
 	char *botNick;
 
-	// The IRC channels to join.
-	char *channelsToJoin[5];
+	// The IRC channels to join, allocated by xget_parse_uri().
+	char **channelsToJoin;
 
 	// The total number of IRC channels to join.
 	uint32_t numChannels;
 
-	// The name of the DCC file.
+	// The name of the DCC file. Only used if has_opt_output_document is set.
 	char *filename;
 
-	// The size of the DCC file to be sent.
-	irc_dcc_size_t filesize;
+	// [optional] The nick to use on the IRC network. Defaults to "xget[<pid>]";
+	// hosts that run concurrent jobs on the same network should set distinct nicks.
+	char *nick;
 
-	// The current size of the DCC file (as it is being sent).
-	irc_dcc_size_t currsize;
+	// [optional] The account to authenticate as with SASL PLAIN while connecting,
+	// and its password. Some DCC senders only serve identified users.
+	char *sasl_user;
+	char *sasl_password;
 
-	// The file descriptor of the file to be downloaded.
-	int fd;
+	// [optional] The PEM file holding the TLS client certificate and its key, sent to
+	// ircs:// networks (see irc_set_ssl_client_cert). With sasl_external, the account
+	// is identified with it through SASL EXTERNAL instead of sasl_user.
+	const char *client_cert;
+	bool sasl_external;
 
 	// The requested pack number.
 	uint32_t pack;
@@ -41,12 +201,163 @@ struct xdccGetConfig
 	// True if the URI begins with 'ircs://'.
 	bool is_ircs;
 
+	// [optional] The DCC receive watermark in bytes (see irc_set_dcc_rcvlowat); 0 keeps
+	// the one of the tuning profile.
+	uint32_t rcvlowat;
+
+	// [optional] The socket options; see xget_tuning_profile(). Zeroed keeps the system defaults.
+	struct xget_tuning tuning;
+
+	// [optional] When to send the XDCC request; XGET_REQUEST_ON_JOIN by default.
+	enum xget_request_trigger request_trigger;
+
+	// [optional] The delay in milliseconds for XGET_REQUEST_AFTER_DELAY.
+	uint32_t request_delay;
+
+	// [optional] Whether the request waits for the DCC sender to be online;
+	// XGET_PRESENCE_REQUIRE by default.
+	enum xget_presence presence;
+
+	// [optional] The deadlines of the phases of the job; all unbounded by default.
+	struct xget_deadlines deadlines;
+
+	// [optional] If the connection to the IRC network is lost during the transfer, the
+	// transfer goes on and the job connects again after reconnect_delay seconds, doubling
+	// the delay after every failed attempt up to reconnect_max_delay (see irc_set_reconnect);
+	// 0 uses XGET_RECONNECT_DELAY and XGET_RECONNECT_MAX_DELAY. Losing it before the
+	// transfer fails the job with XGET_ERR_IRC.
+	uint32_t reconnect_delay;
+	uint32_t reconnect_max_delay;
+
+	// [optional] The lines sent to the IRC network go in bursts of up to flood_burst
+	// lines, then one every flood_interval milliseconds, so that the network does not
+	// drop the connection for flooding (see irc_set_flood_control); 0 uses
+	// XGET_FLOOD_BURST and XGET_FLOOD_INTERVAL.
+	uint32_t flood_burst;
+	uint32_t flood_interval;
+
+	// [optional] Patterns for the notices of the DCC sender, tried before the built-in
+	// ones, which know iroffer and iroffer-dinoex.
+	const struct xget_notice_pattern *notice_patterns;
+	uint32_t num_notice_patterns;
+
+	// [optional] The job gives up with XGET_ERR_QUEUE_FULL, and leaves the queue, once
+	// queued beyond this position; 0 waits in any position. While the job is queued,
+	// the offer deadline does not apply.
+	uint32_t max_queue_position;
+
+	// [optional] Files up to this size are received into memory and written with a
+	// single write(2) once complete, rather than mapped. 0 uses XGET_SMALL_FILE_SIZE.
+	uint32_t small_file_size;
+
+	// [optional] The local addresses to bind the connections to (see irc_bind_pool_create).
+	// Hosts running concurrent jobs should share one pool, so that the jobs are spread
+	// across its addresses.
+	irc_bind_pool_t *bind_pool;
+
+	// [optional] The data threads that receive the file, with their number and the CPUs
+	// they are pinned to (see irc_dcc_pool_create). Hosts running concurrent jobs should
+	// share one pool, so that the transfers are spread across its threads; without one,
+	// each job receives on an unpinned thread of its own.
+	irc_dcc_pool_t *dcc_pool;
+
+	// [optional] The file in which the addresses of the IRC networks and how fast they
+	// connected are kept (see irc_set_endpoint_cache), and for how many seconds the
+	// addresses are used before the hostname is resolved again; 0 uses
+	// XGET_ENDPOINT_CACHE_TTL.
+	const char *endpoint_cache;
+	uint32_t endpoint_cache_ttl;
+
+	// [optional] The file in which the TLS sessions of ircs:// networks are kept, so
+	// that the next job resumes them with an abbreviated handshake (see
+	// irc_set_tls_session_cache).
+	const char *tls_session_cache;
+
 	bool has_opt_no_acknowledge;
 	bool has_opt_output_document;
+};
+
+typedef struct xget_job xget_job_t;
+
+// Callbacks through which a job reports its progress to the host. Any of them may
+// be NULL. They are all invoked from the thread that drives the job, even when the
+// file is received on libircclient's DCC data thread.
+struct xget_callbacks
+{
+	// Called once the offer of the DCC sender has been accepted. The output file is
+	// created concurrently with the DCC connection, so it may not exist yet. small_file
+	// tells whether the file is within cfg.small_file_size, and received into memory.
+	void (*on_start) (xget_job_t *job, const char *filename, irc_dcc_size_t filesize, bool small_file, void *ctx);
+
+	// Called as the file is received. Chunks that arrive close together may be
+	// reported by a single call.
+	void (*on_progress) (xget_job_t *job, irc_dcc_size_t currsize, irc_dcc_size_t filesize, void *ctx);
 
-	// Synchronization primitives to safely share this struct between threads.
-	pthread_mutex_t mutex;
-	pthread_cond_t cv;
+	// Called exactly once, when the job has succeeded or failed.
+	void (*on_complete) (xget_job_t *job, int status, void *ctx);
+
+	// Called every time the DCC sender reports the place of the request in its queue.
+	// total and eta (in seconds) are 0 where the DCC sender did not tell them.
+	void (*on_queue) (xget_job_t *job, uint32_t position, uint32_t total, uint32_t eta, void *ctx);
 };
 
+// Parses an 'irc[s]://HOSTNAME[:PORT]/#CHANNEL[,#CHANNEL...]' URI into cfg. The URI
+// string is modified in place and cfg points into it, so it must outlive cfg.
+// Returns 0 on success and -1 if the URI is malformed or out of memory. Any number
+// of channels may be given; release them with xget_free_uri() once done with cfg.
+int xget_parse_uri (struct xdccGetConfig *cfg, char *uri);
+
+// Frees the channel list allocated by xget_parse_uri().
+void xget_free_uri (struct xdccGetConfig *cfg);
+
+// Fills tuning with the named profile: "default" keeps the system defaults, "lfn"
+// suits long fat networks (large receive buffer, BBR, immediate acknowledgements)
+// and "low-latency" favours the response time over the CPU usage (busy polling).
+// Returns 0 on success and -1 if the profile is unknown.
+int xget_tuning_profile (const char *name, struct xget_tuning *tuning);
+
+// Creates a job to download cfg->pack from cfg->botNick. The strings referenced by
+// cfg are not copied and must outlive the job. Returns NULL if out of memory, or if
+// one of cfg->notice_patterns is not a valid regular expression.
+xget_job_t * xget_job_create (const struct xdccGetConfig *cfg, const struct xget_callbacks *callbacks, void *ctx);
+
+// Initiates the connection to the IRC network. Returns XGET_OK or XGET_ERR_CONNECT.
+// The host name is resolved in the background, so a name that does not resolve
+// or a network that cannot be reached may also fail the job later with
+// XGET_ERR_CONNECT.
+int xget_job_start (xget_job_t *job);
+
+// Adds the job's descriptors to the given sets, for hosts that drive many jobs
+// from a single select(2) loop. Returns nonzero if the job is no longer running.
+int xget_job_add_select_descriptors (xget_job_t *job, fd_set *in_set, fd_set *out_set, int *maxfd);
+
+// Processes the job's descriptors after select(2) has returned. Returns nonzero
+// once the job is no longer running; its status is then final.
+int xget_job_process_select_descriptors (xget_job_t *job, fd_set *in_set, fd_set *out_set);
+
+// Returns the number of milliseconds the host's select(2) may block before the
+// job has to be processed again even if no descriptor is ready, or -1 for no limit.
+int xget_job_next_timeout (xget_job_t *job);
+
+// Drives a started job until it has finished, and returns its status.
+int xget_job_run (xget_job_t *job);
+
+// Requests that the job be cancelled. Safe to call from any thread; the job
+// completes with XGET_ERR_CANCELLED the next time its descriptors are processed.
+// Returns XGET_ERR_FAILURE, with errno set, if the thread that drives the job could
+// not be woken up; the job is still cancelled once that thread processes it.
+int xget_job_cancel (xget_job_t *job);
+
+// Returns the status of the job: XGET_OK until it has failed.
+int xget_job_status (xget_job_t *job);
+
+// Returns a human-readable description of the job's failure.
+const char * xget_job_strerror (xget_job_t *job);
+
+// Returns the ctx pointer given to xget_job_create().
+void * xget_job_get_ctx (xget_job_t *job);
+
+// Closes any open connections and files and frees the job.
+void xget_job_destroy (xget_job_t *job);
+
 #endif //XGET_H